@@ -0,0 +1,82 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* bench-append: Measure sequential append throughput.
+ *
+ * Appends <size> MiB to a new file in <write-size> byte writes, and reports
+ * the time taken and the throughput.  Run it on a mounted RefFS to compare
+ * file storage changes.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+#include <mcfs/errnoname.h>
+#include <time.h>
+#include <vector>
+#include "common.h"
+
+static double elapsed(const struct timespec &start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: %s <file> [<size-MiB> [<write-size>]]\n", argv[0]);
+        exit(1);
+    }
+    size_t total = ((argc > 2) ? strtoull(argv[2], nullptr, 10) : 1024) << 20;
+    size_t wsize = (argc > 3) ? strtoull(argv[3], nullptr, 10) : 4096;
+    if (total == 0 || wsize == 0) {
+        fprintf(stderr, "Size and write size must be positive\n");
+        exit(1);
+    }
+
+    int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", argv[1], errnoname(errno));
+        exit(2);
+    }
+    std::vector<char> buf(wsize, 'x');
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t done = 0;
+    while (done < total) {
+        ssize_t n = write(fd, buf.data(), std::min(wsize, total - done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "Cannot write %s at %zu: %s\n", argv[1], done,
+                    errnoname(n < 0 ? errno : EIO));
+            exit(2);
+        }
+        done += n;
+    }
+    double secs = elapsed(start);
+    close(fd);
+    unlink(argv[1]);
+    printf("appended %zu MiB in %zu byte writes: %.3f s, %.1f MiB/s\n",
+           total >> 20, wsize, secs, (total >> 20) / secs);
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* bench-write: Measure the throughput of large overwrites.
+ *
+ * Writes <size> MiB to a new file once, then overwrites it <passes> times
+ * in <write-size> byte writes (1 MiB by default), and reports the time
+ * taken by the overwrites, which allocate nothing.  Run it on a RefFS
+ * mounted with and without -o splice_read to compare write data that is
+ * spliced and copied once, by write_buf, with data read into a buffer
+ * by libfuse first.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+#include <mcfs/errnoname.h>
+#include <time.h>
+#include <vector>
+#include "common.h"
+
+static double elapsed(const struct timespec &start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void write_file(int fd, const char *path, const std::vector<char> &buf, size_t total) {
+    size_t done = 0;
+    while (done < total) {
+        ssize_t n = pwrite(fd, buf.data(), std::min(buf.size(), total - done), done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "Cannot write %s at %zu: %s\n", path, done,
+                    errnoname(n < 0 ? errno : EIO));
+            exit(2);
+        }
+        done += n;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr, "Usage: %s <file> [<size-MiB> [<write-size> [<passes>]]]\n", argv[0]);
+        exit(1);
+    }
+    size_t total = ((argc > 2) ? strtoull(argv[2], nullptr, 10) : 256) << 20;
+    size_t wsize = (argc > 3) ? strtoull(argv[3], nullptr, 10) : 1 << 20;
+    size_t passes = (argc > 4) ? strtoull(argv[4], nullptr, 10) : 8;
+    if (total == 0 || wsize == 0 || passes == 0) {
+        fprintf(stderr, "Size, write size and passes must be positive\n");
+        exit(1);
+    }
+
+    int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", argv[1], errnoname(errno));
+        exit(2);
+    }
+    std::vector<char> buf(wsize, 'x');
+    write_file(fd, argv[1], buf, total);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < passes; ++i)
+        write_file(fd, argv[1], buf, total);
+    double secs = elapsed(start);
+    close(fd);
+    unlink(argv[1]);
+    size_t mib = (total >> 20) * passes;
+    printf("overwrote %zu MiB in %zu byte writes: %.3f s, %.1f MiB/s\n",
+           mib, wsize, secs, mib / secs);
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* bench-zero: Compare the cost of is_zero() with that of memcpy().
+ *
+ * Scans a <size> MiB buffer of zeros (64 MiB by default) <passes> times a
+ * chunk at a time, as writes do to leave zero chunks as holes, then copies
+ * it as many times, and reports the throughput of each.  The scan should
+ * take a fraction of the copy it saves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "zero_scan.hpp"
+
+static const size_t kChunkSize = 4096;
+
+static double elapsed(const struct timespec &start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 3) {
+        fprintf(stderr, "Usage: %s [<size-MiB> [<passes>]]\n", argv[0]);
+        exit(1);
+    }
+    size_t total = ((argc > 1) ? strtoull(argv[1], nullptr, 10) : 64) << 20;
+    size_t passes = (argc > 2) ? strtoull(argv[2], nullptr, 10) : 16;
+    if (total == 0 || passes == 0) {
+        fprintf(stderr, "Size and passes must be positive\n");
+        exit(1);
+    }
+
+    /* Both buffers are touched first, so that no page faults are timed */
+    std::vector<char> src(total, 0);
+    std::vector<char> dst(total, 1);
+    size_t mib = (total >> 20) * passes;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t zero = 0;
+    for (size_t i = 0; i < passes; ++i) {
+        for (size_t off = 0; off < total; off += kChunkSize)
+            zero += is_zero(src.data() + off, std::min(kChunkSize, total - off));
+    }
+    double scan = elapsed(start);
+    if (zero != passes * ((total + kChunkSize - 1) / kChunkSize)) {
+        fprintf(stderr, "is_zero() missed zero chunks\n");
+        exit(2);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < passes; ++i) {
+        memcpy(dst.data(), src.data(), total);
+        /* Keep the copies from being merged */
+        __asm__ __volatile__("" : : "r"(dst.data()) : "memory");
+    }
+    double copy = elapsed(start);
+
+    printf("is_zero (%s): %zu MiB in %.3f s, %.1f MiB/s\n",
+           is_zero_impl(), mib, scan, mib / scan);
+    printf("memcpy: %zu MiB in %.3f s, %.1f MiB/s\n", mib, copy, mib / copy);
+    printf("scan/copy: %.2f\n", scan / copy);
+    return 0;
+}
@@ -0,0 +1,258 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#include "chunk_pool.hpp"
+
+std::mutex ChunkPool::s_mutex;
+std::vector<char *> ChunkPool::s_free;
+std::vector<char *> ChunkPool::s_released;
+std::unordered_map<char *, size_t> ChunkPool::s_shares;
+char *ChunkPool::s_slab = nullptr;
+char *ChunkPool::s_slabEnd = nullptr;
+size_t ChunkPool::s_anonSize = 0;
+int ChunkPool::s_backFd = -1;
+size_t ChunkPool::s_backAfter = 0;
+char *ChunkPool::s_backBase = nullptr;
+char *ChunkPool::s_backEnd = nullptr;
+std::atomic<uint64_t> ChunkPool::s_packedChunks(0);
+std::atomic<uint64_t> ChunkPool::s_packedBytes(0);
+std::atomic<uint64_t> ChunkPool::s_compressed(0);
+std::atomic<uint64_t> ChunkPool::s_decompressed(0);
+
+/* Compressed copies are kept only if they save a quarter of the chunk */
+static const size_t kMaxPacked = ChunkPool::kChunkSize / 4 * 3;
+
+char *ChunkPool::Get() {
+    std::lock_guard<std::mutex> lk(s_mutex);
+    std::vector<char *> &list = s_free.empty() ? s_released : s_free;
+    if (!list.empty()) {
+        char *chunk = list.back();
+        list.pop_back();
+        return chunk;
+    }
+    if (s_slab == s_slabEnd) {
+        char *slab = NewSlab();
+        if (slab == nullptr)
+            return nullptr;
+        s_slab = slab;
+        s_slabEnd = s_slab + kSlabSize;
+    }
+    char *chunk = s_slab;
+    s_slab += kChunkSize;
+    return chunk;
+}
+
+char *ChunkPool::GetZeroed() {
+    char *chunk = Get();
+    if (chunk != nullptr)
+        memset(chunk, 0, kChunkSize);
+    return chunk;
+}
+
+void ChunkPool::Put(char *chunk) {
+    if (chunk == nullptr)
+        return;
+    std::lock_guard<std::mutex> lk(s_mutex);
+    s_free.push_back(chunk);
+    if (s_free.size() >= 2 * kMaxFree)
+        Release(kMaxFree);
+}
+
+void ChunkPool::Share(char *chunk) {
+    std::lock_guard<std::mutex> lk(s_mutex);
+    s_shares[chunk]++;
+}
+
+void ChunkPool::Share(char *const *chunks, size_t count) {
+    std::lock_guard<std::mutex> lk(s_mutex);
+    for (size_t i = 0; i < count; ++i)
+        s_shares[chunks[i]]++;
+}
+
+void ChunkPool::PutShared(char *chunk) {
+    {
+        std::lock_guard<std::mutex> lk(s_mutex);
+        auto it = s_shares.find(chunk);
+        if (it != s_shares.end()) {
+            if (--it->second == 0)
+                s_shares.erase(it);
+            return;
+        }
+    }
+    Put(chunk);
+}
+
+bool ChunkPool::Own(char *chunk) {
+    std::lock_guard<std::mutex> lk(s_mutex);
+    return s_shares.count(chunk) == 0;
+}
+
+/* NewSlab: Map a slab from the backing file if it is past the threshold
+ * and the blocks for the slab can be allocated in the file (writing to
+ * the mapping must not fail for want of space later), or else from
+ * anonymous memory.  Returns nullptr if neither can be had.  Called with
+ * s_mutex held. */
+char *ChunkPool::NewSlab() {
+    if (s_backFd >= 0 && s_anonSize >= s_backAfter &&
+        s_backEnd < s_backBase + kMaxBacked) {
+        off_t off = s_backEnd - s_backBase;
+        if (fallocate(s_backFd, 0, off, kSlabSize) == 0 &&
+            mmap(s_backEnd, kSlabSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, s_backFd, off) != MAP_FAILED) {
+            char *slab = s_backEnd;
+            s_backEnd += kSlabSize;
+            return slab;
+        }
+    }
+    void *slab = mmap(nullptr, kSlabSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED)
+        return nullptr;
+    s_anonSize += kSlabSize;
+    return (char *) slab;
+}
+
+bool ChunkPool::IsBacked(const char *chunk) {
+    return chunk >= s_backBase && chunk < s_backEnd;
+}
+
+int ChunkPool::SetBacking(const char *dir, size_t threshold) {
+    std::lock_guard<std::mutex> lk(s_mutex);
+    if (s_backFd >= 0)
+        return EBUSY;
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return errno;
+    /* Reserve the address space, so that the slabs are where they are in
+     * the file */
+    void *base = mmap(nullptr, kMaxBacked, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    s_backFd = fd;
+    s_backAfter = threshold;
+    s_backBase = s_backEnd = (char *) base;
+    return 0;
+}
+
+/* Release: Return the pages of all but keep free chunks to the system, a
+ * run of adjacent chunks at a time.  In the backing file, the blocks are
+ * kept but zeroed, which drops the pages without writing them back.
+ * Called with s_mutex held. */
+void ChunkPool::Release(size_t keep) {
+    if (s_free.size() <= keep)
+        return;
+    std::sort(s_free.begin() + keep, s_free.end());
+    for (size_t i = keep; i < s_free.size(); ) {
+        bool backed = IsBacked(s_free[i]);
+        size_t j = i + 1;
+        while (j < s_free.size() && s_free[j] == s_free[j - 1] + kChunkSize &&
+               IsBacked(s_free[j]) == backed)
+            ++j;
+        if (backed)
+            fallocate(s_backFd, FALLOC_FL_KEEP_SIZE | FALLOC_FL_ZERO_RANGE,
+                      s_free[i] - s_backBase, (j - i) * kChunkSize);
+        else
+            madvise(s_free[i], (j - i) * kChunkSize, MADV_DONTNEED);
+        i = j;
+    }
+    s_released.insert(s_released.end(), s_free.begin() + keep, s_free.end());
+    s_free.resize(keep);
+}
+
+void ChunkPool::Trim() {
+    std::lock_guard<std::mutex> lk(s_mutex);
+    Release(0);
+}
+
+/* A compressed copy is its length, then the zlib stream */
+static uint32_t packed_len(const char *packed) {
+    uint32_t len;
+    memcpy(&len, packed, sizeof(len));
+    return len;
+}
+
+char *ChunkPool::Compress(const char *chunk) {
+    Bytef buf[kChunkSize];
+    uLongf len = sizeof(buf);
+    if (compress2(buf, &len, (const Bytef *) chunk, kChunkSize, Z_BEST_SPEED) != Z_OK ||
+        len > kMaxPacked)
+        return nullptr;
+    char *packed = (char *) malloc(sizeof(uint32_t) + len);
+    if (packed == nullptr)
+        return nullptr;
+    uint32_t len32 = len;
+    memcpy(packed, &len32, sizeof(len32));
+    memcpy(packed + sizeof(len32), buf, len);
+    s_packedChunks++;
+    s_packedBytes += sizeof(len32) + len;
+    s_compressed++;
+    return packed;
+}
+
+void ChunkPool::Decompress(const char *packed, char *chunk) {
+    uLongf len = kChunkSize;
+    int res = uncompress((Bytef *) chunk, &len, (const Bytef *) packed + sizeof(uint32_t),
+                         packed_len(packed));
+    assert(res == Z_OK && len == kChunkSize);
+    (void) res;
+    s_decompressed++;
+}
+
+char *ChunkPool::CopyCompressed(const char *packed) {
+    size_t size = sizeof(uint32_t) + packed_len(packed);
+    char *copy = (char *) malloc(size);
+    if (copy == nullptr)
+        return nullptr;
+    memcpy(copy, packed, size);
+    s_packedChunks++;
+    s_packedBytes += size;
+    return copy;
+}
+
+void ChunkPool::PutCompressed(char *packed) {
+    s_packedChunks--;
+    s_packedBytes -= sizeof(uint32_t) + packed_len(packed);
+    free(packed);
+}
+
+void ChunkPool::CompressionStats(uint64_t &chunks, uint64_t &bytes,
+                                 uint64_t &compressed, uint64_t &decompressed) {
+    chunks = s_packedChunks;
+    bytes = s_packedBytes;
+    compressed = s_compressed;
+    decompressed = s_decompressed;
+}
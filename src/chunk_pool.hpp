@@ -0,0 +1,126 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CHUNK_POOL_HPP_
+#define _CHUNK_POOL_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/* ChunkPool: Fixed-size, page-aligned chunks that file contents are kept
+ * in.
+ *
+ * Chunks are carved out of kSlabSize mappings, which are never unmapped;
+ * freed chunks are kept for reuse.  Once there are twice kMaxFree free
+ * chunks, the pages of all but kMaxFree are returned to the system (they
+ * read as zeros when reused), so memory goes back as files shrink.
+ *
+ * With a backing file (SetBacking()), the slabs past a threshold are
+ * shared mappings of that file rather than anonymous memory: the page
+ * cache keeps the chunks in use in memory and writes the others back to
+ * the file, so file contents can outgrow memory.
+ *
+ * A chunk may be shared by files copied with VERIFS_COPY_RANGE, and by
+ * files and their copies in checkpoints and snapshots.  Holders
+ * of a shared chunk must not write to it unless Own() says they are the
+ * only one left, and drop it with PutShared() instead of Put().
+ *
+ * Chunks of files that have gone cold may be replaced by compressed copies
+ * (see FuseRamFs::SetCompression()).  Those are malloc()ed, not pooled,
+ * and have a single holder each.
+ */
+class ChunkPool {
+public:
+    static const size_t kChunkSize = 4096;
+    static const size_t kSlabSize = 2 << 20;
+    static const size_t kMaxFree = 4096;
+
+    /* A chunk with undefined contents, or nullptr if out of memory */
+    static char *Get();
+    /* A chunk filled with zeros, or nullptr if out of memory */
+    static char *GetZeroed();
+    static void Put(char *chunk);
+    /* Add a holder to a chunk */
+    static void Share(char *chunk);
+    /* Add a holder to each of count chunks */
+    static void Share(char *const *chunks, size_t count);
+    /* Drop a holder of a chunk, freeing it with the last one */
+    static void PutShared(char *chunk);
+    /* True if there is a single holder of the chunk */
+    static bool Own(char *chunk);
+    /* Return the pages of every free chunk to the system */
+    static void Trim();
+    /* Map the slabs handed out past the first threshold bytes from an
+     * unnamed file in directory dir.  Returns 0 or an error number. */
+    static int SetBacking(const char *dir, size_t threshold);
+
+    /* A compressed copy of a chunk, or nullptr if it does not compress
+     * well enough to be worth keeping, or we are out of memory */
+    static char *Compress(const char *chunk);
+    /* Decompress a compressed copy into chunk */
+    static void Decompress(const char *packed, char *chunk);
+    /* Another compressed copy, or nullptr if out of memory */
+    static char *CopyCompressed(const char *packed);
+    static void PutCompressed(char *packed);
+    /* Compressed copies held now and the bytes they take, and how many
+     * chunks have been compressed and decompressed */
+    static void CompressionStats(uint64_t &chunks, uint64_t &bytes,
+                                 uint64_t &compressed, uint64_t &decompressed);
+
+private:
+    /* Address space reserved for the slabs in the backing file */
+    static const size_t kMaxBacked = (size_t) 1 << 40;
+
+    static char *NewSlab();
+    static bool IsBacked(const char *chunk);
+    static void Release(size_t keep);
+
+    static std::mutex s_mutex;
+    /* Free chunks that still have their pages, and ones that do not */
+    static std::vector<char *> s_free;
+    static std::vector<char *> s_released;
+    /* Holders beyond the first of shared chunks; others have one */
+    static std::unordered_map<char *, size_t> s_shares;
+    /* The rest of the last slab, not handed out yet */
+    static char *s_slab;
+    static char *s_slabEnd;
+    /* Bytes of anonymous slabs mapped */
+    static size_t s_anonSize;
+    /* The backing file, or -1; slabs are mapped from it once s_anonSize
+     * reaches s_backAfter, at s_backBase up to s_backEnd, which is where
+     * they are in the file */
+    static int s_backFd;
+    static size_t s_backAfter;
+    static char *s_backBase;
+    static char *s_backEnd;
+    static std::atomic<uint64_t> s_packedChunks;
+    static std::atomic<uint64_t> s_packedBytes;
+    static std::atomic<uint64_t> s_compressed;
+    static std::atomic<uint64_t> s_decompressed;
+};
+
+#endif // _CHUNK_POOL_HPP_
@@ -41,6 +41,8 @@
 #include <atomic>
 #include <algorithm>
 #include <unordered_map>
+#include <thread>
+#include <condition_variable>
 
 #include <cstdio>
 #include <cstdlib>
@@ -27,6 +27,8 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+#include <stdint.h>
+#include <limits.h>
 #include <sys/ioctl.h>
 
 #define VERIFS2_IOC_CODE    '1'
@@ -34,17 +36,153 @@ extern "C" {
 #define VERIFS2_IOC(n)      _IO(VERIFS2_IOC_CODE, VERIFS2_IOC_NO(n))
 #define VERIFS2_GET_IOC(n, type)  _IOR(VERIFS2_IOC_CODE, VERIFS2_IOC_NO(n), type)
 #define VERIFS2_SET_IOC(n, type)  _IOW(VERIFS2_IOC_CODE, VERIFS2_IOC_NO(n), type)
+#define VERIFS2_GETSET_IOC(n, type)  _IOWR(VERIFS2_IOC_CODE, VERIFS2_IOC_NO(n), type)
 
 #define VERIFS_CHECKPOINT  VERIFS2_IOC(1)
 #define VERIFS_RESTORE     VERIFS2_IOC(2)
 
-// the PICKLE and LOAD should receive a parameter of `struct verifs_str` which
-// contains the path to the output / input file.
+// Legacy PICKLE and LOAD: the path to the output / input file is read from
+// VERIFS_PICKLE_CFG / VERIFS_LOAD_CFG.  Use VERIFS_PICKLE_ARG and
+// VERIFS_LOAD_ARG instead, which do not share a file between instances.
 #define VERIFS_PICKLE      VERIFS2_IOC(3)
 #define VERIFS_LOAD        VERIFS2_IOC(4)
+// same as LOAD, but file contents are read from the image on first access
+#define VERIFS_LOAD_LAZY   VERIFS2_IOC(5)
 #define VERIFS_PICKLE_CFG  "/tmp/pickle.cfg"
 #define VERIFS_LOAD_CFG    "/tmp/pickle.cfg"
 
+#define VERIFS_IMAGE_ARG_VERSION    1
+
+// flags of struct verifs_image_arg
+#define VERIFS_IMAGE_LAZY           (1U << 0)   // LOAD: read file contents on first access
+#define VERIFS_IMAGE_ASYNC          (1U << 1)   // PICKLE: pickle in the background
+#define VERIFS_IMAGE_NOVERIFY       (1U << 2)   // LOAD: skip the hash check (trusted images)
+// PICKLE: write only what changed since the last image pickled;
+// LOAD: path holds a chain of images, base first, each NUL-terminated and
+// the last followed by an empty string
+#define VERIFS_IMAGE_DELTA          (1U << 3)
+// PICKLE, LOAD: read or write image files with O_DIRECT, around the page cache
+#define VERIFS_IMAGE_DIRECT         (1U << 4)
+#define VERIFS_IMAGE_FLAGS_V1       (VERIFS_IMAGE_LAZY | VERIFS_IMAGE_ASYNC | \
+                                     VERIFS_IMAGE_NOVERIFY | VERIFS_IMAGE_DELTA | \
+                                     VERIFS_IMAGE_DIRECT)
+
+// Argument of VERIFS_PICKLE_ARG, VERIFS_LOAD_ARG and VERIFS_AUTO_PICKLE,
+// passed in the ioctl payload.  New fields are only ever added before `path`,
+// together with a new version number, so that older callers keep working.
+struct verifs_image_arg {
+    uint32_t version;       // VERIFS_IMAGE_ARG_VERSION
+    uint32_t flags;         // VERIFS_IMAGE_*
+    uint64_t interval_ms;   // AUTO_PICKLE: period, or 0 to stop; otherwise 0
+    uint64_t reserved;      // must be zero
+    char path[PATH_MAX];    // NUL-terminated path to the output / input file
+};
+
+// Result of VERIFS_PICKLE_STATUS.  Counters cover all pickles: synchronous,
+// background (VERIFS_IMAGE_ASYNC) and periodic ones.
+struct verifs_pickle_status {
+    uint32_t version;           // VERIFS_IMAGE_ARG_VERSION
+    uint32_t running;           // 1 if a background pickle is in progress
+    int32_t last_error;         // errno of the last finished pickle, or 0
+    uint32_t auto_enabled;      // 1 if periodic pickling is on
+    uint64_t started;           // pickles started
+    uint64_t completed;         // pickles finished, successfully or not
+    uint64_t failed;            // pickles finished with an error
+    uint64_t last_duration_us;  // wall time of the last finished pickle
+    // loaded images copied into memory because they could not be leased
+    // (see lease_error), or because their file was about to change
+    uint64_t images_copied;
+    uint64_t images_detached;
+    int32_t lease_error;        // errno of the last image that could not be leased
+    uint32_t reserved;
+};
+
+// Argument of VERIFS_EXPORT_STATE and VERIFS_IMPORT_STATE.  The image holds
+// the checkpoint as its live file system and no state pool, so it can also
+// be loaded with VERIFS_LOAD_ARG.
+struct verifs_state_arg {
+    uint32_t version;       // VERIFS_IMAGE_ARG_VERSION
+    uint32_t flags;         // EXPORT: VERIFS_IMAGE_DIRECT;
+                            // IMPORT: VERIFS_IMAGE_LAZY, _NOVERIFY, _DIRECT
+    uint64_t key;           // key of the checkpoint in the state pool
+    uint64_t reserved;      // must be zero
+    char path[PATH_MAX];    // NUL-terminated path to the output / input file
+};
+
+#define VERIFS_PICKLE_ARG     VERIFS2_SET_IOC(6, struct verifs_image_arg)
+#define VERIFS_LOAD_ARG       VERIFS2_SET_IOC(7, struct verifs_image_arg)
+#define VERIFS_PICKLE_STATUS  VERIFS2_GET_IOC(8, struct verifs_pickle_status)
+// pickle to `path` every `interval_ms` in the background; 0 stops
+#define VERIFS_AUTO_PICKLE    VERIFS2_SET_IOC(9, struct verifs_image_arg)
+// write checkpoint `key` to an image; the live file system is not touched
+#define VERIFS_EXPORT_STATE   VERIFS2_SET_IOC(10, struct verifs_state_arg)
+// load the live file system of an image as checkpoint `key`, which must not
+// exist yet; the live file system is not touched
+#define VERIFS_IMPORT_STATE   VERIFS2_SET_IOC(11, struct verifs_state_arg)
+
+// Argument and result of VERIFS_SEEK, which is issued on an open regular
+// file and does what lseek(2) with SEEK_DATA or SEEK_HOLE does on other file
+// systems (FUSE 2 does not pass those on).
+struct verifs_seek_arg {
+    int64_t offset;         // in: where to start; out: the data or hole found
+    uint32_t whence;        // SEEK_DATA or SEEK_HOLE
+    uint32_t reserved;      // must be zero
+};
+
+// fails with ENXIO if offset is at or past the end of the file, or there
+// is no data after it (SEEK_DATA)
+#define VERIFS_SEEK           VERIFS2_GETSET_IOC(12, struct verifs_seek_arg)
+
+// Argument and result of VERIFS_COPY_RANGE, which is issued on the open
+// regular file to copy into and does what copy_file_range(2), or with
+// VERIFS_COPY_CLONE what the FICLONERANGE ioctl, does on other file systems
+// (FUSE 2 passes neither on).  Whole chunks are shared by the two files
+// until either changes them.  As the source is named by inode number, not
+// path, copying from another file fails with EPERM unless the caller is
+// root or has CAP_DAC_READ_SEARCH, as for open_by_handle_at(2).
+struct verifs_copy_range_arg {
+    uint64_t src_ino;       // inode number of the file to copy from
+    int64_t src_offset;
+    int64_t dst_offset;
+    uint64_t length;        // in: bytes to copy, 0 for up to the end of the
+                            // source; out: bytes copied
+    uint32_t flags;         // VERIFS_COPY_*
+    uint32_t reserved;      // must be zero
+};
+
+// fail with EINVAL instead of copying what cannot be shared: the offsets
+// must be multiples of 4096, as must the length unless the range reaches
+// the end of the source and of the destination
+#define VERIFS_COPY_CLONE     (1U << 0)
+
+// the ranges may not overlap if the files are the same
+#define VERIFS_COPY_RANGE     VERIFS2_GETSET_IOC(13, struct verifs_copy_range_arg)
+
+// Argument of VERIFS_COMPRESS.  Chunks of files that have not been read or
+// written for idle_ms are compressed in memory by a background thread, and
+// decompressed as they are next accessed.
+struct verifs_compress_arg {
+    uint32_t version;       // VERIFS_IMAGE_ARG_VERSION
+    uint32_t flags;         // must be zero
+    uint64_t idle_ms;       // 0 stops compressing; compressed chunks stay so
+    uint64_t reserved;      // must be zero
+};
+
+// Result of VERIFS_COMPRESS_STATUS.  Chunks are 4096 bytes, so the ratio of
+// compression is chunks * 4096 / compressed_bytes.
+struct verifs_compress_status {
+    uint32_t version;           // VERIFS_IMAGE_ARG_VERSION
+    uint32_t enabled;           // 1 if cold chunks are being compressed
+    uint64_t idle_ms;           // as set with VERIFS_COMPRESS
+    uint64_t chunks;            // compressed chunks held now
+    uint64_t compressed_bytes;  // memory they take
+    uint64_t compressed;        // chunks compressed so far
+    uint64_t decompressed;      // chunks decompressed so far
+};
+
+#define VERIFS_COMPRESS         VERIFS2_SET_IOC(14, struct verifs_compress_arg)
+#define VERIFS_COMPRESS_STATUS  VERIFS2_GET_IOC(15, struct verifs_compress_status)
+
 #ifdef __cplusplus
 }
 #endif
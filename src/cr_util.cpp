@@ -37,6 +37,28 @@ void print_ino_queue(std::queue<fuse_ino_t> DeletedInodes);
 
 std::unordered_map<uint64_t, verifs2_state> state_pool;
 
+/* copy_inode: Copy an inode of any type.
+ *
+ * @return: the copy, or nullptr if the inode's class does not match its
+ * mode.
+ */
+Inode *copy_inode(Inode *inode) {
+    mode_t mode = inode->GetMode();
+    if (S_ISREG(mode)) {
+        File *file = dynamic_cast<File *>(inode);
+        return file ? new File(*file) : nullptr;
+    } else if (S_ISDIR(mode)) {
+        Directory *dir = dynamic_cast<Directory *>(inode);
+        return dir ? new Directory(*dir) : nullptr;
+    } else if (S_ISLNK(mode)) {
+        SymLink *link = dynamic_cast<SymLink *>(inode);
+        return link ? new SymLink(*link) : nullptr;
+    } else {
+        SpecialInode *special = dynamic_cast<SpecialInode *>(inode);
+        return special ? new SpecialInode(*special) : nullptr;
+    }
+}
+
 int insert_state(uint64_t key,
                  const std::tuple<std::vector<Inode *>, std::queue<fuse_ino_t>,
                          struct statvfs> &fs_states_vec) {
@@ -82,7 +104,9 @@ void clear_states() {
 
 void dump_File(File* file)
 {
-  PRINT_VAL((char*)(file->m_buf));
+  std::string contents(file->Size(), '\0');
+  file->Read(&contents[0], contents.size(), 0);
+  PRINT_VAL(contents);
 }
 
 void dump_Directory(Directory* dir)
@@ -100,7 +124,7 @@ void dump_SpecialInode(SpecialInode* sinode)
 
 void dump_SymLink(SymLink* symlink)
 {
-  PRINT_VAL(symlink->m_link);
+  PRINT_VAL(symlink->Link());
 }
 
 
@@ -33,6 +33,8 @@
 
 typedef std::tuple<std::vector<Inode *>, std::queue<fuse_ino_t>, struct statvfs> verifs2_state;
 
+Inode *copy_inode(Inode *inode);
+
 int insert_state(uint64_t key, const verifs2_state &fs_states_vec);
 
 verifs2_state find_state(uint64_t key);
@@ -27,6 +27,7 @@
 #include "inode.hpp"
 #include "directory.hpp"
 #include "fuse_cpp_ramfs.hpp"
+#include "serializer.hpp"
 
 using namespace std;
 std::unordered_map<off_t, Directory::ReadDirCtx *> Directory::readdirStates;
@@ -241,78 +242,33 @@ bool Directory::IsEmpty() {
     return true;
 }
 
+/* Directory record: the inode record, then the number of children and for
+ * each child its inode number and name */
+template <class Archive>
+void Directory::Serialize(Archive &ar) {
+    Inode::Serialize(ar);
+    ar.Sequence(m_children, [&](auto &child) {
+        ar.Varint(child.second);
+        ar.String(child.first);
+    });
+}
+
 size_t Directory::GetPickledSize() {
-    size_t res = Inode::GetPickledSize();
-    // the number of children
-    res += sizeof(size_t);
-    // iterate children
-    for (auto & it : m_children) {
-        // inode number
-        res += sizeof(fuse_ino_t);
-        // name length field
-        res += sizeof(size_t);
-        // size of file name
-        res += it.first.size();
-    }
-    return res;
+    PickleSizer sizer;
+    Serialize(sizer);
+    return sizer.Size();
 }
 
-size_t Directory::Pickle(void* &buf) {
-    if (buf == nullptr) {
-        buf = malloc(Directory::GetPickledSize());
-    }
-    if (buf == nullptr) {
-        return 0;
-    }
-    size_t offset = Inode::Pickle(buf);
-    char *ptr = (char *)buf + offset;
-    // store the number of children in this directory
-    size_t nchildren = m_children.size();
-    memcpy(ptr, &nchildren, sizeof(nchildren));
-    ptr += sizeof(nchildren);
-    // iterate children and store
-    for (auto & it : m_children) {
-        // store inode number
-        fuse_ino_t ino = it.second;
-        memcpy(ptr, &ino, sizeof(ino));
-        ptr += sizeof(ino);
-        // store the length of the file name
-        size_t namelen = it.first.size();
-        memcpy(ptr, &namelen, sizeof(namelen));
-        ptr += sizeof(namelen);
-        // store the name string
-        memcpy(ptr, it.first.c_str(), namelen);
-        ptr += namelen;
-    }
-    return ptr - (char *)buf;
+void Directory::Pickle(PickleWriter &out) {
+    Serialize(out);
 }
 
-size_t Directory::Load(const void* &buf) {
-    size_t offset = Inode::Load(buf);
-    const char *ptr = (const char *)buf + offset;
-    // get the number of children in the directory
-    size_t nchildren;
-    memcpy(&nchildren, ptr, sizeof(nchildren));
-    ptr += sizeof(nchildren);
-    m_children.clear();
-    // iterate the list and load the children
-    for (size_t i = 0; i < nchildren; ++i) {
-        // load inode number
-        fuse_ino_t ino;
-        memcpy(&ino, ptr, sizeof(ino));
-        ptr += sizeof(ino);
-        // load the length of the name
-        size_t namelen;
-        memcpy(&namelen, ptr, sizeof(namelen));
-        ptr += sizeof(namelen);
-        // load the string itself
-        std::string name(ptr, namelen);
-        ptr += namelen;
-        // add children to this Directory object
-        m_children.push_back(std::make_pair(name, ino));
-    }
-    return ptr - (char *)buf;
+void Directory::Load(PickleReader &in) {
+    Serialize(in);
+    if (in.Error() != 0)
+        ClearXAttrs();
 }
+
 std::vector<std::pair<std::string, fuse_ino_t>>::iterator Directory::find(const string& name) {
     return std::find_if(m_children.begin(), m_children.end(),
               [&](const auto& child) { return child.first == name; });
@@ -77,9 +77,10 @@ public:
      * Mainly intended for readdir() method. */
     const std::vector<std::pair<std::string, fuse_ino_t>> &Children() { return m_children; }
 
+    template <class Archive> void Serialize(Archive &ar);
     size_t GetPickledSize();
-    size_t Pickle(void* &buf);
-    size_t Load(const void* &buf);
+    void Pickle(PickleWriter &out);
+    void Load(PickleReader &in);
 
     std::shared_mutex& DirLock() { return childrenRwSem; }
     #ifdef DUMP_TESTING
@@ -27,43 +27,718 @@
 #include "inode.hpp"
 #include "fuse_cpp_ramfs.hpp"
 #include "file.hpp"
+#include "serializer.hpp"
+#include "zero_scan.hpp"
+#include <limits>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+static const size_t kChunkSize = ChunkPool::kChunkSize;
+/* st_blocks of a chunk */
+static const size_t kChunkBlocks = kChunkSize / Inode::BufBlockSize;
+/* What holes read as */
+static const char kZeroChunk[kChunkSize] = {};
+/* Marks chunks in m_chunks that may be shared with other files (see
+ * ChunkPool); they are copied before they are changed */
+static const uintptr_t kSharedBit = 1;
+/* Marks chunks in m_chunks replaced by a compressed copy (see Pack());
+ * they are decompressed before they are read or changed in place */
+static const uintptr_t kPackedBit = 2;
+
+static bool is_shared(const char *chunk) {
+    return (uintptr_t) chunk & kSharedBit;
+}
+
+static bool is_packed(const char *chunk) {
+    return (uintptr_t) chunk & kPackedBit;
+}
+
+static char *chunk_data(char *chunk) {
+    return (char *) ((uintptr_t) chunk & ~(kSharedBit | kPackedBit));
+}
+
+static void put_chunk(char *chunk) {
+    if (is_packed(chunk))
+        ChunkPool::PutCompressed(chunk_data(chunk));
+    else if (is_shared(chunk))
+        ChunkPool::PutShared(chunk_data(chunk));
+    else
+        ChunkPool::Put(chunk);
+}
+
+/* Replace a compressed chunk by the chunk it holds.  Returns 0 or
+ * ENOMEM. */
+static int unpack_chunk(char *&chunk) {
+    char *data = ChunkPool::Get();
+    if (data == nullptr)
+        return ENOMEM;
+    ChunkPool::Decompress(chunk_data(chunk), data);
+    ChunkPool::PutCompressed(chunk_data(chunk));
+    chunk = data;
+    return 0;
+}
+
+/* Decompress the compressed chunks among [first, last).  Their contents
+ * stay the same, so this may be done with the range locked shared: the
+ * compressed copies are only read with the chunk vector locked.  Returns
+ * 0 or ENOMEM. */
+static int unpack_chunks(std::vector<char *> &chunks, size_t first, size_t last) {
+    for (size_t i = first; i < std::min(last, chunks.size()); ++i) {
+        if (chunks[i] != nullptr && is_packed(chunks[i]) && unpack_chunk(chunks[i]) != 0)
+            return ENOMEM;
+    }
+    return 0;
+}
+
+static bool has_packed(const std::vector<char *> &chunks, size_t first, size_t last) {
+    for (size_t i = first; i < std::min(last, chunks.size()); ++i) {
+        if (chunks[i] != nullptr && is_packed(chunks[i]))
+            return true;
+    }
+    return false;
+}
+
+/* Copy n bytes at in of a chunk out to buf; holes read as zeros */
+static void copy_chunk(char *chunk, size_t in, size_t n, char *buf) {
+    if (chunk == nullptr) {
+        memset(buf, 0, n);
+    } else if (is_packed(chunk)) {
+        char data[kChunkSize];
+        ChunkPool::Decompress(chunk_data(chunk), data);
+        memcpy(buf, data + in, n);
+    } else {
+        memcpy(buf, chunk_data(chunk) + in, n);
+    }
+}
+
+/* Make a chunk of the file writable, copying it if other files still
+ * share it, or decompressing it.  Returns 0 or ENOMEM. */
+static int own_chunk(char *&chunk) {
+    if (is_packed(chunk))
+        return unpack_chunk(chunk);
+    if (!is_shared(chunk))
+        return 0;
+    char *data = chunk_data(chunk);
+    if (!ChunkPool::Own(data)) {
+        char *copy = ChunkPool::Get();
+        if (copy == nullptr)
+            return ENOMEM;
+        memcpy(copy, data, kChunkSize);
+        ChunkPool::PutShared(data);
+        data = copy;
+    }
+    chunk = data;
+    return 0;
+}
+
+/* Detach: Move the mapping into anonymous memory, at the same address so
+ * that the files referring into it need not know */
+int MappedImage::Detach() {
+    void *copy = mmap(nullptr, m_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy == MAP_FAILED)
+        return errno;
+    memcpy(copy, m_addr, m_len);
+    if (mprotect(copy, m_len, PROT_READ) != 0 ||
+        mremap(copy, m_len, m_len, MREMAP_MAYMOVE | MREMAP_FIXED, m_addr) == MAP_FAILED) {
+        int err = errno;
+        munmap(copy, m_len);
+        return err;
+    }
+    return 0;
+}
+
+/* Detach: Copy the image into a memfd, and put that in place of the image
+ * under the same descriptor */
+int ImageFile::Detach() {
+    struct stat st;
+    if (fstat(m_fd, &st) != 0)
+        return errno;
+    int copy = memfd_create("reffs-image", MFD_CLOEXEC);
+    if (copy < 0)
+        return errno;
+    off_t off = 0;
+    while (off < st.st_size) {
+        ssize_t n = sendfile(copy, m_fd, &off, st.st_size - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            int err = n < 0 ? errno : EIO;
+            close(copy);
+            return err;
+        }
+    }
+    int err = dup3(copy, m_fd, O_CLOEXEC) < 0 ? errno : 0;
+    close(copy);
+    return err;
+}
+
+File::File(const File &f) : Inode(f), m_inlineUsed(f.m_inlineUsed), m_imageData(nullptr),
+m_lazyOffset(0), m_lazy(false), m_lastAccess(0), m_version(f.m_version.load()) {
+    memcpy(m_inline, f.m_inline, kInlineSize);
+    /* Contents still in the state image are read-only, so share them */
+    if (f.m_lazy) {
+        m_lazyImage = f.m_lazyImage;
+        m_lazyOffset = f.m_lazyOffset;
+        m_lazy = true;
+        return;
+    }
+    if (f.m_image) {
+        m_imageData = f.m_imageData;
+        m_image = f.m_image;
+        return;
+    }
+    /* The chunks are shared with f until either changes them, so that
+     * checkpoints and snapshots copy no data; compressed ones are copied,
+     * as they have a single holder.  f keeps its contents, but its chunks
+     * are tagged as shared, with its chunk vector locked as copies of one
+     * file may be made in parallel. */
+    File &src = const_cast<File &>(f);
+    std::unique_lock<std::shared_mutex> lk(src.m_chunksRwSem);
+    std::vector<char *> shared;
+    m_chunks.reserve(src.m_chunks.size());
+    for (char *&chunk : src.m_chunks) {
+        if (chunk == nullptr) {
+            m_chunks.push_back(nullptr);
+        } else if (is_packed(chunk)) {
+            char *copy = ChunkPool::CopyCompressed(chunk_data(chunk));
+            if (!copy){
+                std::cerr << "malloc failed for File copy constructor\n";
+                exit(EXIT_FAILURE);
+            }
+            m_chunks.push_back((char *) ((uintptr_t) copy | kPackedBit));
+        } else {
+            chunk = (char *) ((uintptr_t) chunk | kSharedBit);
+            shared.push_back(chunk_data(chunk));
+            m_chunks.push_back(chunk);
+        }
+    }
+    ChunkPool::Share(shared.data(), shared.size());
+}
+
+uint64_t File::NextVersion() {
+    static std::atomic<uint64_t> versions(0);
+    return ++versions;
+}
 
 File::~File() {
-    free(m_buf);
+    for (char *chunk : m_chunks) {
+        if (chunk != nullptr)
+            put_chunk(chunk);
+    }
 }
 
-int File::FileTruncate(size_t newSize) {
-    size_t newBlocks = get_nblocks(newSize, File::BufBlockSize);
-    size_t oldBlocks = Inode::UsedBlocks();
-    size_t oldSize = Inode::Size();
+/* Allocate count chunks with undefined contents into chunks; on failure,
+ * none are.  Returns 0 or ENOMEM. */
+static int get_chunks(std::vector<char *> &chunks, size_t count) {
+    chunks.reserve(chunks.size() + count);
+    for (size_t i = 0; i < count; ++i) {
+        char *chunk = ChunkPool::Get();
+        if (chunk == nullptr) {
+            while (i-- > 0) {
+                ChunkPool::Put(chunks.back());
+                chunks.pop_back();
+            }
+            return ENOMEM;
+        }
+        chunks.push_back(chunk);
+    }
+    return 0;
+}
+
+/* Free chunks; returns how many there were (holes do not count) */
+static size_t free_chunks(std::vector<char *> &chunks) {
+    size_t count = 0;
+    for (char *chunk : chunks) {
+        if (chunk != nullptr) {
+            put_chunk(chunk);
+            count++;
+        }
+    }
+    chunks.clear();
+    return count;
+}
 
-    if (!FuseRamFs::CheckHasSpaceFor(this, newSize - oldSize)) {
-        return -ENOSPC;
+/* Count the holes among chunks [first, last), and the chunks that are
+ * shared or compressed, which own_chunk() must see to before they change */
+static size_t count_holes(const std::vector<char *> &chunks, size_t first, size_t last,
+                          size_t *unowned = nullptr) {
+    size_t count = (last > chunks.size()) ? last - std::max(first, chunks.size()) : 0;
+    for (size_t i = first; i < std::min(last, chunks.size()); ++i) {
+        if (chunks[i] == nullptr)
+            count++;
+        else if (unowned && (is_shared(chunks[i]) || is_packed(chunks[i])))
+            ++*unowned;
     }
+    return count;
+}
 
-    /* Realloc if needed */
-    if (newBlocks != oldBlocks) {
-        void *newbuf = realloc(m_buf, newBlocks * File::BufBlockSize);
-        if (newbuf == nullptr && newBlocks > 0) {
-            /* Probably because newsize exceeds limit;
-             * return EINVAL in this case */
-            return EINVAL;
+/* Zero the bytes past len in the last of the chunks holding len bytes,
+ * which must not be shared */
+static void zero_tail(std::vector<char *> &chunks, size_t len) {
+    size_t last = len / kChunkSize;
+    if (len % kChunkSize != 0 && last < chunks.size() && chunks[last] != nullptr)
+        memset(chunks[last] + len % kChunkSize, 0, kChunkSize - len % kChunkSize);
+}
+
+/* Drop the chunks that are all zeros, leaving holes; returns how many are
+ * left */
+static size_t punch_zero_chunks(std::vector<char *> &chunks) {
+    size_t count = 0;
+    for (auto &chunk : chunks) {
+        if (chunk == nullptr)
+            continue;
+        if (is_zero(chunk, kChunkSize)) {
+            ChunkPool::Put(chunk);
+            chunk = nullptr;
+        } else {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Copy len bytes of data into new chunks, leaving holes where the data is
+ * all zeros.  Returns 0 or ENOMEM. */
+static int fill_chunks(std::vector<char *> &chunks, const char *data, size_t len) {
+    size_t count = get_nblocks(len, kChunkSize);
+    chunks.assign(count, nullptr);
+    for (size_t i = 0; i < count; ++i) {
+        size_t start = i * kChunkSize;
+        size_t n = std::min(kChunkSize, len - start);
+        if (is_zero(data + start, n))
+            continue;
+        chunks[i] = ChunkPool::Get();
+        if (chunks[i] == nullptr) {
+            free_chunks(chunks);
+            return ENOMEM;
+        }
+        memcpy(chunks[i], data + start, n);
+    }
+    zero_tail(chunks, len);
+    return 0;
+}
+
+/* Read len bytes at off from an image; returns 0 or an error number */
+static int read_image(int fd, char *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = pread(fd, buf + done, len - done, off + done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return (res < 0) ? errno : EIO;
+        done += res;
+    }
+    return 0;
+}
+
+/* Read len bytes at off from an image into chunks, IOV_MAX chunks per
+ * call; returns 0 or an error number */
+static int read_image_chunks(int fd, std::vector<char *> &chunks, size_t len, off_t off) {
+    struct iovec iov[IOV_MAX];
+    size_t done = 0;
+    while (done < len) {
+        int n = 0;
+        for (size_t pos = done; pos < len && n < IOV_MAX; ++n) {
+            size_t in = pos % kChunkSize;
+            iov[n].iov_base = chunks[pos / kChunkSize] + in;
+            iov[n].iov_len = std::min(kChunkSize - in, len - pos);
+            pos += iov[n].iov_len;
+        }
+        ssize_t res = preadv(fd, iov, n, off + done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return (res < 0) ? errno : EIO;
+        done += res;
+    }
+    return 0;
+}
+
+/* Copy the data in bufv into iov: from memory with memcpy(), and from a
+ * pipe or file with a readv() per IOV_MAX pieces rather than a read() per
+ * piece.  Stops at a short read unless the buffer says to retry.  Returns
+ * the number of bytes copied, or a negative error code if none were. */
+static ssize_t copy_bufvec(std::vector<struct iovec> &iov, struct fuse_bufvec *bufv) {
+    size_t done = 0;
+    size_t i = 0;
+    int err = 0;
+    while (i < iov.size() && bufv->idx < bufv->count) {
+        struct fuse_buf *buf = &bufv->buf[bufv->idx];
+        size_t left = buf->size - bufv->off;
+        if (left == 0) {
+            bufv->idx++;
+            bufv->off = 0;
+            continue;
+        }
+        size_t want;
+        ssize_t n;
+        if (!(buf->flags & FUSE_BUF_IS_FD)) {
+            want = n = std::min(left, iov[i].iov_len);
+            memcpy(iov[i].iov_base, (char *) buf->mem + bufv->off, n);
+        } else {
+            /* Read no more than is left of this buffer */
+            int cnt = 0;
+            want = 0;
+            while (i + cnt < iov.size() && cnt < IOV_MAX && want < left)
+                want += iov[i + cnt++].iov_len;
+            struct iovec &lastIov = iov[i + cnt - 1];
+            size_t lastLen = lastIov.iov_len;
+            if (want > left) {
+                lastIov.iov_len -= want - left;
+                want = left;
+            }
+            if (buf->flags & FUSE_BUF_FD_SEEK)
+                n = preadv(buf->fd, &iov[i], cnt, buf->pos + bufv->off);
+            else
+                n = readv(buf->fd, &iov[i], cnt);
+            lastIov.iov_len = lastLen;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                err = (n < 0) ? errno : 0;
+                break;
+            }
+        }
+
+        done += n;
+        bufv->off += n;
+        if (bufv->off == buf->size) {
+            bufv->idx++;
+            bufv->off = 0;
+        }
+        for (size_t rest = n; rest > 0; ) {
+            size_t k = std::min(rest, iov[i].iov_len);
+            iov[i].iov_base = (char *) iov[i].iov_base + k;
+            iov[i].iov_len -= k;
+            rest -= k;
+            if (iov[i].iov_len == 0)
+                i++;
+        }
+        if ((size_t) n < want && !(buf->flags & FUSE_BUF_FD_RETRY))
+            break;
+    }
+    if (done == 0 && err != 0)
+        return -err;
+    return done;
+}
+
+/* Point iov at [off, end) of chunks, with holes reading from a chunk of
+ * zeros.  If there are no chunks, the first inlineSize bytes are at
+ * inlineData. */
+static void chunk_iov(const std::vector<char *> &chunks, const char *inlineData,
+                      size_t inlineSize, size_t off, size_t end,
+                      std::vector<struct iovec> &iov) {
+    iov.reserve(get_nblocks(end, kChunkSize) - off / kChunkSize + 1);
+    for (size_t pos = off; pos < end; ) {
+        size_t idx = pos / kChunkSize;
+        size_t in = pos % kChunkSize;
+        size_t n = std::min(kChunkSize - in, end - pos);
+        const char *chunk = (idx < chunks.size() && chunks[idx] != nullptr) ?
+                            chunk_data(chunks[idx]) : kZeroChunk;
+        if (chunks.empty() && pos < inlineSize) {
+            chunk = inlineData;
+            n = std::min(inlineSize - pos, n);
         }
-        if (newBlocks == 0) {
-            newbuf = nullptr;
+        iov.push_back({(void *) (chunk + in), n});
+        pos += n;
+    }
+}
+
+/* SetChunks: Take chunks, holding the contents that were in the state
+ * image, and account for them: st_blocks now counts them instead of what
+ * the image said.  Called with m_lazyMutex held. */
+void File::SetChunks(std::vector<char *> &chunks, size_t count) {
+    std::unique_lock<std::shared_mutex> chunksLk(m_chunksRwSem);
+    m_chunks.swap(chunks);
+    m_imageData = nullptr;
+    m_image.reset();
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    ssize_t blocks = count * kChunkBlocks;
+    FuseRamFs::UpdateUsedBlocks(blocks - m_fuseEntryParam.attr.st_blocks);
+    m_fuseEntryParam.attr.st_blocks = blocks;
+}
+
+/* SetInline: Like SetChunks(), for contents that fit inline.  Called with
+ * m_lazyMutex held. */
+void File::SetInline(const char *data, size_t len) {
+    std::unique_lock<std::shared_mutex> chunksLk(m_chunksRwSem);
+    memcpy(m_inline, data, len);
+    memset(m_inline + len, 0, kInlineSize - len);
+    m_inlineUsed = !is_zero(m_inline, kInlineSize);
+    m_imageData = nullptr;
+    m_image.reset();
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    ssize_t blocks = m_inlineUsed ? 1 : 0;
+    FuseRamFs::UpdateUsedBlocks(blocks - m_fuseEntryParam.attr.st_blocks);
+    m_fuseEntryParam.attr.st_blocks = blocks;
+}
+
+/* UpdateInline: Count the block of the inline contents in st_blocks if
+ * they hold any data now.  Called with m_chunksRwSem held exclusively. */
+void File::UpdateInline() {
+    bool used = m_chunks.empty() && !is_zero(m_inline, kInlineSize);
+    if (used == m_inlineUsed)
+        return;
+    m_inlineUsed = used;
+    ssize_t blocks = used ? 1 : -1;
+    FuseRamFs::UpdateUsedBlocks(blocks);
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    m_fuseEntryParam.attr.st_blocks += blocks;
+}
+
+/* Spill: Move the inline contents into a chunk, before the file needs
+ * chunks.  m_inline is left as it is, as readers of the first chunk may
+ * still be copying from it.  Called with m_chunksRwSem held exclusively.
+ *
+ * @return: 0, or ENOSPC or ENOMEM.
+ */
+int File::Spill() {
+    if (!m_chunks.empty())
+        return 0;
+    char *chunk = nullptr;
+    if (m_inlineUsed) {
+        if (!FuseRamFs::CheckHasSpaceFor(nullptr, kChunkSize - Inode::BufBlockSize))
+            return ENOSPC;
+        chunk = ChunkPool::Get();
+        if (chunk == nullptr)
+            return ENOMEM;
+        memcpy(chunk, m_inline, kInlineSize);
+        memset(chunk + kInlineSize, 0, kChunkSize - kInlineSize);
+    }
+    m_chunks.push_back(chunk);
+    UpdateInline();
+    if (chunk != nullptr) {
+        FuseRamFs::UpdateUsedBlocks(kChunkBlocks);
+        std::unique_lock<std::shared_mutex> lk(entryRwSem);
+        m_fuseEntryParam.attr.st_blocks += kChunkBlocks;
+    }
+    return 0;
+}
+
+/* Materialize: Read the contents of a lazily loaded file from the image.
+ *
+ * @return: 0 on success, or a negative error code.
+ */
+int File::Materialize() {
+    if (!m_lazy)
+        return 0;
+
+    std::lock_guard<std::mutex> lk(m_lazyMutex);
+    if (!m_lazy)
+        return 0;
+    size_t fsize = Size();
+    int res;
+    if (fsize <= kInlineSize) {
+        char data[kInlineSize];
+        res = read_image(m_lazyImage->Fd(), data, fsize, m_lazyOffset);
+        if (res != 0)
+            return -res;
+        SetInline(data, fsize);
+        m_lazyImage.reset();
+        m_lazy = false;
+        return 0;
+    }
+    std::vector<char *> chunks;
+    if (get_chunks(chunks, get_nblocks(fsize, kChunkSize)) != 0)
+        return -ENOMEM;
+    res = read_image_chunks(m_lazyImage->Fd(), chunks, fsize, m_lazyOffset);
+    if (res != 0) {
+        free_chunks(chunks);
+        return -res;
+    }
+    zero_tail(chunks, fsize);
+    SetChunks(chunks, punch_zero_chunks(chunks));
+    m_lazyImage.reset();
+    m_lazy = false;
+    return 0;
+}
+
+/* Unshare: Copy the file contents out of the state image before the
+ * first modification.
+ *
+ * @return: 0 on success, or a negative error code if the chunks cannot be
+ * allocated or filled.
+ */
+int File::Unshare() {
+    if (m_lazy)
+        return Materialize();
+    {
+        std::shared_lock<std::shared_mutex> lk(m_chunksRwSem);
+        if (!m_image)
+            return 0;
+    }
+
+    std::lock_guard<std::mutex> lk(m_lazyMutex);
+    if (!m_image)
+        return 0;
+    size_t fsize = Size();
+    if (fsize <= kInlineSize) {
+        SetInline(m_imageData, fsize);
+        return 0;
+    }
+    std::vector<char *> chunks;
+    if (fill_chunks(chunks, m_imageData, fsize) != 0)
+        return -ENOMEM;
+    size_t count = chunks.size() - std::count(chunks.begin(), chunks.end(), nullptr);
+    SetChunks(chunks, count);
+    return 0;
+}
+
+/* CopyOut: Copy size bytes at off, which must be within the file, out of
+ * the chunks, the inline contents or the state image */
+void File::CopyOut(char *buf, size_t size, off_t off) {
+    if (m_image) {
+        memcpy(buf, m_imageData + off, size);
+        return;
+    }
+    if (m_chunks.empty()) {
+        size_t n = ((size_t) off < kInlineSize) ? std::min(kInlineSize - off, size) : 0;
+        memcpy(buf, m_inline + off, n);
+        memset(buf + n, 0, size - n);
+        return;
+    }
+    while (size > 0) {
+        size_t idx = off / kChunkSize;
+        size_t in = off % kChunkSize;
+        size_t n = std::min(kChunkSize - in, size);
+        copy_chunk(idx < m_chunks.size() ? m_chunks[idx] : nullptr, in, n, buf);
+        buf += n;
+        off += n;
+        size -= n;
+    }
+}
+
+ssize_t File::Read(char *buf, size_t size, off_t off) {
+    int res = Materialize();
+    if (res != 0)
+        return res;
+    size_t fsize = m_fuseEntryParam.attr.st_size;
+    if (off < 0 || (size_t) off >= fsize)
+        return 0;
+    size = std::min(size, fsize - off);
+    CopyOut(buf, size, off);
+    return size;
+}
+
+/* Seek: Find the next data or hole at or after off, for SEEK_DATA and
+ * SEEK_HOLE.  There is a hole at the end of the file.  Contents still in
+ * the state image count as data.
+ *
+ * @return: The offset found, or -ENXIO if off is past the end of the file
+ * or there is no data after it.
+ */
+off_t File::Seek(off_t off, int whence) {
+    std::shared_lock<std::shared_mutex> lk(m_chunksRwSem);
+    off_t fsize = Size();
+    if (off < 0 || off >= fsize)
+        return -ENXIO;
+    if (m_lazy || m_image)
+        return (whence == SEEK_DATA) ? off : fsize;
+    /* Inline contents count as the first chunk.  Chunks past the end may
+     * have been allocated with KEEP_SIZE. */
+    size_t count = std::min(m_chunks.empty() && m_inlineUsed ? 1 : m_chunks.size(),
+                            get_nblocks(fsize, kChunkSize));
+    for (size_t i = off / kChunkSize; i < count; ++i) {
+        bool data = m_chunks.empty() || m_chunks[i] != nullptr;
+        if (data == (whence == SEEK_DATA))
+            return std::max(off, (off_t) (i * kChunkSize));
+    }
+    if (whence == SEEK_DATA)
+        return -ENXIO;
+    return std::min(fsize, std::max(off, (off_t) (count * kChunkSize)));
+}
+
+/* Pack: Replace chunks by compressed copies.  Chunks that are in use are
+ * skipped rather than waited for, as are the ones still shared with other
+ * files or not worth compressing.  Each is compressed with its range locked, so
+ * that no one is reading it or will be until it is decompressed. */
+bool File::Pack(size_t &next, size_t count) {
+    for (size_t stop = next + count; next < stop; ++next) {
+        uint64_t start = next * kChunkSize;
+        if (!m_rangeLock.TryLock(start, start + kChunkSize, true))
+            continue;
+        char *chunk = nullptr;
+        bool done;
+        {
+            std::shared_lock<std::shared_mutex> lk(m_chunksRwSem);
+            done = (next >= m_chunks.size());
+            if (!done)
+                chunk = m_chunks[next];
+        }
+        /* Chunks once shared may be ours alone again (e.g. the checkpoint
+         * that shared them is gone); no one can share them meanwhile, as
+         * that takes crMutex exclusively or the range */
+        char *packed = nullptr;
+        if (chunk != nullptr && !is_packed(chunk) &&
+            (!is_shared(chunk) || ChunkPool::Own(chunk_data(chunk))))
+            packed = ChunkPool::Compress(chunk_data(chunk));
+        if (packed != nullptr) {
+            {
+                std::unique_lock<std::shared_mutex> lk(m_chunksRwSem);
+                m_chunks[next] = (char *) ((uintptr_t) packed | kPackedBit);
+            }
+            put_chunk(chunk);
         }
-        m_buf = newbuf;
+        m_rangeLock.Unlock(start, start + kChunkSize, true);
+        if (done)
+            return false;
+    }
+    return true;
+}
+
+/* Returns 0 or an error number */
+int File::FileTruncate(size_t newSize) {
+    /* Everything past the new end changes, whichever way the file goes */
+    RangeLock::Guard range(m_rangeLock, newSize, RangeLock::kEnd, true);
+    int res = Unshare();
+    if (res != 0) {
+        return -res;
     }
+    Changed();
 
-    /* If the file is expanded, zero out outstanding bytes */
-    if (newSize > oldSize) {
-        memset((char *)m_buf + oldSize, 0, newSize - oldSize);
+    /* Growing leaves a hole; shrinking drops whole chunks, and zeroes the
+     * rest of the new last one so that it reads as zeros if the file grows
+     * again.  What is left of a file shrunk to fit inline moves there. */
+    size_t oldSize = Inode::Size();
+    size_t freed = 0;
+    if (newSize < oldSize && newSize <= kInlineSize) {
+        std::unique_lock<std::shared_mutex> lk(m_chunksRwSem);
+        if (!m_chunks.empty()) {
+            copy_chunk(m_chunks[0], 0, newSize, m_inline);
+            freed = free_chunks(m_chunks);
+        }
+        memset(m_inline + newSize, 0, kInlineSize - newSize);
+        UpdateInline();
+    } else if (newSize < oldSize) {
+        std::unique_lock<std::shared_mutex> lk(m_chunksRwSem);
+        size_t count = get_nblocks(newSize, kChunkSize);
+        if (newSize % kChunkSize != 0 && count <= m_chunks.size() &&
+            m_chunks[count - 1] != nullptr && own_chunk(m_chunks[count - 1]) != 0) {
+            return ENOMEM;
+        }
+        if (count < m_chunks.size()) {
+            std::vector<char *> dropped(m_chunks.begin() + count, m_chunks.end());
+            m_chunks.resize(count);
+            freed = free_chunks(dropped);
+        }
+        zero_tail(m_chunks, newSize);
+        /* A new last chunk left with nothing but zeros becomes a hole */
+        if (newSize % kChunkSize != 0 && count <= m_chunks.size() &&
+            m_chunks[count - 1] != nullptr &&
+            is_zero(m_chunks[count - 1], newSize % kChunkSize)) {
+            put_chunk(m_chunks[count - 1]);
+            m_chunks[count - 1] = nullptr;
+            freed++;
+        }
     }
 
     /* Update size / block usage */
-    FuseRamFs::UpdateUsedBlocks(newBlocks - oldBlocks);
+    FuseRamFs::UpdateUsedBlocks(-(ssize_t) (freed * kChunkBlocks));
     std::unique_lock<std::shared_mutex> lk(entryRwSem);
-    m_fuseEntryParam.attr.st_blocks = newBlocks;
+    m_fuseEntryParam.attr.st_blocks -= freed * kChunkBlocks;
     m_fuseEntryParam.attr.st_size = newSize;
     
     /* Changes to file content: both mtime and ctime will change */
@@ -77,50 +752,393 @@ int File::FileTruncate(size_t newSize) {
     return 0;
 }
 
+/* AllocateRange: Fill the holes in [off, end) with chunks of zeros, and,
+ * if zero is set, zero the bytes of the range that are already there.
+ * Called with the range locked.  Returns 0 or an error number. */
+int File::AllocateRange(size_t off, size_t end, bool zero) {
+    size_t first = off / kChunkSize;
+    size_t last = get_nblocks(end, kChunkSize);
+    std::unique_lock<std::shared_mutex> chunksLk(m_chunksRwSem);
+    if (m_chunks.empty() && end <= kInlineSize) {
+        if (zero) {
+            memset(m_inline + off, 0, end - off);
+            UpdateInline();
+        }
+        return 0;
+    }
+    int res = Spill();
+    if (res != 0) {
+        return res;
+    }
+    size_t needed = count_holes(m_chunks, first, last);
+    if (needed > 0 && !FuseRamFs::CheckHasSpaceFor(nullptr, needed * kChunkSize)) {
+        return ENOSPC;
+    }
+    for (size_t i = first; zero && i < std::min(last, m_chunks.size()); ++i) {
+        if (m_chunks[i] != nullptr && own_chunk(m_chunks[i]) != 0) {
+            return ENOMEM;
+        }
+    }
+    std::vector<char *> fresh;
+    if (get_chunks(fresh, needed) != 0) {
+        return ENOMEM;
+    }
+    if (m_chunks.size() < last) {
+        m_chunks.resize(last, nullptr);
+    }
+
+    for (size_t i = first; i < last; ++i) {
+        if (m_chunks[i] == nullptr) {
+            m_chunks[i] = fresh.back();
+            fresh.pop_back();
+            memset(m_chunks[i], 0, kChunkSize);
+        } else if (zero) {
+            size_t start = i * kChunkSize;
+            size_t from = std::max(off, start);
+            size_t to = std::min(end, start + kChunkSize);
+            memset(m_chunks[i] + (from - start), 0, to - from);
+        }
+    }
+
+    FuseRamFs::UpdateUsedBlocks(needed * kChunkBlocks);
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    m_fuseEntryParam.attr.st_blocks += needed * kChunkBlocks;
+    return 0;
+}
+
+/* PunchRange: Zero [off, end), freeing the chunks that end up all zeros.
+ * Called with the range locked.  Returns 0, or ENOMEM if a shared chunk
+ * only partly in the range cannot be copied. */
+int File::PunchRange(size_t off, size_t end) {
+    std::unique_lock<std::shared_mutex> chunksLk(m_chunksRwSem);
+    if (m_chunks.empty()) {
+        if (off < kInlineSize) {
+            memset(m_inline + off, 0, std::min(end, kInlineSize) - off);
+            UpdateInline();
+        }
+        return 0;
+    }
+    size_t first = off / kChunkSize;
+    size_t last = std::min(get_nblocks(end, kChunkSize), m_chunks.size());
+    size_t freed = 0;
+    int res = 0;
+    for (size_t i = first; i < last; ++i) {
+        if (m_chunks[i] == nullptr)
+            continue;
+        size_t start = i * kChunkSize;
+        size_t from = std::max(off, start);
+        size_t to = std::min(end, start + kChunkSize);
+        if (to - from < kChunkSize) {
+            res = own_chunk(m_chunks[i]);
+            if (res != 0)
+                break;
+            memset(m_chunks[i] + (from - start), 0, to - from);
+            if (!is_zero(m_chunks[i], kChunkSize))
+                continue;
+        }
+        put_chunk(m_chunks[i]);
+        m_chunks[i] = nullptr;
+        freed++;
+    }
+    /* Keep the first chunk, even a hole: emptying m_chunks would bring
+     * the stale inline contents back */
+    while (m_chunks.size() > 1 && m_chunks.back() == nullptr) {
+        m_chunks.pop_back();
+    }
+
+    FuseRamFs::UpdateUsedBlocks(-(ssize_t) (freed * kChunkBlocks));
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    m_fuseEntryParam.attr.st_blocks -= freed * kChunkBlocks;
+    return res;
+}
+
+/* Fallocate: Change a range of the file as fallocate(2) does with mode.
+ * Holes are filled with chunks of zeros; punched chunks are freed.
+ * Collapsing and inserting a range move chunks rather than bytes, so its
+ * offset and length must be multiples of kChunkSize.
+ *
+ * @return: 0 or an error number.
+ */
+int File::Fallocate(int mode, off_t off, off_t len) {
+    if (off < 0 || len <= 0) {
+        return EINVAL;
+    }
+    if (off > std::numeric_limits<off_t>::max() - len) {
+        return EFBIG;
+    }
+    bool keepSize = mode & FALLOC_FL_KEEP_SIZE;
+    mode &= ~FALLOC_FL_KEEP_SIZE;
+    bool shift = (mode == FALLOC_FL_COLLAPSE_RANGE || mode == FALLOC_FL_INSERT_RANGE);
+    if (shift && (keepSize || off % kChunkSize != 0 || len % kChunkSize != 0)) {
+        return EINVAL;
+    }
+    if (mode == FALLOC_FL_PUNCH_HOLE && !keepSize) {
+        return EOPNOTSUPP;
+    }
+
+    /* Collapsing and inserting move everything past off */
+    size_t end = off + len;
+    RangeLock::Guard range(m_rangeLock, off, shift ? RangeLock::kEnd : end, true);
+    int res = Unshare();
+    if (res != 0) {
+        return -res;
+    }
+    Changed();
+
+    size_t fsize = Size();
+    size_t minSize = 0;
+    switch (mode) {
+    case 0:
+    case FALLOC_FL_ZERO_RANGE:
+        res = AllocateRange(off, end, mode == FALLOC_FL_ZERO_RANGE);
+        if (res != 0) {
+            return res;
+        }
+        if (!keepSize) {
+            minSize = end;
+        }
+        break;
+    case FALLOC_FL_PUNCH_HOLE:
+        res = PunchRange(off, end);
+        if (res != 0) {
+            return res;
+        }
+        break;
+    case FALLOC_FL_COLLAPSE_RANGE:
+        /* The range must not reach the end of the file */
+        if (end >= fsize) {
+            return EINVAL;
+        }
+        /* Whole chunks: nothing to copy */
+        PunchRange(off, end);
+        {
+            std::unique_lock<std::shared_mutex> lk(m_chunksRwSem);
+            res = Spill();
+            if (res != 0) {
+                return res;
+            }
+            if (off / kChunkSize < m_chunks.size()) {
+                m_chunks.erase(m_chunks.begin() + off / kChunkSize,
+                               m_chunks.begin() + std::min(end / kChunkSize, m_chunks.size()));
+            }
+            if (m_chunks.empty()) {
+                m_chunks.push_back(nullptr);
+            }
+        }
+        break;
+    case FALLOC_FL_INSERT_RANGE:
+        if ((size_t) off >= fsize) {
+            return EINVAL;
+        }
+        if (fsize > (size_t) (std::numeric_limits<off_t>::max() - len)) {
+            return EFBIG;
+        }
+        {
+            std::unique_lock<std::shared_mutex> lk(m_chunksRwSem);
+            res = Spill();
+            if (res != 0) {
+                return res;
+            }
+            if (off / kChunkSize < m_chunks.size()) {
+                m_chunks.insert(m_chunks.begin() + off / kChunkSize, len / kChunkSize, nullptr);
+            }
+        }
+        break;
+    default:
+        return EOPNOTSUPP;
+    }
+
+    /* Writes below off may have grown the file in the meantime, except
+     * while collapsing or inserting, which lock the end of the file */
+    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    if (mode == FALLOC_FL_COLLAPSE_RANGE) {
+        m_fuseEntryParam.attr.st_size = fsize - len;
+    } else if (mode == FALLOC_FL_INSERT_RANGE) {
+        m_fuseEntryParam.attr.st_size = fsize + len;
+    } else if (minSize > (size_t) m_fuseEntryParam.attr.st_size) {
+        m_fuseEntryParam.attr.st_size = minSize;
+    }
+
+    /* Changes to file content: both mtime and ctime will change */
+#ifdef __APPLE__
+    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_ctimespec));
+    m_fuseEntryParam.attr.st_mtimespec = m_fuseEntryParam.attr.st_ctimespec;
+#else
+    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_ctim));
+    m_fuseEntryParam.attr.st_mtim = m_fuseEntryParam.attr.st_ctim;
+#endif
+    return 0;
+}
+
 int File::WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off) {
-    // Allocate more memory if we don't have space.
-    size_t newSize = off + size;
-    size_t oldSize = Size();
-    size_t originalCapacity = Inode::BufBlockSize * File::UsedBlocks();
-    size_t newBlocks = newSize/Inode::BufBlockSize + (newSize % Inode::BufBlockSize != 0);
-
-    /* Request for more memory if write() expands the file */
-    if (newSize > originalCapacity) {
-        if (!FuseRamFs::CheckHasSpaceFor(this, newSize - File::Size())) {
-            return fuse_reply_err(req, ENOSPC);
-        }
-        void *newBuf = realloc(m_buf, newBlocks * Inode::BufBlockSize);
-        // If we ran out of memory, let the caller know that no bytes were
-        // written.
-        if (newBuf == NULL) {
-            return fuse_reply_write(req, 0);;
-        }
-        
-        // Update our buffer size
-        m_buf = newBuf;
-    }
-
-    /* If write() operation expands the file, we must zero out the "hole"
-     * that the write may create (i.e. the range of [oldsize, offset)).
-     * Otherwise, the "hole" may contain garbage data */
-    if ((size_t)off > oldSize)
-        memset((char *)m_buf + oldSize, 0, off - oldSize);
-    
-    // Write to the buffer. TODO: Check if SRC and DST overlap.
-    // We assume that there can be no buffer overflow since realloc has already
-    // been called with the new size and offset. If realloc failed, we wouldn't
-    // be here.
-    memmove((char *) m_buf + off, buf, size);
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    bufv.buf[0].mem = (void *) buf;
+    return WriteBufAndReply(req, &bufv, off);
+}
+
+/* WriteBufAndReply: Copy the data straight into the chunks of the file,
+ * from memory or, if it was spliced, from the pipe it is in; each byte is
+ * copied once. */
+int File::WriteBufAndReply(fuse_req_t req, struct fuse_bufvec *bufv, off_t off) {
+    size_t size = fuse_buf_size(bufv);
+    RangeLock::Guard range(m_rangeLock, off, off + size, true);
+    int res = Unshare();
+    if (res != 0) {
+        return fuse_reply_err(req, -res);
+    }
+
+    ssize_t written = WriteLocked(bufv, off);
+    if (written < 0) {
+        return fuse_reply_err(req, -written);
+    }
+    return fuse_reply_write(req, written);
+}
+
+/* WriteLocked: Write the data in bufv at off, with the range locked and the
+ * file unshared from any image.
+ *
+ * Writes to different chunks run in parallel: the chunk vector is only
+ * locked exclusively while holes in the range are filled or shared or
+ * compressed chunks copied, and the data is copied with just the range locked.
+ *
+ * @return: The number of bytes written, which is 0 if we ran out of
+ * memory, or a negative error code.
+ */
+ssize_t File::WriteLocked(struct fuse_bufvec *bufv, off_t off) {
+    size_t size = fuse_buf_size(bufv);
+    size_t end = off + size;
+    size_t first = off / kChunkSize;
+    size_t last = get_nblocks(end, kChunkSize);
+    std::vector<struct iovec> iov;
+    size_t needed = 0;
+    size_t unowned = 0;
+    bool inlined;
+    Changed();
+    {
+        std::shared_lock<std::shared_mutex> lk(m_chunksRwSem);
+        inlined = m_chunks.empty();
+        if (!inlined)
+            needed = count_holes(m_chunks, first, last, &unowned);
+        if (!inlined && needed == 0 && unowned == 0)
+            chunk_iov(m_chunks, nullptr, 0, off, end, iov);
+    }
 
-    /* Update size and block usage info */
-    if (newSize > originalCapacity) {
-        FuseRamFs::UpdateUsedBlocks(newBlocks - m_fuseEntryParam.attr.st_blocks);
+    /* Tiny files are written inline, under the lock as a writer further
+     * on may move the contents into a chunk; others leave inline first */
+    if (inlined) {
+        std::unique_lock<std::shared_mutex> lk(m_chunksRwSem);
+        if (m_chunks.empty() && end <= kInlineSize) {
+            if (!m_inlineUsed && !FuseRamFs::CheckHasSpaceFor(nullptr, Inode::BufBlockSize)) {
+                return -ENOSPC;
+            }
+            iov.push_back({m_inline + off, size});
+            ssize_t copied = copy_bufvec(iov, bufv);
+            UpdateInline();
+            lk.unlock();
+            return Written(off, copied);
+        }
+        int res = Spill();
+        if (res != 0) {
+            return (res == ENOMEM) ? 0 : -res;
+        }
+        needed = count_holes(m_chunks, first, last, &unowned);
+        if (needed == 0 && unowned == 0)
+            chunk_iov(m_chunks, nullptr, 0, off, end, iov);
+    }
+
+    /* Only the chunks written to are allocated: the range of
+     * [oldsize, offset) that the write may skip over stays a hole.  No
+     * one else fills holes in a range we hold. */
+    std::vector<size_t> filled;
+    if (needed > 0 || unowned > 0) {
+        if (needed > 0 && !FuseRamFs::CheckHasSpaceFor(nullptr, needed * kChunkSize)) {
+            return -ENOSPC;
+        }
+
+        /* If we ran out of memory, let the caller know that no bytes were
+         * written. */
+        std::vector<char *> fresh;
+        if (get_chunks(fresh, needed) != 0) {
+            return 0;
+        }
+
+        std::unique_lock<std::shared_mutex> lk(m_chunksRwSem);
+        for (size_t i = first; unowned > 0 && i < std::min(last, m_chunks.size()); ++i) {
+            if (m_chunks[i] != nullptr && own_chunk(m_chunks[i]) != 0) {
+                free_chunks(fresh);
+                return 0;
+            }
+        }
+
+        /* Zero what the write leaves of the new chunks */
+        filled.reserve(needed);
+        if (m_chunks.size() < last) {
+            m_chunks.resize(last, nullptr);
+        }
+        for (size_t i = first; i < last && !fresh.empty(); ++i) {
+            if (m_chunks[i] != nullptr)
+                continue;
+            m_chunks[i] = fresh.back();
+            fresh.pop_back();
+            filled.push_back(i);
+            size_t start = i * kChunkSize;
+            if ((size_t) off > start)
+                memset(m_chunks[i], 0, (size_t) off - start);
+            if (end < start + kChunkSize)
+                memset(m_chunks[i] + (end - start), 0, start + kChunkSize - end);
+        }
+        chunk_iov(m_chunks, nullptr, 0, off, end, iov);
+
+        FuseRamFs::UpdateUsedBlocks(needed * kChunkBlocks);
+        std::unique_lock<std::shared_mutex> entryLk(entryRwSem);
+        m_fuseEntryParam.attr.st_blocks += needed * kChunkBlocks;
+    }
+
+    ssize_t copied = copy_bufvec(iov, bufv);
+    size_t done = std::max(copied, (ssize_t) 0);
+    if (done < size) {
+        /* The pipe came up short: what was not written of the new chunks
+         * must read as zeros */
+        std::shared_lock<std::shared_mutex> lk(m_chunksRwSem);
+        for (size_t i : filled) {
+            size_t start = std::max(off + done, i * kChunkSize);
+            size_t stop = std::min(end, (i + 1) * kChunkSize);
+            if (start < stop)
+                memset(m_chunks[i] + (start - i * kChunkSize), 0, stop - start);
+        }
     }
 
+    /* Holes that were written only zeros stay holes.  Chunks that were
+     * there already are kept, as fallocate() may have put them there. */
+    size_t punched = 0;
+    if (!filled.empty()) {
+        std::unique_lock<std::shared_mutex> lk(m_chunksRwSem);
+        for (size_t i : filled) {
+            if (is_zero(m_chunks[i], kChunkSize)) {
+                ChunkPool::Put(m_chunks[i]);
+                m_chunks[i] = nullptr;
+                punched++;
+            }
+        }
+    }
+    if (punched > 0) {
+        FuseRamFs::UpdateUsedBlocks(-(ssize_t) (punched * kChunkBlocks));
+        std::unique_lock<std::shared_mutex> entryLk(entryRwSem);
+        m_fuseEntryParam.attr.st_blocks -= punched * kChunkBlocks;
+    }
+    return Written(off, copied);
+}
+
+/* Written: Account for copied bytes written at off, or the error if it is
+ * negative.  Returns copied. */
+ssize_t File::Written(off_t off, ssize_t copied) {
+    size_t done = std::max(copied, (ssize_t) 0);
+    m_lastAccess = monotonic_ms();
+
+    /* Update size; writes further on may have grown the file already */
     std::unique_lock<std::shared_mutex> lk(entryRwSem);
-    if (newSize > oldSize) {
-        m_fuseEntryParam.attr.st_blocks = newBlocks;
-        m_fuseEntryParam.attr.st_size = newSize;
+    if (off + done > (size_t) m_fuseEntryParam.attr.st_size) {
+        m_fuseEntryParam.attr.st_size = off + done;
     }
     
     /* Changes to file content: both mtime and ctime will change */
@@ -131,63 +1149,377 @@ int File::WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off)
     clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_ctim));
     m_fuseEntryParam.attr.st_mtim = m_fuseEntryParam.attr.st_ctim;
 #endif
-    
-    return fuse_reply_write(req, size);
+    return copied;
+}
+
+/* CopyRange: Copy len bytes at srcOff in src to dstOff in this file, or
+ * up to the end of src if len is 0.
+ *
+ * Where the two offsets are equally far into a chunk, the whole chunks in
+ * between are shared rather than copied, and copied on the first change
+ * by either file.  Space is charged as if they had been copied, so that
+ * the copy on change cannot run out of it.  The rest is copied through a
+ * buffer.  With cloneOnly, nothing is copied: the ranges must start at
+ * chunk boundaries and end at one or at the end of src.
+ *
+ * @return: The number of bytes copied, or a negative error code.
+ */
+ssize_t File::CopyRange(File *src, off_t srcOff, off_t dstOff, size_t len, bool cloneOnly) {
+    static const size_t kBounceSize = 1 << 20;
+
+    if (srcOff < 0 || dstOff < 0) {
+        return -EINVAL;
+    }
+    if (len > (size_t) std::numeric_limits<off_t>::max() - dstOff) {
+        return -EFBIG;
+    }
+    uint64_t srcEnd = (len == 0) ? RangeLock::kEnd : srcOff + len;
+    uint64_t dstEnd = (len == 0) ? RangeLock::kEnd : dstOff + len;
+
+    /* Lock both ranges, the lower numbered inode first; within one file a
+     * single range covers both */
+    std::unique_ptr<RangeLock::Guard> srcRange, dstRange;
+    if (src == this) {
+        dstRange.reset(new RangeLock::Guard(m_rangeLock, std::min(srcOff, dstOff),
+                                            std::max(srcEnd, dstEnd), true));
+    } else if (src->GetIno() < GetIno()) {
+        srcRange.reset(new RangeLock::Guard(src->m_rangeLock, srcOff, srcEnd, false));
+        dstRange.reset(new RangeLock::Guard(m_rangeLock, dstOff, dstEnd, true));
+    } else {
+        dstRange.reset(new RangeLock::Guard(m_rangeLock, dstOff, dstEnd, true));
+        srcRange.reset(new RangeLock::Guard(src->m_rangeLock, srcOff, srcEnd, false));
+    }
+
+    int res = src->Unshare();
+    if (res == 0) {
+        res = Unshare();
+    }
+    if (res != 0) {
+        return res;
+    }
+
+    size_t srcSize = src->Size();
+    if ((size_t) srcOff >= srcSize) {
+        return 0;
+    }
+    if (len == 0 || len > srcSize - srcOff) {
+        len = srcSize - srcOff;
+        if (len > (size_t) std::numeric_limits<off_t>::max() - dstOff) {
+            return -EFBIG;
+        }
+    }
+    if (src == this && (size_t) srcOff < dstOff + len && (size_t) dstOff < srcOff + len) {
+        return -EINVAL;
+    }
+    Changed();
+
+    /* Split the range into a head copied up to the first chunk boundary,
+     * whole chunks shared, and a tail copied after them.  The tail chunk
+     * is shared too if it ends both files, as the rest of it is zeros.
+     * Inline contents are always copied. */
+    bool srcInline;
+    {
+        std::shared_lock<std::shared_mutex> lk(src->m_chunksRwSem);
+        srcInline = src->m_chunks.empty();
+    }
+    size_t head = len;
+    size_t share = 0;
+    if (!srcInline && srcOff % kChunkSize == dstOff % kChunkSize) {
+        head = std::min(len, (kChunkSize - dstOff % kChunkSize) % kChunkSize);
+        share = (len - head) / kChunkSize;
+        if ((len - head) % kChunkSize != 0 && srcOff + len == srcSize &&
+            dstOff + len >= Size()) {
+            share++;
+        }
+    }
+    size_t tailOff = std::min(len, head + share * kChunkSize);
+    if (cloneOnly && !srcInline && (head != 0 || tailOff != len)) {
+        return -EINVAL;
+    }
+
+    std::vector<char> bounce;
+    size_t done = 0;
+    auto copy = [&](size_t stop) -> ssize_t {
+        if (done < stop)
+            bounce.resize(std::min(kBounceSize, len));
+        while (done < stop) {
+            size_t n = std::min(bounce.size(), stop - done);
+            {
+                std::shared_lock<std::shared_mutex> lk(src->m_chunksRwSem);
+                src->CopyOut(bounce.data(), n, srcOff + done);
+            }
+            struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(n);
+            bufv.buf[0].mem = bounce.data();
+            ssize_t written = WriteLocked(&bufv, dstOff + done);
+            if (written <= 0) {
+                return (written < 0) ? written : -ENOMEM;
+            }
+            done += written;
+        }
+        return 0;
+    };
+
+    ssize_t err = copy(head);
+    if (err == 0 && share > 0) {
+        size_t srcFirst = (srcOff + head) / kChunkSize;
+        size_t dstFirst = (dstOff + head) / kChunkSize;
+        ssize_t added = 0;
+        {
+            /* Compressed chunks are not shared */
+            std::unique_lock<std::shared_mutex> lk(src->m_chunksRwSem);
+            err = -unpack_chunks(src->m_chunks, srcFirst, srcFirst + share);
+            added += share - count_holes(src->m_chunks, srcFirst, srcFirst + share);
+        }
+        if (err == 0) {
+            std::unique_lock<std::shared_mutex> lk(m_chunksRwSem);
+            err = -Spill();
+            added -= share - count_holes(m_chunks, dstFirst, dstFirst + share);
+        }
+        if (err == 0 && !FuseRamFs::CheckHasSpaceFor(nullptr, added * (ssize_t) kChunkSize)) {
+            err = -ENOSPC;
+        } else if (err == 0) {
+            /* Tag the chunks of src as shared, and add a holder for us */
+            std::vector<char *> chunks(share, nullptr);
+            {
+                std::unique_lock<std::shared_mutex> lk(src->m_chunksRwSem);
+                size_t last = std::min(srcFirst + share, src->m_chunks.size());
+                for (size_t i = srcFirst; i < last; ++i) {
+                    char *&chunk = src->m_chunks[i];
+                    if (chunk == nullptr)
+                        continue;
+                    chunk = (char *) ((uintptr_t) chunk | kSharedBit);
+                    ChunkPool::Share(chunk_data(chunk));
+                    chunks[i - srcFirst] = chunk;
+                }
+            }
+            {
+                std::unique_lock<std::shared_mutex> lk(m_chunksRwSem);
+                if (m_chunks.size() < dstFirst + share) {
+                    m_chunks.resize(dstFirst + share, nullptr);
+                }
+                std::swap_ranges(chunks.begin(), chunks.end(), m_chunks.begin() + dstFirst);
+            }
+            free_chunks(chunks);
+
+            FuseRamFs::UpdateUsedBlocks(added * (ssize_t) kChunkBlocks);
+            std::unique_lock<std::shared_mutex> lk(entryRwSem);
+            m_fuseEntryParam.attr.st_blocks += added * (ssize_t) kChunkBlocks;
+            done = tailOff;
+        }
+    }
+    if (err == 0) {
+        err = copy(len);
+    }
+    if (done == 0) {
+        return err;
+    }
+
+    /* WriteLocked() did not grow the file if all of the range was shared */
+    return Written(dstOff, done);
 }
 
+/* ReadAndReply: Reply with the data at off.  Reads run in parallel with
+ * each other and with writes to other chunks; the range stays locked
+ * until the reply is sent.  Compressed chunks read are decompressed for
+ * good, as the file is in use again. */
 int File::ReadAndReply(fuse_req_t req, size_t size, off_t off) {    
-    // Don't start the read past our file size
-    if (off > m_fuseEntryParam.attr.st_size) {
-        return fuse_reply_buf(req, (const char *) m_buf, 0);
+    RangeLock::Guard range(m_rangeLock, off, off + size, false);
+    m_lastAccess = monotonic_ms();
+
+    /* Contents still in a lazily loaded image are not read in: the reply
+     * is spliced straight from the image */
+    std::shared_ptr<ImageFile> lazyImage;
+    off_t lazyOffset = 0;
+    if (m_lazy) {
+        std::lock_guard<std::mutex> lk(m_lazyMutex);
+        if (m_lazy) {
+            lazyImage = m_lazyImage;
+            lazyOffset = m_lazyOffset;
+        }
     }
-    
+
     // Update access time. TODO: This could get very intensive. Some
     // filesystems buffer this with options at mount time. Look into this.
     // TODO: What do we do if this fails? Do we care? Log the event?
-    std::unique_lock<std::shared_mutex> lk(entryRwSem);
+    size_t fsize;
+    {
+        std::unique_lock<std::shared_mutex> lk(entryRwSem);
 #ifdef __APPLE__
-    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_atimespec));
+        clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_atimespec));
 #else
-    clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_atim));
+        clock_gettime(CLOCK_REALTIME, &(m_fuseEntryParam.attr.st_atim));
 #endif
+        fsize = m_fuseEntryParam.attr.st_size;
+    }
+
+    // Don't start the read past our file size
+    if ((size_t) off >= fsize) {
+        return fuse_reply_buf(req, nullptr, 0);
+    }
     
     // Handle reading past the file size as well as inside the size.
-    size_t bytesRead = off + size > m_fuseEntryParam.attr.st_size ? m_fuseEntryParam.attr.st_size - off : size;
-    
-    // TODO: There are all sorts of other replies. What about them?
-    return fuse_reply_buf(req, (const char *) m_buf + off, bytesRead);
+    size_t bytesRead = std::min(size, fsize - off);
+
+    if (lazyImage) {
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(bytesRead);
+        bufv.buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY);
+        bufv.buf[0].fd = lazyImage->Fd();
+        bufv.buf[0].pos = lazyOffset + off;
+        return fuse_reply_data(req, &bufv, (enum fuse_buf_copy_flags) 0);
+    }
+
+    /* Reply straight from the chunks; holes come from a chunk of zeros.
+     * This is a writev() of the chunks to the device: fuse_reply_data()
+     * would first copy a bufvec of several memory buffers into one.  The
+     * chunks cannot go away while the range is locked. */
+    std::shared_ptr<MappedImage> image;
+    const char *imageData = nullptr;
+    std::vector<struct iovec> iov;
+    size_t first = off / kChunkSize;
+    size_t last = get_nblocks(off + bytesRead, kChunkSize);
+    bool packed = false;
+    {
+        std::shared_lock<std::shared_mutex> lk(m_chunksRwSem);
+        if (m_image) {
+            image = m_image;
+            imageData = m_imageData;
+        } else {
+            packed = has_packed(m_chunks, first, last);
+            if (!packed)
+                chunk_iov(m_chunks, m_inline, kInlineSize, off, off + bytesRead, iov);
+        }
+    }
+    if (image) {
+        return fuse_reply_buf(req, imageData + off, bytesRead);
+    }
+    if (packed) {
+        std::unique_lock<std::shared_mutex> lk(m_chunksRwSem);
+        if (unpack_chunks(m_chunks, first, last) != 0)
+            return fuse_reply_err(req, ENOMEM);
+        chunk_iov(m_chunks, m_inline, kInlineSize, off, off + bytesRead, iov);
+    }
+    return fuse_reply_iov(req, iov.data(), iov.size());
 }
 
-size_t File::GetPickledSize() {
-    return Inode::GetPickledSize() + m_fuseEntryParam.attr.st_size;
+/* File record: the inode record, then the contents (st_size bytes),
+ * which are streamed when written */
+template <class Archive>
+void File::Serialize(Archive &ar) {
+    Inode::Serialize(ar);
+    uint64_t fsize = m_fuseEntryParam.attr.st_size;
+    ar.Varint(fsize);
+    if constexpr (Archive::kLoading) {
+        const char *data = ar.Extend(fsize);
+        if (data == nullptr)
+            return;
+        if (ar.LazyImage()) {
+            m_lazyImage = ar.LazyImage();
+            m_lazyOffset = ar.ImageOffset(data);
+            m_lazy = true;
+        } else if (ar.Image()) {
+            m_imageData = data;
+            m_image = ar.Image();
+        } else if (fsize <= kInlineSize) {
+            memcpy(m_inline, data, fsize);
+            m_inlineUsed = !is_zero(m_inline, kInlineSize);
+            m_fuseEntryParam.attr.st_blocks = m_inlineUsed ? 1 : 0;
+        } else {
+            /* st_blocks counts the chunks, which may differ from what
+             * the image says */
+            if (fill_chunks(m_chunks, data, fsize) != 0) {
+                ar.Fail(ENOMEM);
+                return;
+            }
+            size_t count = m_chunks.size() - std::count(m_chunks.begin(), m_chunks.end(), nullptr);
+            m_fuseEntryParam.attr.st_blocks = count * kChunkBlocks;
+        }
+    } else {
+        ar.Contents(fsize, m_version, [this, fsize](PickleStream &out) {
+            return StreamOut(out, fsize);
+        });
+    }
 }
 
-size_t File::Pickle(void* &buf) {
-    if (buf == nullptr) {
-        buf = malloc(File::GetPickledSize());
+/* Size of the pieces a lazily loaded file is copied in from its image */
+static const size_t kStreamBufSize = 1 << 20;
+
+/* StreamOut: Write the first size bytes of the file to out, piece by
+ * piece, with holes written as zeros.  Returns 0 or an error number. */
+int File::StreamOut(PickleStream &out, size_t size) {
+    if (m_lazy) {
+        /* Copy straight from the image instead of materializing the file */
+        std::lock_guard<std::mutex> lk(m_lazyMutex);
+        if (m_lazy) {
+            std::vector<char> buf(std::min(size, kStreamBufSize));
+            for (size_t done = 0; done < size; ) {
+                size_t n = std::min(size - done, buf.size());
+                int res = read_image(m_lazyImage->Fd(), buf.data(), n, m_lazyOffset + done);
+                if (res != 0)
+                    return res;
+                out.Write(buf.data(), n);
+                done += n;
+            }
+            return 0;
+        }
     }
-    if (buf == nullptr) {
+    RangeLock::Guard range(m_rangeLock, 0, size, false);
+    if (m_image) {
+        out.Write(m_imageData, size);
         return 0;
     }
-    size_t offset = Inode::Pickle(buf);
-    char *ptr = (char *)buf + offset;
-    size_t fsize = m_fuseEntryParam.attr.st_size;
-    memcpy(ptr, m_buf, fsize);
-    return offset + fsize;
+    if (m_chunks.empty()) {
+        size_t n = std::min(kInlineSize, size);
+        out.Write(m_inline, n);
+        out.Zeros(size - n);
+        return 0;
+    }
+    /* Runs of holes go out in one piece, which the image can leave as a
+     * hole of its own */
+    size_t zeros = 0;
+    for (size_t pos = 0; pos < size; pos += kChunkSize) {
+        size_t n = std::min(kChunkSize, size - pos);
+        char *chunk = nullptr;
+        {
+            std::shared_lock<std::shared_mutex> lk(m_chunksRwSem);
+            if (pos / kChunkSize >= m_chunks.size()) {
+                zeros += size - pos;
+                break;
+            }
+            chunk = m_chunks[pos / kChunkSize];
+        }
+        if (chunk == nullptr) {
+            zeros += n;
+            continue;
+        }
+        if (zeros > 0) {
+            out.Zeros(zeros);
+            zeros = 0;
+        }
+        if (is_packed(chunk)) {
+            char data[kChunkSize];
+            ChunkPool::Decompress(chunk_data(chunk), data);
+            out.Write(data, n);
+        } else {
+            out.Write(chunk_data(chunk), n);
+        }
+    }
+    if (zeros > 0)
+        out.Zeros(zeros);
+    return 0;
 }
 
-size_t File::Load(const void* &buf) {
-    size_t offset = Inode::Load(buf);
-    size_t fsize = m_fuseEntryParam.attr.st_size;
-    size_t nblocks = m_fuseEntryParam.attr.st_blocks;
-    size_t fcap = m_fuseEntryParam.attr.st_blksize * nblocks;
-    
-    m_buf = calloc(fcap, 1);
-    if (m_buf == nullptr) {
+size_t File::GetPickledSize() {
+    PickleSizer sizer;
+    Serialize(sizer);
+    return sizer.Size();
+}
+
+void File::Pickle(PickleWriter &out) {
+    Serialize(out);
+}
+
+void File::Load(PickleReader &in) {
+    Serialize(in);
+    if (in.Error() != 0)
         ClearXAttrs();
-        return 0;
-    }
-    char *ptr = (char *)buf + offset;
-    memcpy(m_buf, ptr, fsize);
-    return offset + fsize;
 }
@@ -25,33 +25,177 @@
 #ifndef file_hpp
 #define file_hpp
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sys/mman.h>
+
+#include "chunk_pool.hpp"
+#include "image_io.hpp"
+#include "range_lock.hpp"
+
+/* MappedImage: A state image mmap'ed by load_verifs2(), or read into
+ * memory from a pipe or socket or with direct I/O (malloced).
+ *
+ * Files loaded from the image keep referring to their contents inside the
+ * mapping until they are modified, so the mapping is unmapped only after the
+ * last such file is gone.  A mapped image file must not change meanwhile:
+ * Pin() leases it, and on a lease break (or if there is no lease to be had)
+ * the mapping is replaced in place by a copy in anonymous memory.
+ */
+class MappedImage : public ImageLease {
+private:
+    void *m_addr;
+    size_t m_len;
+    bool m_malloced;
+
+    int Detach() override;
+
+public:
+    MappedImage(void *addr, size_t len, bool malloced = false) :
+    m_addr(addr), m_len(len), m_malloced(malloced) {}
+    ~MappedImage() {
+        Release();
+        if (m_malloced)
+            free(m_addr);
+        else
+            munmap(m_addr, m_len);
+    }
+
+    /* Keep the image file open at fd, which the mapping is of, from
+     * changing under it.  Returns 0 or an error number. */
+    int Pin(int fd) { return Hold(fd); }
+
+    const void *Data() const { return m_addr; }
+    size_t Length() const { return m_len; }
+};
+
+/* ImageFile: A state image opened by a lazy load.
+ *
+ * Lazily loaded files are read by splicing from the image, and read their
+ * contents in from it when first modified.  The descriptor stays open
+ * until the last such file has been modified or deleted, so the image may
+ * be replaced or unlinked in the meantime, but not written to or truncated.
+ * Pin() leases it, and on a lease break (or if there is no lease to be had)
+ * a copy of the image in a memfd takes over the descriptor.
+ */
+class ImageFile : public ImageLease {
+private:
+    int m_fd;
+
+    int Detach() override;
+
+public:
+    explicit ImageFile(int fd) : m_fd(fd) {}
+    ~ImageFile() {
+        Release();
+        close(m_fd);
+    }
+
+    /* Returns 0 or an error number */
+    int Pin() { return Hold(m_fd); }
+
+    int Fd() const { return m_fd; }
+};
+
 class File : public Inode {
 private:
-    void *m_buf;
+    /* The contents in ChunkPool chunks: chunk i holds the bytes at
+     * [i * kChunkSize, (i + 1) * kChunkSize).  Null chunks, and the ones
+     * past the end of the vector up to st_size, are holes that read as
+     * zeros; holes written nothing but zeros stay holes.  Bytes past
+     * st_size, including in chunks fallocate()d past it, are zero.
+     * st_blocks counts the chunks allocated, compressed (see Pack()) or
+     * not. */
+    std::vector<char *> m_chunks;
+    /* While m_chunks is empty, the first kInlineSize bytes of the file
+     * are kept here instead of in a chunk, and the rest are holes, so tiny
+     * files take no chunk at all.  Bytes past st_size are zero.
+     * m_inlineUsed says if any are not, and st_blocks then counts one
+     * block for them. */
+    static constexpr size_t kInlineSize = 64;
+    char m_inline[kInlineSize];
+    bool m_inlineUsed;
+    /* Non-null if the contents are still in a loaded state image, at
+     * m_imageData, and m_chunks is empty. */
+    std::shared_ptr<MappedImage> m_image;
+    const char *m_imageData;
+    /* Non-null if the contents have not been read in from the image yet;
+     * they are at m_lazyOffset in m_lazyImage. */
+    std::shared_ptr<ImageFile> m_lazyImage;
+    off_t m_lazyOffset;
+    std::atomic<bool> m_lazy;
+    /* Serializes reading the contents in from the state image */
+    std::mutex m_lazyMutex;
+    /* When the contents were last read or written (monotonic_ms()) */
+    std::atomic<uint64_t> m_lastAccess;
+    /* The version of the contents: a number no other contents had, taken
+     * by Changed() whenever they may change, and kept by copies.  Delta
+     * images tell unchanged files by it (see PickleWriter::Contents()). */
+    std::atomic<uint64_t> m_version;
+
+    /* Locking: reads lock their byte range shared and changes lock theirs
+     * exclusively, so the data in a range, and which chunks back it, only
+     * change under its holder.  m_chunksRwSem guards m_chunks itself and
+     * m_image, and is held only while they are looked at or changed, not
+     * while data is copied; inline contents are only changed with it held
+     * exclusively, as are compressed chunks decompressed.  Size, times
+     * and st_blocks stay under entryRwSem.  Locks are taken in the order
+     * m_rangeLock, m_lazyMutex, m_chunksRwSem, entryRwSem. */
+    RangeLock m_rangeLock;
+    std::shared_mutex m_chunksRwSem;
+
+    static uint64_t NextVersion();
+    void Changed() { m_version = NextVersion(); }
+    int Materialize();
+    int Unshare();
+    void SetChunks(std::vector<char *> &chunks, size_t count);
+    void SetInline(const char *data, size_t len);
+    void UpdateInline();
+    int Spill();
+    void CopyOut(char *buf, size_t size, off_t off);
+    int StreamOut(PickleStream &out, size_t size);
+    int AllocateRange(size_t off, size_t end, bool zero);
+    int PunchRange(size_t off, size_t end);
+    ssize_t WriteLocked(struct fuse_bufvec *bufv, off_t off);
+    ssize_t Written(off_t off, ssize_t copied);
     
 public:
     File() :
-    m_buf(NULL) {}
-
-    File(const File &f) : Inode(f){
-        size_t bufsize = f.m_fuseEntryParam.attr.st_blocks * f.BufBlockSize; 
-        m_buf = malloc(bufsize);
-        if (!m_buf){
-            std::cerr << "malloc failed for File copy constructor\n";
-            exit(EXIT_FAILURE);
-        }
-        memcpy(m_buf, f.m_buf, bufsize);
-    };
+    m_inline(), m_inlineUsed(false), m_imageData(nullptr), m_lazyOffset(0), m_lazy(false),
+    m_lastAccess(0), m_version(NextVersion()) {}
+
+    File(const File &f);
     
     ~File();
     
     int WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off);
+    int WriteBufAndReply(fuse_req_t req, struct fuse_bufvec *bufv, off_t off);
+    /* Returns the number of bytes copied, or a negative error code */
+    ssize_t CopyRange(File *src, off_t srcOff, off_t dstOff, size_t len, bool cloneOnly);
     int ReadAndReply(fuse_req_t req, size_t size, off_t off);
+    /* Returns 0 or an error number */
     int FileTruncate(size_t newSize);
+    /* Returns 0 or an error number */
+    int Fallocate(int mode, off_t off, off_t len);
+    /* Copy up to size bytes at off out of the file, reading them in first
+     * if the file was loaded lazily.  Returns the number of bytes copied,
+     * or a negative error code.  Not guarded, like Children(). */
+    ssize_t Read(char *buf, size_t size, off_t off);
+    off_t Seek(off_t off, int whence);
+    /* Compress up to count chunks from chunk next on, advancing next, for
+     * the background compression of files gone cold.  Returns false once
+     * past the last chunk. */
+    bool Pack(size_t &next, size_t count);
+    uint64_t LastAccess() const { return m_lastAccess; }
 
+    /* Contents are loaded as PickleReader says: copied, left in the mapped
+     * image, or read from the image on first access */
+    template <class Archive> void Serialize(Archive &ar);
     size_t GetPickledSize();
-    size_t Pickle(void* &buf);
-    size_t Load(const void* &buf);
+    void Pickle(PickleWriter &out);
+    void Load(PickleReader &in);
 
     friend class FuseRamFs;
     #ifdef DUMP_TESTING
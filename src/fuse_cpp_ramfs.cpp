@@ -27,6 +27,7 @@
 #endif
 
 #include "common.h"
+#include <linux/capability.h>
 
 #include "inode.hpp"
 #include "file.hpp"
@@ -57,6 +58,30 @@ struct statvfs FuseRamFs::m_stbuf = {};
 std::shared_mutex FuseRamFs::stbufMutex;
 
 std::mutex FuseRamFs::renameMutex;
+
+/**
+ Background and periodic pickling.
+ */
+std::mutex FuseRamFs::pickleMutex;
+std::condition_variable FuseRamFs::pickleCond;
+std::thread FuseRamFs::pickleThread;
+std::thread FuseRamFs::autoPickleThread;
+std::string FuseRamFs::autoPicklePath;
+uint64_t FuseRamFs::autoPickleIntervalMs = 0;
+uint64_t FuseRamFs::autoPickleGen = 0;
+struct verifs_pickle_status FuseRamFs::pickleStatus = {};
+std::shared_ptr<const pickle_baseline> FuseRamFs::pickleBaseline;
+std::string FuseRamFs::exitPicklePath;
+
+/**
+ Background compression of cold file chunks.
+ */
+std::mutex FuseRamFs::compressMutex;
+std::condition_variable FuseRamFs::compressCond;
+std::thread FuseRamFs::compressThread;
+uint64_t FuseRamFs::compressIdleMs = 0;
+uint64_t FuseRamFs::compressGen = 0;
+
 /**
  All the supported filesystem operations mapped to object-methods.
  */
@@ -81,6 +106,7 @@ FuseRamFs::FuseRamFs(fsblkcnt_t blocks, fsfilcnt_t inodes) {
     FuseOps.open = FuseRamFs::FuseOpen;
     FuseOps.read = FuseRamFs::FuseRead;
     FuseOps.write = FuseRamFs::FuseWrite;
+    FuseOps.write_buf = FuseRamFs::FuseWriteBuf;
     FuseOps.flush = FuseRamFs::FuseFlush;
     FuseOps.release = FuseRamFs::FuseRelease;
     FuseOps.fsync = FuseRamFs::FuseFsync;
@@ -97,6 +123,7 @@ FuseRamFs::FuseRamFs(fsblkcnt_t blocks, fsfilcnt_t inodes) {
     FuseOps.create = FuseRamFs::FuseCreate;
     FuseOps.getlk = FuseRamFs::FuseGetLock;
     FuseOps.ioctl = FuseRamFs::FuseIoctl;
+    FuseOps.fallocate = FuseRamFs::FuseFallocate;
 
     if (blocks <= 0) {
         blocks = kTotalBlocks;
@@ -130,6 +157,28 @@ static void free_inodes(std::vector<Inode *> &table) {
     table.clear();
 }
 
+/* copy_inodes: Copy an inode table, e.g. into or out of the state pool.
+ *
+ * @return: 0 on success, or a negative error code; dst is left empty on
+ * failure.
+ */
+static int copy_inodes(const std::vector<Inode *> &src, std::vector<Inode *> &dst) {
+    dst.reserve(src.size());
+    for (auto &i : src) {
+        if (i == nullptr) {
+            dst.push_back(nullptr);
+            continue;
+        }
+        Inode *copy = copy_inode(i);
+        if (copy == nullptr) {
+            free_inodes(dst);
+            return -EBADF;
+        }
+        dst.push_back(copy);
+    }
+    return 0;
+}
+
 int FuseRamFs::checkpoint(uint64_t key) {
     //std::cout << "Start Checkpoint.\n";
     // Lock
@@ -137,60 +186,9 @@ int FuseRamFs::checkpoint(uint64_t key) {
     int ret = 0;
     std::vector<Inode *> copied_files = std::vector<Inode *>();
 
-    mode_t inode_mode;
-
-    File *file_inode_old;
-    Directory *dir_inode_old;
-    SpecialInode *special_inode_old;
-    SymLink *symlink_inode_old;
-
-    for (auto &i : Inodes) {
-        if (i == nullptr) {
-            copied_files.push_back(nullptr);
-            continue;
-        }
-
-        inode_mode = i->GetMode();
-        if (S_ISREG(inode_mode)) {
-            file_inode_old = dynamic_cast<File *>(i);
-            if (file_inode_old == nullptr) {
-                ret = -EBADF;
-                goto err;
-            }
-
-            File *file_inode_copy = new File(*file_inode_old);
-            copied_files.push_back((Inode *) file_inode_copy);
-
-        } else if (S_ISDIR(inode_mode)) {
-            dir_inode_old = dynamic_cast<Directory *>(i);
-            if (dir_inode_old == nullptr) {
-                ret = -EBADF;
-                goto err;
-            }
-
-            auto *dir_copy = new Directory(*dir_inode_old);
-            copied_files.push_back((Inode *) dir_copy);
-
-        } else if (S_ISLNK(inode_mode)) {
-            symlink_inode_old = dynamic_cast<SymLink *>(i);
-            if (symlink_inode_old == nullptr) {
-                ret = -EBADF;
-                goto err;
-            }
-
-            auto *symlink_inode_copy = new SymLink(*symlink_inode_old);
-            copied_files.push_back((Inode *) symlink_inode_copy);
-
-        } else {
-            special_inode_old = dynamic_cast<SpecialInode *>(i);
-            if (special_inode_old == nullptr) {
-                ret = -EBADF;
-                goto err;
-            }
-
-            auto *special_inode_copy = new SpecialInode(*special_inode_old);
-            copied_files.push_back((Inode *) special_inode_copy);
-        }
+    ret = copy_inodes(Inodes, copied_files);
+    if (ret != 0) {
+        goto err;
     }
     // insert state
     ret = insert_state(key, std::make_tuple(copied_files, DeletedInodes, m_stbuf));
@@ -211,6 +209,57 @@ int FuseRamFs::checkpoint(uint64_t key) {
     return ret;
 }
 
+fs_snapshot::~fs_snapshot() {
+    free_inodes(std::get<0>(live));
+    for (auto &state : states) {
+        free_inodes(std::get<0>(state.second));
+    }
+}
+
+/* snapshot: Take a consistent copy of the file system and the state pool.
+ *
+ * Operations are blocked only while the inodes are copied, so the copy can
+ * then be pickled without holding crMutex.  That copies metadata only: the
+ * copies share file chunks with the originals until either side changes
+ * them (see File::File(const File &)).
+ */
+int FuseRamFs::snapshot(fs_snapshot &snap) {
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    int ret = copy_inodes(Inodes, std::get<0>(snap.live));
+    if (ret != 0)
+        return ret;
+    std::get<1>(snap.live) = DeletedInodes;
+    std::get<2>(snap.live) = m_stbuf;
+    for (const auto &state : get_state_pool()) {
+        std::vector<Inode *> copied_files;
+        ret = copy_inodes(std::get<0>(state.second), copied_files);
+        if (ret != 0)
+            return ret;
+        snap.states.emplace(state.first,
+                            std::make_tuple(copied_files, std::get<1>(state.second),
+                                            std::get<2>(state.second)));
+    }
+    return 0;
+}
+
+/* snapshot_state: Copy one checkpoint of the state pool into snap.live.
+ *
+ * @return: 0 on success, or a negative error code; -ENOENT if there is no
+ * checkpoint with that key.
+ */
+int FuseRamFs::snapshot_state(uint64_t key, fs_snapshot &snap) {
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    verifs2_state state = find_state(key);
+    if (std::get<0>(state).empty() && std::get<1>(state).empty())
+        return -ENOENT;
+    int ret = copy_inodes(std::get<0>(state), std::get<0>(snap.live));
+    if (ret != 0)
+        return ret;
+    std::get<1>(snap.live) = std::get<1>(state);
+    std::get<2>(snap.live) = std::get<2>(state);
+    return 0;
+}
+
 void FuseRamFs::invalidate_kernel_states() {
     for (auto &it : Inodes) {
         if (it == nullptr) {
@@ -278,52 +327,10 @@ int FuseRamFs::restore(uint64_t key) {
     m_stbuf = stored_m_stbuf;
 
     std::vector<Inode *> newfiles;
-    mode_t inode_mode;
 
-    File *file_inode_stored;
-    Directory *dir_inode_stored;
-    SpecialInode *special_inode_stored;
-    SymLink *symlink_inode_stored;
-
-    for (auto &stored_file : stored_files) {
-        if (stored_file == nullptr) {
-            newfiles.push_back(nullptr);
-            continue;
-        }
-        inode_mode = stored_file->GetMode();
-        if (S_ISREG(inode_mode)) {
-            file_inode_stored = dynamic_cast<File *>(stored_file);
-            if (file_inode_stored == nullptr) {
-                ret = -EBADF;
-                goto err;
-            }
-            File *file_new = new File(*file_inode_stored);
-            newfiles.push_back((Inode *) file_new);
-        } else if (S_ISDIR(inode_mode)) {
-            dir_inode_stored = dynamic_cast<Directory *>(stored_file);
-            if (dir_inode_stored == nullptr) {
-                ret = -EBADF;
-                goto err;
-            }
-            auto *dir_new = new Directory(*dir_inode_stored);
-            newfiles.push_back((Inode *) dir_new);
-        } else if (S_ISLNK(inode_mode)) {
-            symlink_inode_stored = dynamic_cast<SymLink *>(stored_file);
-            if (symlink_inode_stored == nullptr) {
-                ret = -EBADF;
-                goto err;
-            }
-            auto *symlink_new = new SymLink(*symlink_inode_stored);
-            newfiles.push_back((Inode *) symlink_new);
-        } else {
-            special_inode_stored = dynamic_cast<SpecialInode *>(stored_file);
-            if (special_inode_stored == nullptr) {
-                ret = -EBADF;
-                goto err;
-            }
-            auto *special_inode_new = new SpecialInode(*special_inode_stored);
-            newfiles.push_back((Inode *) special_inode_new);
-        }
+    ret = copy_inodes(stored_files, newfiles);
+    if (ret != 0) {
+        goto err;
     }
     // clear old Inodes
     free_inodes(Inodes);
@@ -348,11 +355,103 @@ int FuseRamFs::restore(uint64_t key) {
     return ret;
 }
 
+/* check_image_arg: Validate the payload of VERIFS_PICKLE_ARG / VERIFS_LOAD_ARG.
+ *
+ * @return: 0 if valid, or a negative error code.
+ */
+static int check_image_arg(const void *in_buf, size_t in_bufsz) {
+    auto iarg = (const struct verifs_image_arg *) in_buf;
+    if (in_buf == nullptr || in_bufsz < sizeof(*iarg))
+        return -EINVAL;
+    if (iarg->version != VERIFS_IMAGE_ARG_VERSION)
+        return -EPROTONOSUPPORT;
+    if ((iarg->flags & ~VERIFS_IMAGE_FLAGS_V1) != 0 || iarg->reserved != 0)
+        return -EINVAL;
+    size_t pathlen = strnlen(iarg->path, sizeof(iarg->path));
+    /* Stopping periodic pickling needs no path */
+    if (pathlen == 0 && iarg->interval_ms == 0)
+        return 0;
+    if (pathlen == 0)
+        return -EINVAL;
+    if (pathlen == sizeof(iarg->path))
+        return -ENAMETOOLONG;
+    return 0;
+}
+
+/* check_state_arg: Validate the payload of VERIFS_EXPORT_STATE /
+ * VERIFS_IMPORT_STATE.
+ *
+ * @param[in] allowed: The VERIFS_IMAGE_* flags the ioctl accepts
+ *
+ * @return: 0 if valid, or a negative error code.
+ */
+static int check_state_arg(const void *in_buf, size_t in_bufsz, uint32_t allowed) {
+    auto sarg = (const struct verifs_state_arg *) in_buf;
+    if (in_buf == nullptr || in_bufsz < sizeof(*sarg))
+        return -EINVAL;
+    if (sarg->version != VERIFS_IMAGE_ARG_VERSION)
+        return -EPROTONOSUPPORT;
+    if ((sarg->flags & ~allowed) != 0 || sarg->reserved != 0)
+        return -EINVAL;
+    size_t pathlen = strnlen(sarg->path, sizeof(sarg->path));
+    if (pathlen == 0)
+        return -EINVAL;
+    if (pathlen == sizeof(sarg->path))
+        return -ENAMETOOLONG;
+    return 0;
+}
+
+/* may_search_all: Whether the caller of a request may reach any inode by
+ * number, as open_by_handle_at(2) lets only holders of CAP_DAC_READ_SEARCH
+ * do: the directories above a file may forbid the caller to look it up.
+ * FUSE 2 passes no capabilities, so they are read from /proc. */
+static bool may_search_all(fuse_req_t req) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    if (ctx->uid == 0)
+        return true;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) ctx->pid);
+    FILE *f = fopen(path, "r");
+    if (f == nullptr)
+        return false;
+    bool allowed = false;
+    char line[256];
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        unsigned long long caps;
+        if (sscanf(line, "CapEff: %llx", &caps) == 1) {
+            allowed = (caps >> CAP_DAC_READ_SEARCH) & 1;
+            break;
+        }
+    }
+    fclose(f);
+    return allowed;
+}
+
+/* parse_image_chain: Split the NUL-separated image paths of VERIFS_LOAD_ARG
+ * with VERIFS_IMAGE_DELTA.
+ *
+ * @return: 0 if valid, or a negative error code.
+ */
+static int parse_image_chain(const struct verifs_image_arg *iarg,
+                             std::vector<std::string> &chain) {
+    const char *ptr = iarg->path;
+    const char *end = iarg->path + sizeof(iarg->path);
+    while (ptr < end && *ptr != '\0') {
+        size_t len = strnlen(ptr, end - ptr);
+        if (ptr + len == end)
+            return -ENAMETOOLONG;
+        chain.emplace_back(ptr, len);
+        ptr += len + 1;
+    }
+    return (ptr < end) ? 0 : -ENAMETOOLONG;
+}
+
 void FuseRamFs::FuseIoctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
                           struct fuse_file_info *fi, unsigned flags,
                           const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
     int ret;
-    switch (cmd) {
+    /* ioctl numbers with _IOC_READ set do not fit in an int */
+    switch ((unsigned int) cmd) {
         case VERIFS_CHECKPOINT:
             ret = checkpoint((uint64_t) arg);
             break;
@@ -362,12 +461,187 @@ void FuseRamFs::FuseIoctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
             break;
 
         case VERIFS_PICKLE:
-            ret = pickle_verifs2();
+            ret = pickle_verifs2(nullptr, 0);
             break;
 
         case VERIFS_LOAD:
-            ret = load_verifs2();
+            ret = load_verifs2(nullptr, 0);
+            break;
+
+        case VERIFS_LOAD_LAZY:
+            ret = load_verifs2(nullptr, VERIFS_IMAGE_LAZY);
+            break;
+
+        case VERIFS_PICKLE_ARG:
+            ret = check_image_arg(in_buf, in_bufsz);
+            if (ret == 0) {
+                auto iarg = (const struct verifs_image_arg *) in_buf;
+                if (iarg->path[0] == '\0' || iarg->interval_ms != 0)
+                    ret = -EINVAL;
+                else
+                    ret = pickle_verifs2(iarg->path, iarg->flags);
+            }
+            break;
+
+        case VERIFS_LOAD_ARG:
+            ret = check_image_arg(in_buf, in_bufsz);
+            if (ret == 0) {
+                auto iarg = (const struct verifs_image_arg *) in_buf;
+                std::vector<std::string> chain;
+                if (iarg->path[0] == '\0' || iarg->interval_ms != 0)
+                    ret = -EINVAL;
+                else if (!(iarg->flags & VERIFS_IMAGE_DELTA))
+                    ret = load_verifs2(iarg->path, iarg->flags);
+                else if ((ret = parse_image_chain(iarg, chain)) == 0)
+                    ret = load_verifs2(chain, iarg->flags);
+            }
+            break;
+
+        case VERIFS_AUTO_PICKLE:
+            ret = check_image_arg(in_buf, in_bufsz);
+            if (ret == 0) {
+                auto iarg = (const struct verifs_image_arg *) in_buf;
+                /* Each pickle replaces the last, so it cannot be a delta */
+                if (iarg->flags & VERIFS_IMAGE_DELTA)
+                    ret = -EINVAL;
+                else
+                    ret = set_auto_pickle(iarg->path, iarg->interval_ms);
+            }
+            break;
+
+        case VERIFS_EXPORT_STATE:
+            ret = check_state_arg(in_buf, in_bufsz, VERIFS_IMAGE_DIRECT);
+            if (ret == 0) {
+                auto sarg = (const struct verifs_state_arg *) in_buf;
+                ret = export_state(sarg->key, sarg->path, sarg->flags);
+            }
+            break;
+
+        case VERIFS_IMPORT_STATE:
+            ret = check_state_arg(in_buf, in_bufsz, VERIFS_IMAGE_LAZY |
+                                  VERIFS_IMAGE_NOVERIFY | VERIFS_IMAGE_DIRECT);
+            if (ret == 0) {
+                auto sarg = (const struct verifs_state_arg *) in_buf;
+                ret = import_state(sarg->key, sarg->path, sarg->flags);
+            }
+            break;
+
+        case VERIFS_SEEK: {
+            struct verifs_seek_arg sarg;
+            if (in_bufsz < sizeof(sarg) || out_bufsz < sizeof(sarg)) {
+                ret = -EINVAL;
+                break;
+            }
+            memcpy(&sarg, in_buf, sizeof(sarg));
+            if ((sarg.whence != SEEK_DATA && sarg.whence != SEEK_HOLE) || sarg.reserved != 0) {
+                ret = -EINVAL;
+                break;
+            }
+            std::shared_lock<std::shared_mutex> lk(crMutex);
+            File *file = dynamic_cast<File *>(GetInode(ino));
+            if (file == nullptr) {
+                ret = -EINVAL;
+                break;
+            }
+            off_t found = file->Seek(sarg.offset, sarg.whence);
+            if (found < 0) {
+                ret = found;
+                break;
+            }
+            sarg.offset = found;
+            fuse_reply_ioctl(req, 0, &sarg, sizeof(sarg));
+            return;
+        }
+
+        case VERIFS_COPY_RANGE: {
+            struct verifs_copy_range_arg carg;
+            if (in_bufsz < sizeof(carg) || out_bufsz < sizeof(carg)) {
+                ret = -EINVAL;
+                break;
+            }
+            memcpy(&carg, in_buf, sizeof(carg));
+            if ((carg.flags & ~VERIFS_COPY_CLONE) != 0 || carg.reserved != 0) {
+                ret = -EINVAL;
+                break;
+            }
+            /* The source is named by number, which only those who may look
+             * up any file can do; copying within the file itself is
+             * always allowed */
+            const struct fuse_ctx *ctx = fuse_req_ctx(req);
+            if (carg.src_ino != ino && !may_search_all(req)) {
+                ret = -EPERM;
+                break;
+            }
+            /* The kernel holds no reference to the source: keep it in the
+             * table, as FuseForget() removes inodes from there before
+             * deleting them, until the copy is done */
+            std::shared_lock<std::shared_mutex> lk(crMutex);
+            std::shared_lock<std::shared_mutex> inodesLk(inodesRwSem);
+            Inode *dstInode = (ino < Inodes.size()) ? Inodes[ino] : nullptr;
+            Inode *srcInode = (carg.src_ino < Inodes.size()) ? Inodes[carg.src_ino] : nullptr;
+            if (srcInode == nullptr || srcInode->HasNoLinks()) {
+                ret = -EBADF;
+                break;
+            }
+            File *dst = dynamic_cast<File *>(dstInode);
+            File *src = dynamic_cast<File *>(srcInode);
+            if (dst == nullptr || src == nullptr) {
+                ret = (dynamic_cast<Directory *>(srcInode) != nullptr) ? -EISDIR : -EINVAL;
+                break;
+            }
+            /* We only have the descriptor of the destination, which the
+             * kernel checked; check that the caller may read the source */
+            if (ctx->uid != 0 && srcInode->CheckAccess(R_OK, ctx->gid, ctx->uid) != 0) {
+                ret = -EACCES;
+                break;
+            }
+            ssize_t copied = dst->CopyRange(src, carg.src_offset, carg.dst_offset, carg.length,
+                                            carg.flags & VERIFS_COPY_CLONE);
+            if (copied < 0) {
+                ret = copied;
+                break;
+            }
+            carg.length = copied;
+            fuse_reply_ioctl(req, 0, &carg, sizeof(carg));
+            return;
+        }
+
+        case VERIFS_COMPRESS: {
+            auto carg = (const struct verifs_compress_arg *) in_buf;
+            if (in_buf == nullptr || in_bufsz < sizeof(*carg)) {
+                ret = -EINVAL;
+            } else if (carg->version != VERIFS_IMAGE_ARG_VERSION) {
+                ret = -EPROTONOSUPPORT;
+            } else if (carg->flags != 0 || carg->reserved != 0) {
+                ret = -EINVAL;
+            } else {
+                set_compression(carg->idle_ms);
+                ret = 0;
+            }
             break;
+        }
+
+        case VERIFS_COMPRESS_STATUS: {
+            struct verifs_compress_status status;
+            if (out_bufsz < sizeof(status)) {
+                ret = -EINVAL;
+                break;
+            }
+            get_compress_status(status);
+            fuse_reply_ioctl(req, 0, &status, sizeof(status));
+            return;
+        }
+
+        case VERIFS_PICKLE_STATUS: {
+            struct verifs_pickle_status status;
+            if (out_bufsz < sizeof(status)) {
+                ret = -EINVAL;
+                break;
+            }
+            get_pickle_status(status);
+            fuse_reply_ioctl(req, 0, &status, sizeof(status));
+            return;
+        }
 
         default:
             std::cerr << "Function Not implemented in FuseIoctl.\n";
@@ -381,6 +655,83 @@ void FuseRamFs::FuseIoctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
     }
 }
 
+/* compress_cold: Compress the chunks of the files that have not been read
+ * or written for idle_ms.  Files are visited a batch of chunks at a time,
+ * so that checkpoints and new inodes wait for one batch at most; holding
+ * the inode table keeps the file from being deleted meanwhile. */
+void FuseRamFs::compress_cold(uint64_t gen, uint64_t idle_ms) {
+    static const size_t kBatchChunks = 64;
+    uint64_t now = monotonic_ms();
+    uint64_t cutoff = (now > idle_ms) ? now - idle_ms : 0;
+    fuse_ino_t ino = 0;
+    size_t next = 0;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lk(compressMutex);
+            if (compressGen != gen)
+                return;
+        }
+        std::shared_lock<std::shared_mutex> crLk(crMutex);
+        std::shared_lock<std::shared_mutex> inodesLk(inodesRwSem);
+        if (ino >= Inodes.size())
+            return;
+        File *file = dynamic_cast<File *>(Inodes[ino]);
+        if (file == nullptr || file->LastAccess() > cutoff || !file->Pack(next, kBatchChunks)) {
+            ino++;
+            next = 0;
+        }
+    }
+}
+
+void FuseRamFs::compress_loop(uint64_t gen) {
+    std::unique_lock<std::mutex> lk(compressMutex);
+    while (true) {
+        uint64_t idle_ms = compressIdleMs;
+        if (compressCond.wait_for(lk, std::chrono::milliseconds(idle_ms),
+                                  [gen] { return compressGen != gen; }))
+            return;
+        lk.unlock();
+        compress_cold(gen, idle_ms);
+        lk.lock();
+    }
+}
+
+/* set_compression: Start, reconfigure or stop (idle_ms == 0) compressing
+ * the chunks of files untouched for idle_ms.  Chunks already compressed
+ * stay so until they are accessed. */
+void FuseRamFs::set_compression(uint64_t idle_ms) {
+    std::unique_lock<std::mutex> lk(compressMutex);
+    std::thread old = std::move(compressThread);
+    compressGen++;
+    compressIdleMs = idle_ms;
+    if (idle_ms != 0)
+        compressThread = std::thread(compress_loop, compressGen);
+    compressCond.notify_all();
+    lk.unlock();
+    if (old.joinable())
+        old.join();
+}
+
+/* SetCompression: Have FuseInit() start compressing cold chunks, as
+ * set_compression() does.  Threads do not survive fuse_daemonize(), so
+ * none is started before. */
+void FuseRamFs::SetCompression(uint64_t idle_ms) {
+    std::lock_guard<std::mutex> lk(compressMutex);
+    compressIdleMs = idle_ms;
+}
+
+void FuseRamFs::get_compress_status(struct verifs_compress_status &status) {
+    memset(&status, 0, sizeof(status));
+    status.version = VERIFS_IMAGE_ARG_VERSION;
+    {
+        std::lock_guard<std::mutex> lk(compressMutex);
+        status.enabled = compressThread.joinable();
+        status.idle_ms = compressIdleMs;
+    }
+    ChunkPool::CompressionStats(status.chunks, status.compressed_bytes,
+                                status.compressed, status.decompressed);
+}
+
 static inline mode_t get_umask() {
     mode_t mask = umask(0);
     umask(mask);
@@ -389,12 +740,29 @@ static inline mode_t get_umask() {
 
 /**
  Initializes the filesystem. Creates the root directory. The UID and GID are those
- of the creating process.
+ of the creating process. A file system loaded by Preload() is kept as it is.
 
  @param userdata Any user data carried through FUSE calls.
  @param conn Information on the capabilities of the connection to FUSE.
  */
 void FuseRamFs::FuseInit(void *userdata, struct fuse_conn_info *conn) {
+    /* Enable ioctl on directory */
+    conn->want |= FUSE_CAP_IOCTL_DIR;
+    /* Let reads of lazily loaded files splice from the image */
+    conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+    uint64_t idle_ms;
+    {
+        std::lock_guard<std::mutex> lk(compressMutex);
+        idle_ms = compressThread.joinable() ? 0 : compressIdleMs;
+    }
+    if (idle_ms != 0)
+        set_compression(idle_ms);
+    /* Images preloaded before fuse_daemonize() forked are leased to a
+     * watcher thread of the parent */
+    ImageLease::Rearm();
+    if (!Inodes.empty())
+        return;
+
     /* No need for locking because no other threads should be
      * accessing these elements during f/s initialization */
     m_stbuf.f_bfree = m_stbuf.f_blocks;    /* Free blocks */
@@ -422,22 +790,28 @@ void FuseRamFs::FuseInit(void *userdata, struct fuse_conn_info *conn) {
     fuse_ino_t rootno = RegisterInode(root, S_IFDIR | rootmode, 2, gid, uid);
     root->AddChild(string("."), rootno);
     root->AddChild(string(".."), rootno);
-
-    /* Enable ioctl on directory */
-    conn->want |= FUSE_CAP_IOCTL_DIR;
 }
 
 
 /**
- Destroys the filesystem.
+ Destroys the filesystem, after pickling it if SetExitPickle() was called.
 
  @param userdata Any user data carried through FUSE calls.
  */
 void FuseRamFs::FuseDestroy(void *userdata) {
+    set_compression(0);
+    stop_pickling();
+    if (!exitPicklePath.empty()) {
+        int res = pickle_verifs2(exitPicklePath.c_str(), 0);
+        if (res != 0)
+            std::cerr << "Cannot pickle to " << exitPicklePath << ": "
+                      << strerror(-res) << std::endl;
+    }
     /* No need for locking because it's destruction of the file system */
     for (auto const &inode: Inodes) {
         delete inode;
     }
+    ChunkPool::Trim();
 }
 
 
@@ -865,7 +1239,7 @@ long FuseRamFs::do_create_node(Directory *parent, const char *name, mode_t mode,
             if (symlink == nullptr) {
                 return -EINVAL;
             }
-            new_node = new SymLink(std::string(symlink));
+            new_node = new SymLink(symlink);
         } else {
             return -EINVAL;
         }
@@ -897,8 +1271,8 @@ long FuseRamFs::do_create_node(Directory *parent, const char *name, mode_t mode,
     if (ret < 0) {
         FuseRamFs::UpdateUsedInodes(-1);
         FuseRamFs::UpdateUsedBlocks(new_node->UsedBlocks());
-        delete new_node;
         FuseRamFs::DeleteInode(ino);
+        delete new_node;
         return ret;
     }
     /* Only add hard link to the parent dir if everything above succeeded */
@@ -1079,10 +1453,11 @@ void FuseRamFs::FuseForget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup
         {
             // Let's just delete this inode and free memory.
             size_t blocks_freed = inode_p->UsedBlocks();
-            delete inode_p;
             /* Atomically erase the record in inodes table and
-             * push this ino to the DeletedInodes list */
+             * push this ino to the DeletedInodes list; before the inode
+             * goes, as compress_cold() may be at it until then */
             DeleteInode(ino);
+            delete inode_p;
             FuseRamFs::UpdateUsedInodes(-1);
             FuseRamFs::UpdateUsedBlocks(-blocks_freed);
         } else {
@@ -1112,6 +1487,18 @@ void FuseRamFs::FuseWrite(fuse_req_t req, fuse_ino_t ino, const char *buf, size_
     inode_p->WriteAndReply(req, buf, size, off);
 }
 
+void FuseRamFs::FuseWriteBuf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off,
+                             struct fuse_file_info *fi) {
+    std::shared_lock<std::shared_mutex> lk(crMutex);
+    Inode *inode_p = GetInode(ino);
+    if (inode_p == nullptr || inode_p->HasNoLinks()) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    inode_p->WriteBufAndReply(req, bufv, off);
+}
+
 void FuseRamFs::FuseFlush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
     // TODO: Handle info in fi.
 
@@ -1386,7 +1773,7 @@ void FuseRamFs::FuseReadLink(fuse_req_t req, fuse_ino_t ino) {
 
     //const struct fuse_ctx* ctx_p = fuse_req_ctx(req);
 
-    fuse_reply_readlink(req, link_p->Link().c_str());
+    fuse_reply_readlink(req, link_p->Link());
 }
 
 void FuseRamFs::FuseStatfs(fuse_req_t req, fuse_ino_t ino) {
@@ -1502,6 +1889,23 @@ FuseRamFs::FuseCreate(fuse_req_t req, fuse_ino_t parent, const char *name, mode_
     }
 }
 
+void FuseRamFs::FuseFallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                              struct fuse_file_info *fi) {
+    std::shared_lock<std::shared_mutex> lk(crMutex);
+    Inode *inode = GetInode(ino);
+    if (inode == nullptr || inode->HasNoLinks()) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    File *file = dynamic_cast<File *>(inode);
+    if (file == nullptr) {
+        fuse_reply_err(req, S_ISDIR(inode->GetMode()) ? EISDIR : ENODEV);
+        return;
+    }
+    fuse_reply_err(req, file->Fallocate(mode, offset, length));
+}
+
 void FuseRamFs::FuseGetLock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct flock *lock) {
     // TODO: implement locking (Custom lock impl is only needed for distributed file systems)
     //inode_p->ReplyGetLock(req, lock);
@@ -31,6 +31,24 @@
 #include "cr.h"
 
 class Directory;
+struct pickle_baseline;
+
+/* A consistent copy of the file system and its state pool, owning its
+ * inodes; see FuseRamFs::snapshot(). */
+struct fs_snapshot {
+    verifs2_state live;
+    std::unordered_map<uint64_t, verifs2_state> states;
+
+    fs_snapshot() = default;
+    fs_snapshot(const fs_snapshot &) = delete;
+    fs_snapshot &operator=(const fs_snapshot &) = delete;
+    ~fs_snapshot();
+
+    void swap(fs_snapshot &other) {
+        std::swap(live, other.live);
+        states.swap(other.states);
+    }
+};
 
 class FuseRamFs {
 private:
@@ -51,6 +69,27 @@ private:
     static std::shared_mutex stbufMutex;
 
     static std::mutex renameMutex;
+
+    /* Background and periodic pickling */
+    static std::mutex pickleMutex;
+    static std::condition_variable pickleCond;
+    static std::thread pickleThread;
+    static std::thread autoPickleThread;
+    static std::string autoPicklePath;
+    static uint64_t autoPickleIntervalMs;
+    static uint64_t autoPickleGen;
+    static struct verifs_pickle_status pickleStatus;
+    /* The last image pickled, that delta images refer to */
+    static std::shared_ptr<const pickle_baseline> pickleBaseline;
+    /* Where FuseDestroy() pickles the file system to, if anywhere */
+    static std::string exitPicklePath;
+
+    /* Background compression of cold file chunks */
+    static std::mutex compressMutex;
+    static std::condition_variable compressCond;
+    static std::thread compressThread;
+    static uint64_t compressIdleMs;
+    static uint64_t compressGen;
     
 public:
     static struct fuse_lowlevel_ops FuseOps;
@@ -63,8 +102,26 @@ private:
     static void invalidate_kernel_states();
     static int restore(uint64_t key);
     static void check_restored_inode_size();
-    static int pickle_verifs2(void);
-    static int load_verifs2(void);
+    static int snapshot(fs_snapshot &snap);
+    static int snapshot_state(uint64_t key, fs_snapshot &snap);
+    static int pickle_verifs2(const char *path, uint32_t flags);
+    static int start_pickle(bool background);
+    static void finish_pickle(int res, const struct timespec &start, bool background,
+                              std::shared_ptr<const pickle_baseline> baseline);
+    static std::shared_ptr<const pickle_baseline> get_pickle_baseline(bool delta);
+    static int run_pickle(const char *path, bool background, uint32_t flags);
+    static int set_auto_pickle(const char *path, uint64_t interval_ms);
+    static void auto_pickle_loop(uint64_t gen);
+    static void stop_pickling();
+    static void get_pickle_status(struct verifs_pickle_status &status);
+    static int load_verifs2(const char *path, uint32_t flags);
+    static int load_verifs2(const std::vector<std::string> &chain, uint32_t flags);
+    static int export_state(uint64_t key, const char *path, uint32_t flags);
+    static int import_state(uint64_t key, const char *path, uint32_t flags);
+    static void set_compression(uint64_t idle_ms);
+    static void compress_loop(uint64_t gen);
+    static void compress_cold(uint64_t gen, uint64_t idle_ms);
+    static void get_compress_status(struct verifs_compress_status &status);
 
     /* Atomic inode table operations */
     static void DeleteInode(fuse_ino_t ino) {
@@ -96,6 +153,10 @@ private:
 public:
     FuseRamFs(fsblkcnt_t blocks = 0, fsfilcnt_t inodes = 0);
     ~FuseRamFs();
+
+    static int Preload(const char *path, uint32_t flags);
+    static void SetExitPickle(const char *path);
+    static void SetCompression(uint64_t idle_ms);
     
     static void FuseInit(void *userdata, struct fuse_conn_info *conn);
     static void FuseDestroy(void *userdata);
@@ -117,6 +178,7 @@ public:
     static void FuseRmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
     static void FuseForget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
     static void FuseWrite(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi);
+    static void FuseWriteBuf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi);
     static void FuseFlush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
     static void FuseRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
     static void FuseRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname);
@@ -142,6 +204,7 @@ public:
     static void FuseRemoveXAttr(fuse_req_t req, fuse_ino_t ino, const char *name);
     static void FuseAccess(fuse_req_t req, fuse_ino_t ino, int mask);
     static void FuseCreate(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
+    static void FuseFallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
     static void FuseGetLock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct flock *lock);
     
     static void UpdateUsedBlocks(ssize_t blocksAdded) {
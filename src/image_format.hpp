@@ -0,0 +1,213 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IMAGE_FORMAT_HPP_
+#define _IMAGE_FORMAT_HPP_
+
+#include <cstdint>
+#include <cstring>
+
+/* State image layout (all fixed-width integers are little-endian):
+ *
+ * |--header--|--section--|--section--|...|--section table--|--trailer--|
+ *
+ * header:  magic "RefFSImg" (8) | version (u32) | flags (u32) | reserved (48)
+ *          flags: IMAGE_FLAG_*
+ * section: type (varint) | key (varint) | payload
+ *          The payload is self-delimiting, so sections can be parsed one
+ *          after another without the table.
+ * table:   count (varint) | count * {type, key, offset, length} (varints)
+ *          offset and length cover the section header and payload.
+ * trailer: table offset (u64) | table length (u64) | sha256 (32) |
+ *          magic "RefFSEnd" (8)
+ *          The hash covers every byte before it.
+ *
+ * Section payload (both the live file system and state pool entries):
+ *   statvfs fields (varints) | ninodes (varint) | ninodes * inode slot |
+ *   ndeleted (varint) | ndeleted * ino (varint) | range index |
+ *   range index length (u64)
+ * where an inode slot is a presence byte (IMAGE_SLOT_*) followed, if the
+ * inode is stored, by its mode (varint) and the record written by
+ * Inode::Pickle().
+ *
+ * The inode slots are split into ranges of IMAGE_RANGE_INODES slots.  The
+ * range index, found from the end of the section, holds the range size and
+ * the count and byte length of the ranges (varints), so that the ranges can
+ * be loaded in parallel.
+ *
+ * A delta image (IMAGE_FLAG_DELTA) only stores what changed since a base
+ * image.  Its first section is IMAGE_SECTION_BASE, whose payload is the
+ * hash of the base image and the path it was written to (bytes).  Each
+ * other section is compared to a reference section of the base: the one of
+ * the same type and key, or else the live file system.  An inode slot may
+ * then be IMAGE_SLOT_BASE, meaning the inode is the one in the same slot of
+ * the reference section, and a state pool entry that is the same as its
+ * reference section as a whole is an IMAGE_SECTION_STATE_BASE section
+ * without a payload.  States missing from the section table are gone, as
+ * in a full image.
+ */
+
+#define IMAGE_MAGIC             "RefFSImg"
+#define IMAGE_TRAILER_MAGIC     "RefFSEnd"
+#define IMAGE_MAGIC_LEN         8
+#define IMAGE_VERSION           4
+#define IMAGE_HASH_LEN          32
+
+#define IMAGE_RANGE_INODES      4096
+/* Longest chain of delta images followed to find a full image */
+#define IMAGE_MAX_CHAIN         64
+
+#define IMAGE_FLAG_DELTA        (1U << 0)
+
+#define IMAGE_HEADER_SIZE       64
+#define IMAGE_TRAILER_SIZE      (8 + 8 + IMAGE_HASH_LEN + IMAGE_MAGIC_LEN)
+/* Number of trailing bytes not covered by the image hash */
+#define IMAGE_UNHASHED_SIZE     (IMAGE_HASH_LEN + IMAGE_MAGIC_LEN)
+
+enum image_section_type {
+    IMAGE_SECTION_LIVE = 1,     /* The mounted file system */
+    IMAGE_SECTION_STATE = 2,    /* A checkpoint in the state pool; key is the
+                                 * checkpoint key */
+    IMAGE_SECTION_BASE = 3,     /* The base of a delta image */
+    IMAGE_SECTION_STATE_BASE = 4,   /* A checkpoint that is the same as its
+                                     * reference section in the base image */
+};
+
+/* Presence byte of an inode slot */
+enum image_slot_type {
+    IMAGE_SLOT_NONE = 0,        /* No inode */
+    IMAGE_SLOT_INODE = 1,       /* The inode record follows */
+    IMAGE_SLOT_BASE = 2,        /* The inode is the same as in the reference
+                                 * section of the base image */
+};
+
+struct image_section {
+    uint32_t type;
+    uint64_t key;
+    uint64_t offset;
+    uint64_t length;
+};
+
+/* Variable-length integer encoding: 7 bits per byte, least significant
+ * group first, with the high bit set on all but the last byte. */
+static inline size_t varint_size(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+static inline char *put_varint(char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (char) ((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char) v;
+    return p;
+}
+
+/* Decode a varint in [p, end).  Returns the byte after it, or nullptr if
+ * it runs past end or is longer than any uint64_t takes.  p may be the
+ * nullptr of an earlier call, so that a run of fields is checked once. */
+static inline const char *get_varint(const char *p, const char *end, uint64_t &v) {
+    uint64_t res = 0;
+    v = 0;
+    if (p == nullptr)
+        return nullptr;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (p >= end)
+            return nullptr;
+        unsigned char byte = (unsigned char) *p++;
+        res |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            v = res;
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+/* Signed values (e.g. timestamps) are zigzag-encoded first so that small
+ * negative numbers stay short. */
+static inline uint64_t zigzag_encode(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static inline char *put_u32(char *p, uint32_t v) {
+    for (int i = 0; i < 4; ++i)
+        *p++ = (char) (v >> (8 * i));
+    return p;
+}
+
+static inline char *put_u64(char *p, uint64_t v) {
+    for (int i = 0; i < 8; ++i)
+        *p++ = (char) (v >> (8 * i));
+    return p;
+}
+
+static inline uint32_t get_u32(const char *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i)
+        v |= (uint32_t) (unsigned char) p[i] << (8 * i);
+    return v;
+}
+
+static inline uint64_t get_u64(const char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i)
+        v |= (uint64_t) (unsigned char) p[i] << (8 * i);
+    return v;
+}
+
+/* Doubles (entry/attr timeouts) are stored as their IEEE-754 bit pattern */
+static inline char *put_double(char *p, double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return put_u64(p, bits);
+}
+
+static inline double get_double(const char *p) {
+    uint64_t bits = get_u64(p);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+/* Length-prefixed byte strings */
+static inline size_t bytes_size(size_t len) {
+    return varint_size(len) + len;
+}
+
+static inline char *put_bytes(char *p, const void *data, size_t len) {
+    p = put_varint(p, len);
+    memcpy(p, data, len);
+    return p + len;
+}
+
+#endif // _IMAGE_FORMAT_HPP_
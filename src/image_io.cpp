@@ -0,0 +1,607 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <future>
+#include <linux/io_uring.h>
+
+#include "image_io.hpp"
+#include "pickle.hpp"
+#include "zero_scan.hpp"
+
+IoRing::IoRing(unsigned entries) : m_fd(-1), m_entries(0), m_sqRing(MAP_FAILED),
+    m_cqRing(MAP_FAILED), m_sqRingSize(0), m_cqRingSize(0), m_sqes(nullptr),
+    m_sqesSize(0) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return;
+
+    m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (m_sqRing != MAP_FAILED && !single_mmap) {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    } else {
+        m_cqRing = m_sqRing;
+    }
+    m_sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (m_sqRing == MAP_FAILED || m_cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, m_sqesSize);
+        if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+            munmap(m_cqRing, m_cqRingSize);
+        if (m_sqRing != MAP_FAILED)
+            munmap(m_sqRing, m_sqRingSize);
+        m_sqRing = m_cqRing = MAP_FAILED;
+        close(fd);
+        return;
+    }
+    m_sqes = (struct io_uring_sqe *) sqes;
+
+    char *sq = (char *) m_sqRing;
+    m_sqHead = (unsigned *) (sq + p.sq_off.head);
+    m_sqTail = (unsigned *) (sq + p.sq_off.tail);
+    m_sqMask = (unsigned *) (sq + p.sq_off.ring_mask);
+    m_sqArray = (unsigned *) (sq + p.sq_off.array);
+    char *cq = (char *) m_cqRing;
+    m_cqHead = (unsigned *) (cq + p.cq_off.head);
+    m_cqTail = (unsigned *) (cq + p.cq_off.tail);
+    m_cqMask = (unsigned *) (cq + p.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    m_entries = p.sq_entries;
+    m_fd = fd;
+}
+
+IoRing::~IoRing() {
+    if (m_fd < 0)
+        return;
+    munmap(m_sqes, m_sqesSize);
+    if (m_cqRing != m_sqRing)
+        munmap(m_cqRing, m_cqRingSize);
+    munmap(m_sqRing, m_sqRingSize);
+    close(m_fd);
+}
+
+int IoRing::Submit(bool write, int fd, void *buf, size_t len, uint64_t off,
+                   uint64_t data) {
+    unsigned tail = *m_sqTail;
+    if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_entries)
+        return -EBUSY;
+    unsigned index = tail & *m_sqMask;
+    struct io_uring_sqe *sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = data;
+    m_sqArray[index] = index;
+    __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, m_fd, 1, 0, 0, nullptr, 0) < 0) {
+        if (errno != EINTR) {
+            int err = errno;
+            /* Take the entry back; the kernel has not consumed it */
+            __atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+            return -err;
+        }
+    }
+    return 0;
+}
+
+int IoRing::Wait(uint64_t &data, int &res) {
+    while (true) {
+        unsigned head = *m_cqHead;
+        if (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &m_cqes[head & *m_cqMask];
+            data = cqe->user_data;
+            res = cqe->res;
+            __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS,
+                    nullptr, 0) < 0 && errno != EINTR)
+            return -errno;
+    }
+}
+
+static void pwrite_full(int fd, const char *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t res = pwrite(fd, buf, len, off);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            throw pickle_error(res < 0 ? errno : EIO, __func__, __LINE__);
+        buf += res;
+        len -= res;
+        off += res;
+    }
+}
+
+static void write_full(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t res = write(fd, buf, len);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            throw pickle_error(res < 0 ? errno : EIO, __func__, __LINE__);
+        buf += res;
+        len -= res;
+    }
+}
+
+ImageOutput::ImageOutput(int fd) : m_fd(fd), m_stream(false), m_direct(false),
+    m_sparse(false), m_base(0), m_offset(0), m_ring(IMAGE_IO_DEPTH), m_inflight(0), m_cur(0),
+    m_fill(0) {
+    struct stat st;
+    m_stream = (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode));
+    if (!m_stream) {
+        m_base = lseek(fd, 0, SEEK_CUR);
+        m_sparse = (m_base >= 0 && st.st_size <= m_base);
+        int flags = fcntl(fd, F_GETFL);
+        m_direct = (flags >= 0 && (flags & O_DIRECT));
+        /* Direct I/O needs an aligned start */
+        if (m_direct && m_base % IMAGE_IO_ALIGN != 0) {
+            fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+            m_direct = false;
+        }
+    }
+    for (unsigned i = 0; i < IMAGE_IO_DEPTH; ++i) {
+        void *buf = nullptr;
+        if (posix_memalign(&buf, IMAGE_IO_ALIGN, IMAGE_IO_CHUNK) != 0) {
+            for (char *b : m_bufs)
+                free(b);
+            throw pickle_error(ENOMEM, __func__, __LINE__);
+        }
+        m_bufs.push_back((char *) buf);
+    }
+    /* At most every other block of a chunk starts a run */
+    m_pending.resize(IMAGE_IO_DEPTH);
+    for (auto &p : m_pending)
+        p.reserve(IMAGE_IO_CHUNK / IMAGE_IO_ALIGN / 2 + 1);
+    m_pendingCount.assign(IMAGE_IO_DEPTH, 0);
+    m_pendingOff.assign(IMAGE_IO_DEPTH, 0);
+}
+
+ImageOutput::~ImageOutput() {
+    /* The kernel may still be reading from the buffers */
+    while (m_inflight > 0) {
+        uint64_t data;
+        int res;
+        if (m_ring.Wait(data, res) < 0)
+            break;
+        m_inflight--;
+    }
+    if (m_inflight == 0) {
+        for (char *b : m_bufs)
+            free(b);
+    }
+}
+
+/* Wait for one write from a buffer to complete */
+void ImageOutput::Reap() {
+    uint64_t data;
+    int res;
+    int ret = m_ring.Wait(data, res);
+    if (ret < 0)
+        throw pickle_error(-ret, __func__, __LINE__);
+    m_inflight--;
+    unsigned b = data & 0xffffffff;
+    struct pending_write w = m_pending[b][data >> 32];
+    if (--m_pendingCount[b] == 0)
+        m_pending[b].clear();
+    /* Kernels before 5.6 have no IORING_OP_WRITE */
+    if (res == -EINVAL)
+        res = 0;
+    if (res < 0)
+        throw pickle_error(-res, __func__, __LINE__);
+    /* Finish a short write synchronously */
+    if ((size_t) res < w.len)
+        pwrite_full(m_fd, m_bufs[b] + w.start + res, w.len - res,
+                    m_base + m_pendingOff[b] + w.start + res);
+}
+
+/* Write the len bytes at start in the current buffer */
+void ImageOutput::SubmitRun(size_t start, size_t len) {
+    char *buf = m_bufs[m_cur] + start;
+    uint64_t off = m_base + m_offset + start;
+    /* No more writes in flight than the ring has room for */
+    while (m_inflight >= IMAGE_IO_DEPTH)
+        Reap();
+    uint64_t data = (uint64_t) m_pending[m_cur].size() << 32 | m_cur;
+    if (!m_ring.Ready() || m_ring.Submit(true, m_fd, buf, len, off, data) < 0) {
+        pwrite_full(m_fd, buf, len, off);
+        return;
+    }
+    m_pending[m_cur].push_back({start, len});
+    m_pendingCount[m_cur]++;
+    m_pendingOff[m_cur] = m_offset;
+    m_inflight++;
+}
+
+/* Write out len bytes of the current buffer and move on to the next one */
+void ImageOutput::SubmitChunk(size_t len) {
+    char *buf = m_bufs[m_cur];
+    if (m_stream) {
+        write_full(m_fd, buf, len);
+    } else {
+        /* Leave out every zero block, writing the runs between them; the
+         * offsets stay aligned.  Finish() extends the file over a hole at
+         * the end. */
+        size_t from = 0;
+        while (from < len) {
+            size_t n = std::min((size_t) IMAGE_IO_ALIGN, len - from);
+            if (m_sparse && is_zero(buf + from, n)) {
+                from += n;
+                continue;
+            }
+            size_t to = from + n;
+            while (to < len) {
+                n = std::min((size_t) IMAGE_IO_ALIGN, len - to);
+                if (m_sparse && is_zero(buf + to, n))
+                    break;
+                to += n;
+            }
+            SubmitRun(from, to - from);
+            from = to;
+        }
+    }
+    m_offset += len;
+    m_cur = (m_cur + 1) % IMAGE_IO_DEPTH;
+    m_fill = 0;
+    while (m_pendingCount[m_cur] != 0)
+        Reap();
+}
+
+void ImageOutput::Write(const void *data, size_t len) {
+    const char *ptr = (const char *) data;
+    while (len > 0) {
+        size_t n = std::min(len, (size_t) IMAGE_IO_CHUNK - m_fill);
+        memcpy(m_bufs[m_cur] + m_fill, ptr, n);
+        m_fill += n;
+        ptr += n;
+        len -= n;
+        if (m_fill == IMAGE_IO_CHUNK)
+            SubmitChunk(IMAGE_IO_CHUNK);
+    }
+}
+
+void ImageOutput::WriteZeros(size_t len) {
+    while (len > 0) {
+        /* A chunk or more of zeros from a block boundary on is left as a
+         * hole without being copied; the buffer so far is written first */
+        if (m_sparse && m_fill % IMAGE_IO_ALIGN == 0 && len >= IMAGE_IO_CHUNK) {
+            if (m_fill > 0)
+                SubmitChunk(m_fill);
+            size_t hole = len / IMAGE_IO_ALIGN * IMAGE_IO_ALIGN;
+            m_offset += hole;
+            len -= hole;
+            continue;
+        }
+        size_t n = std::min(len, (size_t) IMAGE_IO_CHUNK - m_fill);
+        /* Up to the next block boundary, if a hole can start there */
+        if (m_sparse && len >= IMAGE_IO_CHUNK + IMAGE_IO_ALIGN)
+            n = std::min(n, IMAGE_IO_ALIGN - m_fill % IMAGE_IO_ALIGN);
+        memset(m_bufs[m_cur] + m_fill, 0, n);
+        m_fill += n;
+        len -= n;
+        if (m_fill == IMAGE_IO_CHUNK)
+            SubmitChunk(IMAGE_IO_CHUNK);
+    }
+}
+
+void ImageOutput::Finish() {
+    if (m_fill > 0) {
+        uint64_t end = m_offset + m_fill;
+        size_t len = m_fill;
+        if (m_direct) {
+            len = (m_fill + IMAGE_IO_ALIGN - 1) / IMAGE_IO_ALIGN * IMAGE_IO_ALIGN;
+            memset(m_bufs[m_cur] + m_fill, 0, len - m_fill);
+        }
+        SubmitChunk(len);
+        m_offset = end;
+    }
+    while (m_inflight > 0)
+        Reap();
+    if (m_stream)
+        return;
+    /* Cut off the padding of the last direct write, or extend the file
+     * over zeros left out at the end */
+    if ((m_direct || m_sparse) && ftruncate(m_fd, m_base + m_offset) < 0)
+        throw pickle_error(errno, __func__, __LINE__);
+    lseek(m_fd, m_base + m_offset, SEEK_SET);
+}
+
+/* Read at least min_len and at most max_len bytes; max_len may reach past
+ * the end of the file, to keep direct reads aligned */
+static int pread_chunk(int fd, char *buf, size_t min_len, size_t max_len, off_t off) {
+    size_t done = 0;
+    while (done < min_len) {
+        ssize_t res = pread(fd, buf + done, max_len - done, off + done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return -errno;
+        if (res == 0)
+            return -EMSGSIZE;
+        done += res;
+    }
+    return 0;
+}
+
+/* read_file_chunks: Read the first len bytes of a file.
+ *
+ * The file is read in chunks of IMAGE_IO_CHUNK with up to IMAGE_IO_DEPTH of
+ * them in flight, so that done() can process one chunk (e.g. hash it)
+ * while the next ones are read.
+ *
+ * @param[in] fd: The file, possibly opened with O_DIRECT
+ * @param[in] buf: At least len bytes rounded up to IMAGE_IO_ALIGN, aligned
+ *            to IMAGE_IO_ALIGN
+ * @param[in] done: Called with the offset and length of each chunk, in
+ *            order, once it has been read.  It may throw pickle_error.
+ *
+ * @return: 0 on success, or a negative error code.
+ */
+int read_file_chunks(int fd, char *buf, size_t len,
+                     const std::function<void(size_t, size_t)> &done) {
+    size_t nchunks = (len + IMAGE_IO_CHUNK - 1) / IMAGE_IO_CHUNK;
+    auto chunk_len = [&](size_t c) {
+        return std::min((size_t) IMAGE_IO_CHUNK, len - c * IMAGE_IO_CHUNK);
+    };
+    /* Requests cover whole aligned blocks; the tail past len is ignored */
+    auto request_len = [&](size_t c) {
+        return (chunk_len(c) + IMAGE_IO_ALIGN - 1) / IMAGE_IO_ALIGN * IMAGE_IO_ALIGN;
+    };
+
+    IoRing ring(IMAGE_IO_DEPTH);
+    std::vector<int> result(nchunks, INT_MIN);
+    size_t submitted = 0, completed = 0;
+    unsigned inflight = 0;
+    int ret = 0;
+    try {
+        while (completed < nchunks) {
+            /* Keep the ring full */
+            while (ring.Ready() && submitted < nchunks &&
+                   submitted < completed + IMAGE_IO_DEPTH) {
+                size_t off = submitted * IMAGE_IO_CHUNK;
+                if (ring.Submit(false, fd, buf + off, request_len(submitted), off,
+                                submitted) < 0)
+                    break;
+                inflight++;
+                submitted++;
+            }
+            size_t c = completed;
+            size_t off = c * IMAGE_IO_CHUNK;
+            if (c < submitted) {
+                while (result[c] == INT_MIN) {
+                    uint64_t data;
+                    int res;
+                    int err = ring.Wait(data, res);
+                    if (err < 0)
+                        throw pickle_error(-err, __func__, __LINE__);
+                    inflight--;
+                    result[data] = res;
+                }
+                /* Kernels before 5.6 have no IORING_OP_READ */
+                if (result[c] == -EINVAL)
+                    result[c] = 0;
+                if (result[c] < 0)
+                    throw pickle_error(-result[c], __func__, __LINE__);
+                /* Finish a short read synchronously */
+                if ((size_t) result[c] < chunk_len(c)) {
+                    int err = pread_chunk(fd, buf + off + result[c],
+                                          chunk_len(c) - result[c],
+                                          request_len(c) - result[c], off + result[c]);
+                    if (err < 0)
+                        throw pickle_error(-err, __func__, __LINE__);
+                }
+            } else {
+                int err = pread_chunk(fd, buf + off, chunk_len(c), request_len(c), off);
+                if (err < 0)
+                    throw pickle_error(-err, __func__, __LINE__);
+                submitted++;
+            }
+            done(off, chunk_len(c));
+            completed++;
+        }
+    } catch (const pickle_error &e) {
+        ret = -e.get_errno();
+    }
+    /* The kernel must be done with buf before the caller frees it */
+    while (inflight > 0) {
+        uint64_t data;
+        int res;
+        if (ring.Wait(data, res) < 0)
+            abort();
+        inflight--;
+    }
+    return ret;
+}
+
+/* Lease breaks are signalled with this, the broken lease's descriptor in
+ * si_fd.  It is sent to the watcher thread only, which keeps it blocked and
+ * waits for it, so no other thread is interrupted. */
+#define IMAGE_LEASE_SIGNAL  (SIGRTMIN + 1)
+
+/* Guards the holders, the watcher and the counts */
+static std::mutex lease_mutex;
+static std::map<int, ImageLease *> lease_holders;
+/* Thread id of the watcher, or 0, and the process it runs in: threads do
+ * not survive fork() (as in fuse_daemonize()), so a child needs its own */
+static pid_t lease_watcher;
+static pid_t lease_watcher_pid;
+/* Images copied into memory because they could not be leased, or were
+ * about to change; and the error of the last lease that failed */
+static uint64_t lease_copied;
+static uint64_t lease_detached;
+static int lease_error;
+
+void ImageLease::Watch() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, IMAGE_LEASE_SIGNAL);
+    while (true) {
+        siginfo_t info;
+        if (sigwaitinfo(&set, &info) < 0)
+            continue;
+        std::lock_guard<std::mutex> lock(lease_mutex);
+        Broken(info.si_fd, false);
+    }
+}
+
+/* Broken: Detach the holder of the lease on fd, if it is being broken (or
+ * anyway, if force), and let the writer go on.  Called with lease_mutex
+ * held. */
+void ImageLease::Broken(int fd, bool force) {
+    auto it = lease_holders.find(fd);
+    /* The lease may have been released since, and its descriptor reused by
+     * one that is not being broken */
+    if (it == lease_holders.end() || (!force && fcntl(fd, F_GETLEASE) == F_RDLCK))
+        return;
+    ImageLease *holder = it->second;
+    int err = holder->Detach();
+    /* Nothing better to do than to let the writer go on anyway */
+    if (err != 0)
+        fprintf(stderr, "Image lease: cannot detach from the image: %s\n",
+                strerror(err));
+    else
+        lease_detached++;
+    lease_holders.erase(it);
+    fcntl(fd, F_SETLEASE, F_UNLCK);
+    close(fd);
+    holder->m_leaseFd = -1;
+}
+
+/* StartWatcher: Start the watcher in this process, if not yet running.
+ * Called with lease_mutex held; returns false if it cannot be started. */
+bool ImageLease::StartWatcher() {
+    if (lease_watcher != 0 && lease_watcher_pid == getpid())
+        return true;
+    /* The watcher starts with the signal blocked, inheriting it */
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, IMAGE_LEASE_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    std::promise<pid_t> tid;
+    std::future<pid_t> started = tid.get_future();
+    try {
+        std::thread([&tid]() {
+            tid.set_value(syscall(SYS_gettid));
+            Watch();
+        }).detach();
+        lease_watcher = started.get();
+        lease_watcher_pid = getpid();
+    } catch (const std::system_error &e) {
+        lease_watcher = 0;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    return lease_watcher != 0;
+}
+
+int ImageLease::Take(int fd) {
+    int lease_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (lease_fd < 0)
+        return errno;
+    /* Register before the lease is set, so that a break arriving right
+     * away finds its holder */
+    std::lock_guard<std::mutex> lock(lease_mutex);
+    if (!StartWatcher()) {
+        close(lease_fd);
+        return ENOTSUP;
+    }
+    struct f_owner_ex owner = {F_OWNER_TID, lease_watcher};
+    if (fcntl(lease_fd, F_SETOWN_EX, &owner) != 0 ||
+        fcntl(lease_fd, F_SETSIG, IMAGE_LEASE_SIGNAL) != 0 ||
+        fcntl(lease_fd, F_SETLEASE, F_RDLCK) != 0) {
+        int err = errno;
+        close(lease_fd);
+        return err;
+    }
+    m_leaseFd = lease_fd;
+    lease_holders[lease_fd] = this;
+    return 0;
+}
+
+int ImageLease::Hold(int fd) {
+    int err = Take(fd);
+    if (err == 0)
+        return 0;
+    {
+        std::lock_guard<std::mutex> lock(lease_mutex);
+        if (lease_error == 0)
+            fprintf(stderr, "Image lease: cannot lease an image (%s); loaded "
+                    "images are copied into memory instead\n", strerror(err));
+        lease_error = err;
+        lease_copied++;
+    }
+    return Detach();
+}
+
+void ImageLease::Rearm() {
+    std::lock_guard<std::mutex> lock(lease_mutex);
+    if (lease_holders.empty() || lease_watcher_pid == getpid())
+        return;
+    std::vector<int> fds;
+    for (const auto &h : lease_holders)
+        fds.push_back(h.first);
+    bool started = StartWatcher();
+    struct f_owner_ex owner = {F_OWNER_TID, lease_watcher};
+    for (int fd : fds) {
+        /* Breaks signalled before the owner was set are lost: handle any
+         * under way.  Without a watcher, the holders detach now. */
+        bool rearmed = started && fcntl(fd, F_SETOWN_EX, &owner) == 0;
+        Broken(fd, !rearmed);
+    }
+}
+
+void ImageLease::Stats(uint64_t &copied, uint64_t &detached, int &error) {
+    std::lock_guard<std::mutex> lock(lease_mutex);
+    copied = lease_copied;
+    detached = lease_detached;
+    error = lease_error;
+}
+
+void ImageLease::Release() {
+    std::lock_guard<std::mutex> lock(lease_mutex);
+    if (m_leaseFd < 0)
+        return;
+    lease_holders.erase(m_leaseFd);
+    fcntl(m_leaseFd, F_SETLEASE, F_UNLCK);
+    close(m_leaseFd);
+    m_leaseFd = -1;
+}
@@ -0,0 +1,197 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IMAGE_IO_HPP_
+#define _IMAGE_IO_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+#include <sys/types.h>
+
+/* Image files are read and written in chunks of IMAGE_IO_CHUNK bytes, with
+ * up to IMAGE_IO_DEPTH chunks in flight.  Buffers, offsets and lengths are
+ * multiples of IMAGE_IO_ALIGN, as O_DIRECT requires. */
+#define IMAGE_IO_CHUNK      (4 << 20)
+#define IMAGE_IO_DEPTH      4
+#define IMAGE_IO_ALIGN      4096
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* IoRing: A minimal io_uring, set up with the raw system calls.
+ *
+ * Ready() is false if the kernel does not support io_uring (or it is
+ * disabled); callers then fall back to pread/pwrite.
+ */
+class IoRing {
+private:
+    int m_fd;
+    unsigned m_entries;
+    void *m_sqRing;
+    void *m_cqRing;
+    size_t m_sqRingSize;
+    size_t m_cqRingSize;
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqesSize;
+    unsigned *m_sqHead, *m_sqTail, *m_sqMask, *m_sqArray;
+    unsigned *m_cqHead, *m_cqTail, *m_cqMask;
+    struct io_uring_cqe *m_cqes;
+
+public:
+    explicit IoRing(unsigned entries);
+    ~IoRing();
+    IoRing(const IoRing &) = delete;
+    IoRing &operator=(const IoRing &) = delete;
+
+    bool Ready() const { return m_fd >= 0; }
+    /* Queue and submit one read or write; returns 0 or a negative error */
+    int Submit(bool write, int fd, void *buf, size_t len, uint64_t off,
+               uint64_t data);
+    /* Wait for one completion; returns 0 or a negative error */
+    int Wait(uint64_t &data, int &res);
+};
+
+/* ImageOutput: Writes an image to a file, pipe or socket.
+ *
+ * Files are written with positional writes through io_uring, so that
+ * serializing the next chunk overlaps with writing the previous ones.  If
+ * the file was opened with O_DIRECT, the last chunk is padded to
+ * IMAGE_IO_ALIGN and the file truncated afterwards.  Pipes and sockets are
+ * written with plain write().
+ *
+ * Blocks of IMAGE_IO_ALIGN zeros are not written if nothing was in the
+ * file there before, leaving holes, so that an image of mostly zero files
+ * takes little space and time to write; as they read as zeros, the format
+ * is the same either way.  Each run of other blocks in a chunk is written
+ * with a write of its own, and long runs of zeros from WriteZeros() skip
+ * the buffers altogether.
+ *
+ * Errors are thrown as pickle_error.
+ */
+class ImageOutput {
+private:
+    int m_fd;
+    bool m_stream;
+    bool m_direct;
+    /* Whether zero blocks may be left as holes: the file ended at m_base */
+    bool m_sparse;
+    off_t m_base;
+    /* Bytes handed to the kernel or left as holes so far */
+    uint64_t m_offset;
+    IoRing m_ring;
+    std::vector<char *> m_bufs;
+    /* Where in each buffer the writes in flight from it start, and their
+     * lengths; a write's completion data is its index here shifted left
+     * by 32, or'ed with the buffer's */
+    struct pending_write {
+        size_t start;
+        size_t len;
+    };
+    std::vector<std::vector<struct pending_write>> m_pending;
+    /* Writes still in flight from each buffer, and the offset it was for */
+    std::vector<unsigned> m_pendingCount;
+    std::vector<uint64_t> m_pendingOff;
+    unsigned m_inflight;
+    unsigned m_cur;
+    size_t m_fill;
+
+    void SubmitChunk(size_t len);
+    void SubmitRun(size_t start, size_t len);
+    void Reap();
+
+public:
+    explicit ImageOutput(int fd);
+    ~ImageOutput();
+    ImageOutput(const ImageOutput &) = delete;
+    ImageOutput &operator=(const ImageOutput &) = delete;
+
+    void Write(const void *data, size_t len);
+    /* Write len zeros */
+    void WriteZeros(size_t len);
+    /* Write out everything and leave the file offset after the image */
+    void Finish();
+};
+
+int read_file_chunks(int fd, char *buf, size_t len,
+                     const std::function<void(size_t, size_t)> &done);
+
+/* ImageLease: Keeps an image file from changing while it is loaded.
+ *
+ * Files loaded from an image refer to it until they are modified, through
+ * a private mapping or by reading it on first access.  A private mapping
+ * only keeps our writes out of the file, not the file's out of the
+ * mapping: pages not yet faulted in show later writes to the file, and
+ * pages past a truncated end fault with SIGBUS.  So an image must not be
+ * changed while loaded, and this enforces it.
+ *
+ * Take() puts a read lease (F_SETLEASE) on the image.  When anyone opens
+ * it for writing or truncates it, the kernel holds them off and signals a
+ * watcher thread, which then calls Detach() to move what the holder needs
+ * of the image into memory, and drops the lease to let the writer go on.
+ * If no lease can be had (the image is open for writing, belongs to
+ * someone else, or its file system has no leases), Hold() detaches the
+ * holder right away instead; this is logged the first time, and counted
+ * in Stats().
+ *
+ * Subclasses call Release() in their destructor, so that Detach() is not
+ * called on a half destroyed object.
+ */
+class ImageLease {
+private:
+    /* Our own descriptor of the image, holding the lease, or -1 */
+    int m_leaseFd;
+
+    static void Watch();
+    static void Broken(int fd, bool force);
+    static bool StartWatcher();
+
+protected:
+    /* Lease the image open at fd.  Returns 0, or an error number if no
+     * lease could be had. */
+    int Take(int fd);
+    /* Lease the image open at fd, or detach right away if no lease can be
+     * had.  Returns 0 or an error number. */
+    int Hold(int fd);
+    /* Drop the lease, if still held */
+    void Release();
+    /* Stop depending on the image file, while the lease still holds
+     * writers off.  Returns 0 or an error number. */
+    virtual int Detach() = 0;
+
+public:
+    ImageLease() : m_leaseFd(-1) {}
+    virtual ~ImageLease() { Release(); }
+    ImageLease(const ImageLease &) = delete;
+    ImageLease &operator=(const ImageLease &) = delete;
+
+    /* Point the leases taken before a fork() at a watcher in this process;
+     * FuseInit() calls it once fuse_daemonize() has forked */
+    static void Rearm();
+    /* Images copied into memory because no lease could be had, or because
+     * they were about to change, and the error of the last failed lease */
+    static void Stats(uint64_t &copied, uint64_t &detached, int &error);
+};
+
+#endif // _IMAGE_IO_HPP_
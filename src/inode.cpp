@@ -26,6 +26,7 @@
 
 #include "util.hpp"
 #include "inode.hpp"
+#include "serializer.hpp"
 
 using namespace std;
 
@@ -36,6 +37,19 @@ Inode::~Inode() {}
 #define FUSE_SET_ATTR_CTIME   (1 << 10)
 #endif
 
+/* Inodes other than files take the data in one buffer */
+int Inode::WriteBufAndReply(fuse_req_t req, struct fuse_bufvec *bufv, off_t off) {
+    size_t size = fuse_buf_size(bufv);
+    std::vector<char> buf(size);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = buf.data();
+    ssize_t res = fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags) 0);
+    if (res < 0) {
+        return fuse_reply_err(req, -res);
+    }
+    return WriteAndReply(req, buf.data(), res, off);
+}
+
 int Inode::ReplyEntry(fuse_req_t req) {
     m_nlookup++;
     std::shared_lock<std::shared_mutex> lk(entryRwSem);
@@ -246,15 +260,19 @@ int Inode::RemoveXAttrAndReply(fuse_req_t req, const string &name) {
 }
 
 int Inode::ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid) {
+    return fuse_reply_err(req, CheckAccess(mask, gid, uid));
+}
+
+int Inode::CheckAccess(int mask, gid_t gid, uid_t uid) {
     // If all the user wanted was to know if the file existed, it does.
     if (mask == F_OK) {
-        return fuse_reply_err(req, 0);
+        return 0;
     }
 
     std::shared_lock<std::shared_mutex> lk(entryRwSem);
     // Check other
     if ((m_fuseEntryParam.attr.st_mode & mask) == mask) {
-        return fuse_reply_err(req, 0);
+        return 0;
     }
     mask <<= 3;
 
@@ -262,7 +280,7 @@ int Inode::ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid) {
     if ((m_fuseEntryParam.attr.st_mode & mask) == mask) {
         // Go ahead if the user's main group is the same as the file's
         if (gid == m_fuseEntryParam.attr.st_gid) {
-            return fuse_reply_err(req, 0);
+            return 0;
         }
 
         // Now check the user's other groups. TODO: Where is this function?! not on this version of FUSE?
@@ -273,10 +291,10 @@ int Inode::ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid) {
 
     // Check owner.
     if ((uid == m_fuseEntryParam.attr.st_uid) && (m_fuseEntryParam.attr.st_mode & mask) == mask) {
-        return fuse_reply_err(req, 0);
+        return 0;
     }
 
-    return fuse_reply_err(req, EACCES);
+    return EACCES;
 }
 
 void Inode::Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid) {
@@ -313,108 +331,77 @@ void Inode::Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, ui
 #endif
 }
 
-size_t Inode::GetPickledSize() {
-    size_t res = 0;
-    res += sizeof(m_markedForDeletion) + sizeof(unsigned long) + sizeof(m_fuseEntryParam);
-    // xattrs
-    // a header telling how many xattrs there are
-    res += sizeof(size_t);
-    for (auto &it : m_xattr) {
-        // xattr key: <key_size><key_str>
-        res += sizeof(size_t);
-        res += it.first.size();
-        // xattr value: <val_size><val_data>
-        res += sizeof(size_t);
-        res += it.second.second;
-    }
-    return res;
+/* Inode record format:
+ * |--m_markedForDeletion (1)--|--m_nlookup--|--ino--|--generation--|...
+ * --st_dev--|--st_ino--|--st_mode--|--st_nlink--|--st_uid--|--st_gid--|...
+ * --st_rdev--|--st_size--|--st_blksize--|--st_blocks--|...
+ * --atime sec--|--atime nsec--|--mtime sec--|--mtime nsec--|...
+ * --ctime sec--|--ctime nsec--|--attr_timeout (8)--|--entry_timeout (8)--|...
+ * --num_xattrs--|--xattr1_keysize--|--xattr1_keystr--|...
+ * --xattr1_valsize--|--xattr1_valdata--|--xattr2_keysize--|--xattr2_...--|...
+ *
+ * Integers are varints; signed attributes (sizes and timestamp seconds) are
+ * zigzag-encoded first, and doubles are little-endian IEEE-754 (see
+ * image_format.hpp), so the format does not depend on struct layout.
+ */
+template <class Archive>
+void Inode::Serialize(Archive &ar) {
+    struct stat &st = m_fuseEntryParam.attr;
+#ifdef __APPLE__
+    struct timespec &atim = st.st_atimespec;
+    struct timespec &mtim = st.st_mtimespec;
+    struct timespec &ctim = st.st_ctimespec;
+#else
+    struct timespec &atim = st.st_atim;
+    struct timespec &mtim = st.st_mtim;
+    struct timespec &ctim = st.st_ctim;
+#endif
+    if constexpr (Archive::kLoading)
+        memset(&m_fuseEntryParam, 0, sizeof(m_fuseEntryParam));
+    ar.Flag(m_markedForDeletion);
+    ar.Varint(m_nlookup);
+    ar.Varint(m_fuseEntryParam.ino);
+    ar.Varint(m_fuseEntryParam.generation);
+    ar.Varint(st.st_dev);
+    ar.Varint(st.st_ino);
+    ar.Varint(st.st_mode);
+    ar.Varint(st.st_nlink);
+    ar.Varint(st.st_uid);
+    ar.Varint(st.st_gid);
+    ar.Varint(st.st_rdev);
+    ar.Zigzag(st.st_size);
+    ar.Zigzag(st.st_blksize);
+    ar.Zigzag(st.st_blocks);
+    ar.Zigzag(atim.tv_sec);
+    ar.Varint(atim.tv_nsec);
+    ar.Zigzag(mtim.tv_sec);
+    ar.Varint(mtim.tv_nsec);
+    ar.Zigzag(ctim.tv_sec);
+    ar.Varint(ctim.tv_nsec);
+    ar.Double(m_fuseEntryParam.attr_timeout);
+    ar.Double(m_fuseEntryParam.entry_timeout);
+    ar.Sequence(m_xattr, [&](auto &name, auto &value) {
+        ar.String(name);
+        ar.Blob(value.first, value.second);
+    });
 }
 
-size_t Inode::Pickle(void *&buf) {
-    if (buf == nullptr)
-        buf = malloc(GetPickledSize());
-    if (buf == nullptr)
-        return 0;
+template void Inode::Serialize(PickleSizer &ar);
+template void Inode::Serialize(PickleWriter &ar);
+template void Inode::Serialize(PickleReader &ar);
 
-    char *ptr = (char *) buf;
-    // bool m_markedForDeletion;
-    *ptr++ = m_markedForDeletion ? 1 : 0;
-    // std::atomic_ulong m_nlookup;
-    unsigned long nlookup = m_nlookup.load();
-    memcpy(ptr, &nlookup, sizeof(nlookup));
-    ptr += sizeof(nlookup);
-    // struct fuse_entry_param m_fuseEntryParam;
-    memcpy(ptr, &m_fuseEntryParam, sizeof(m_fuseEntryParam));
-    ptr += sizeof(m_fuseEntryParam);
-    // how many xattrs are there
-    size_t num_xattrs = m_xattr.size();
-    memcpy(ptr, &num_xattrs, sizeof(num_xattrs));
-    ptr += sizeof(num_xattrs);
-    // pickle xattrs
-    for (auto &it : m_xattr) {
-        size_t keysize = it.first.size();
-        const char *keystr = it.first.c_str();
-        size_t valsize = it.second.second;
-        char *valdata = (char *) it.second.first;
-        memcpy(ptr, &keysize, sizeof(keysize));
-        ptr += sizeof(keysize);
-        memcpy(ptr, keystr, keysize);
-        ptr += keysize;
-        memcpy(ptr, &valsize, sizeof(valsize));
-        ptr += sizeof(valsize);
-        memcpy(ptr, valdata, valsize);
-        ptr += valsize;
-    }
-    return (size_t) (ptr - (char *) buf);
+size_t Inode::GetPickledSize() {
+    PickleSizer sizer;
+    Serialize(sizer);
+    return sizer.Size();
 }
 
-/* Inode pickle format: 
- * |--m_markedForDeletion--|--m_nlookup--|-------m_fuseEntryParam--------|...
- * --num_xattrs--|--xattr1_keysize--|-----xattr1_keystr-----|--xattr1_valsize--|...
- * ------xattr1_valdata-------|--xattr2_keysize--|-----xattr2_keystr-----|...
- * --xattr2_valsize--|-------xattr2_valdata-------|--xattr3_keysize--|--xattr3_...--|...
- */
+void Inode::Pickle(PickleWriter &out) {
+    Serialize(out);
+}
 
-size_t Inode::Load(const void *&buf) {
-    const char *ptr = (const char *) buf;
-    // bool m_markedForDeletion
-    m_markedForDeletion = *ptr++;
-    // std::atomic_ulong m_nlookup;
-    unsigned long nlookup;
-    memcpy(&nlookup, ptr, sizeof(nlookup));
-    m_nlookup.store(nlookup);
-    ptr += sizeof(nlookup);
-    // struct fuse_entry_param m_fuseEntryParam;
-    memcpy(&m_fuseEntryParam, ptr, sizeof(m_fuseEntryParam));
-    ptr += sizeof(m_fuseEntryParam);
-    // num_xattrs
-    size_t n_xattrs;
-    memcpy(&n_xattrs, ptr, sizeof(n_xattrs));
-    ptr += sizeof(n_xattrs);
-
-    m_xattr.clear();
-    // load xattrs
-    for (size_t i = 0; i < n_xattrs; ++i) {
-        // key
-        size_t keysize;
-        memcpy(&keysize, ptr, sizeof(keysize));
-        ptr += sizeof(keysize);
-        std::string key(ptr, keysize);
-        ptr += keysize;
-        // value
-        size_t valsize;
-        memcpy(&valsize, ptr, sizeof(valsize));
-        ptr += sizeof(valsize);
-        char *value = (char *) malloc(valsize);
-        if (value == nullptr)
-            goto error;
-        memcpy(value, ptr, valsize);
-        ptr += valsize;
-        // add to xattrs tree
-        m_xattr.insert({key, {value, valsize}});
-    }
-    return ptr - (char *) buf;
-    error:
-    ClearXAttrs();
-    return 0;
+void Inode::Load(PickleReader &in) {
+    Serialize(in);
+    if (in.Error() != 0)
+        ClearXAttrs();
 }
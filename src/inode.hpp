@@ -26,6 +26,11 @@
 
 #include "common.h"
 
+class PickleSizer;
+class PickleWriter;
+class PickleReader;
+class PickleStream;
+
 class Inode {
 private:    
     bool m_markedForDeletion;
@@ -64,6 +69,8 @@ public:
     
     virtual int WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off) = 0;
     virtual int ReadAndReply(fuse_req_t req, size_t size, off_t off) = 0;
+    /* Write data that may still be in the pipe it was spliced into */
+    virtual int WriteBufAndReply(fuse_req_t req, struct fuse_bufvec *bufv, off_t off);
     int ReplyEntry(fuse_req_t req);
     int ReplyCreate(fuse_req_t req, struct fuse_file_info *fi);
     // TODO: Should this be GetAttr?
@@ -77,6 +84,8 @@ public:
     virtual int ListXAttrAndReply(fuse_req_t req, size_t size);
     virtual int RemoveXAttrAndReply(fuse_req_t req, const std::string &name);
     virtual int ReplyAccess(fuse_req_t req, int mask, gid_t gid, uid_t uid);
+    /* Returns 0 or EACCES, like ReplyAccess() replies */
+    int CheckAccess(int mask, gid_t gid, uid_t uid);
     
     /* Atomic file attribute operations */
     void IncrementLinkCount() {
@@ -119,24 +128,32 @@ public:
     fuse_ino_t GetIno() { return m_fuseEntryParam.attr.st_ino; }
     
     bool Forgotten() { return m_nlookup == 0; }
+    /* NOTE: Not guarded; for offline tools that own the inode. */
+    const std::map<std::string, std::pair<void *, size_t> > &XAttrs() { return m_xattr; }
+
+    /* Serialize: Visit the fields of the inode record in order, to size,
+     * write or read it (see serializer.hpp).  Each subclass appends its own
+     * fields after these. */
+    template <class Archive> void Serialize(Archive &ar);
 
+    /* The size of the record Pickle() writes */
     virtual size_t GetPickledSize();
 
-    /* Pickle: Serialize the Inode object.
-     *
-     * NOTE: This function does NOT consider implementation or architecture
-     * specific data type length or byte order, so it's not recommended to
-     * pickle and unpickle on different machines. 
+    /* Pickle: Serialize the Inode object, appending it to out.
      *
-     * @param[in] The pointer to the buffer. If the buffer is nullptr, Pickle
-     * will automatically allocate sufficient buffer to store the data.
-     * If buf is not null, it must provide at least GetPickledSize() bytes of
-     * buffer, otherwise the behavior is undefined.
+     * Fields are encoded one by one as varints or little-endian values
+     * (see image_format.hpp), so the result does not depend on struct
+     * layout or byte order of the machine.  The record is written in a
+     * single pass, without computing its size first.  File contents are
+     * left for out.StreamContents().
      *
-     * @return The size of serialized object
+     * Only fails, setting out.Error(), if out cannot grow, or if file
+     * contents cannot be read from a lazily loaded image when streamed.
      */
-    virtual size_t Pickle(void* &buf);
-    virtual size_t Load(const void* &buf);
+    virtual void Pickle(PickleWriter &out);
+    /* Load: Read the record written by Pickle().  On failure in.Error() is
+     * set, and the inode is only good for deleting. */
+    virtual void Load(PickleReader &in);
 
     friend class FuseRamFs;
     friend class File;
@@ -26,11 +26,54 @@
 #include <mcfs/errnoname.h>
 #include "common.h"
 #include "cr.h"
+#include "tool_util.hpp"
+#include <sys/wait.h>
 
 int main(int argc, char **argv)
 {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <mountpoint> <output-file>\n", argv[0]);
+    // -l: lazy load, file contents are read from the image on first access
+    // -n: do not verify the image hash
+    // -D: read the image with direct I/O, around the page cache
+    // -k <key>: add the image to the state pool as checkpoint <key>
+    uint32_t flags = 0;
+    bool import_state = false;
+    uint64_t key = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "lnDk:")) != -1) {
+        if (opt == 'l') {
+            flags |= VERIFS_IMAGE_LAZY;
+        } else if (opt == 'n') {
+            flags |= VERIFS_IMAGE_NOVERIFY;
+        } else if (opt == 'D') {
+            flags |= VERIFS_IMAGE_DIRECT;
+        } else if (opt == 'k') {
+            import_state = true;
+            key = parse_key(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-l] [-n] [-D] [-k <key>] <mountpoint> <input-file|-> "
+                    "[<delta-file>...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind < 2) {
+        fprintf(stderr, "Usage: %s [-l] [-n] [-D] [-k <key>] <mountpoint> <input-file|-> "
+                "[<delta-file>...]\n", argv[0]);
+        exit(1);
+    }
+    int nimages = argc - optind - 1;
+    argv += optind - 1;
+    // "-": read the image from stdin
+    bool streaming = (strcmp(argv[2], "-") == 0);
+    if (streaming && (flags & VERIFS_IMAGE_LAZY)) {
+        fprintf(stderr, "-l cannot be used with -\n");
+        exit(1);
+    }
+    if (streaming && nimages > 1) {
+        fprintf(stderr, "Delta images cannot be used with -\n");
+        exit(1);
+    }
+    if (import_state && nimages > 1) {
+        fprintf(stderr, "-k takes a single image\n");
         exit(1);
     }
 
@@ -41,27 +84,67 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    // write the config file to pass the output file path
-    int cfgfd = open(VERIFS_LOAD_CFG, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (cfgfd < 0) {
-        fprintf(stderr, "Cannot open/create %s: (%d:%s)\n", VERIFS_LOAD_CFG,
-                errno, errnoname(errno));
-        exit(2);
+    // pass the input file path in the ioctl payload; the file system
+    // resolves it relative to its own working directory, so make it absolute
+    struct verifs_image_arg iarg;
+    memset(&iarg, 0, sizeof(iarg));
+    iarg.version = VERIFS_IMAGE_ARG_VERSION;
+    iarg.flags = flags;
+    int len;
+    int pipefd[2] = {-1, -1};
+    pid_t pump = -1;
+    if (streaming) {
+        // the file system reads from a pipe, opened through /proc, and a
+        // child process copies stdin to it
+        if (pipe(pipefd) < 0 || (pump = fork()) < 0) {
+            fprintf(stderr, "Cannot create pipe: (%d:%s)\n", errno, errnoname(errno));
+            exit(2);
+        }
+        if (pump == 0) {
+            close(pipefd[0]);
+            copy_stream(STDIN_FILENO, pipefd[1]);
+            _exit(0);
+        }
+        close(pipefd[1]);
+        len = snprintf(iarg.path, sizeof(iarg.path), "/proc/%d/fd/%d",
+                       getpid(), pipefd[0]);
+    } else if (nimages == 1) {
+        len = absolute_path(argv[2], iarg.path, sizeof(iarg.path));
+    } else {
+        // a base image and its deltas: NUL-separated paths, ending with an
+        // empty one (the payload is zeroed)
+        iarg.flags |= VERIFS_IMAGE_DELTA;
+        len = 0;
+        for (int i = 0; i < nimages && len < (int) sizeof(iarg.path) - 1; ++i) {
+            len += absolute_path(argv[2 + i], iarg.path + len,
+                                 sizeof(iarg.path) - 1 - len) + 1;
+        }
     }
-    size_t pathlen = strnlen(argv[2], PATH_MAX);
-    ssize_t res = write(cfgfd, argv[2], pathlen);
-    if (res < 0) {
-        fprintf(stderr, "Cannot write parameter to %s: (%d:%s)\n",
-                VERIFS_LOAD_CFG, errno, errnoname(errno));
+    if (len >= (int) sizeof(iarg.path)) {
+        fprintf(stderr, "Path too long: %s\n", argv[2]);
         exit(3);
     }
-    close(cfgfd);
 
     // call the ioctl
-    int ret = ioctl(dirfd, VERIFS_LOAD, nullptr);
+    int ret;
+    if (import_state) {
+        struct verifs_state_arg sarg;
+        memset(&sarg, 0, sizeof(sarg));
+        sarg.version = VERIFS_IMAGE_ARG_VERSION;
+        sarg.flags = flags;
+        sarg.key = key;
+        memcpy(sarg.path, iarg.path, sizeof(sarg.path));
+        ret = ioctl(dirfd, VERIFS_IMPORT_STATE, &sarg);
+    } else {
+        ret = ioctl(dirfd, VERIFS_LOAD_ARG, &iarg);
+    }
     if (ret != 0) {
-        printf("Result: ret = %d, errno = %d (%s)\n",
-               ret, errno, errnoname(errno));
+        fprintf(streaming ? stderr : stdout, "Result: ret = %d, errno = %d (%s)\n",
+                ret, errno, errnoname(errno));
+    }
+    if (streaming) {
+        close(pipefd[0]);
+        waitpid(pump, nullptr, 0);
     }
     close(dirfd);
     return (ret == 0) ? 0 : 1;
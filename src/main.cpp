@@ -25,7 +25,9 @@
 #include "common.h"
 
 #include "inode.hpp"
+#include "chunk_pool.hpp"
 #include "fuse_cpp_ramfs.hpp"
+#include "cr.h"
 
 using namespace std;
 
@@ -68,6 +70,31 @@ int main(int argc, const char * argv[]) {
     // The core code for our filesystem.
     size_t nblocks = options.capacity / Inode::BufBlockSize;
     FuseRamFs core(nblocks, options.inodes);
+
+    // Before any file contents are allocated
+    if (options.spill) {
+        int res = ChunkPool::SetBacking(options.spill, options.spill_after);
+        if (res != 0) {
+            cerr << "Cannot spill to " << options.spill << ": " << strerror(res) << endl;
+            return 1;
+        }
+    }
+
+    // Load the image now, so that a bad one fails the mount
+    if (options.load) {
+        int res = FuseRamFs::Preload(options.load,
+                                     options.load_lazy ? VERIFS_IMAGE_LAZY : 0);
+        if (res != 0) {
+            cerr << "Cannot load " << options.load << ": " << strerror(-res) << endl;
+            return 1;
+        }
+    }
+    if (options.pickle_on_exit) {
+        FuseRamFs::SetExitPickle(options.pickle_on_exit);
+    }
+    if (options.compress_idle) {
+        FuseRamFs::SetCompression(options.compress_idle * 1000);
+    }
     
     if (options.subtype) {
         mountpoint = options.mountpoint;
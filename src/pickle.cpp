@@ -23,12 +23,11 @@
  */
 
 #include "common.h"
+#include <new>
 #include <sys/stat.h>
-#include <mcfs/errnoname.h>
-#include <exception>
-#include <openssl/sha.h>
-#include <openssl/evp.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "inode.hpp"
 #include "file.hpp"
@@ -36,186 +35,402 @@
 #include "symlink.hpp"
 #include "special_inode.hpp"
 #include "fuse_cpp_ramfs.hpp"
+#include "pickle.hpp"
+#include "image_io.hpp"
+#include "serializer.hpp"
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+ImageHash::ImageHash() {
+    m_ctx = EVP_MD_CTX_new();
+    if (m_ctx == nullptr || EVP_DigestInit_ex(m_ctx, EVP_sha256(), NULL) == 0)
+        throw pickle_error(EPROTO, __func__, __LINE__);
+}
+
+ImageHash::~ImageHash() {
+    EVP_MD_CTX_free(m_ctx);
+}
+
+void ImageHash::Update(const void *data, size_t len) {
+    if (EVP_DigestUpdate(m_ctx, data, len) == 0)
+        throw pickle_error(EPROTO, __func__, __LINE__);
+}
+
+void ImageHash::Final(unsigned char *digest) {
+    unsigned int sha256_digest_len = EVP_MD_size(EVP_sha256());
+    if (EVP_DigestFinal_ex(m_ctx, digest, &sha256_digest_len) == 0)
+        throw pickle_error(EPROTO, __func__, __LINE__);
+}
+#else
+ImageHash::ImageHash() {
+    if (SHA256_Init(&m_ctx) == 0)
+        throw pickle_error(EPROTO, __func__, __LINE__);
+}
+
+ImageHash::~ImageHash() {}
+
+void ImageHash::Update(const void *data, size_t len) {
+    if (SHA256_Update(&m_ctx, data, len) == 0)
+        throw pickle_error(EPROTO, __func__, __LINE__);
+}
+
+void ImageHash::Final(unsigned char *digest) {
+    if (SHA256_Final(digest, &m_ctx) == 0)
+        throw pickle_error(EPROTO, __func__, __LINE__);
+}
+#endif
+
+/* ImageWriter: Hashed output of an image.
+ *
+ * The bytes go through ImageOutput, which keeps several chunks of the
+ * image in flight to the file.  File contents are streamed to it (see
+ * PickleWriter::StreamContents()). */
+class ImageWriter : public PickleStream {
+private:
+    ImageOutput m_out;
+    ImageHash m_hash;
+    uint64_t m_offset;
 
-class pickle_error : public std::exception {
 public:
-    int _errno;
-    std::string func;
-    int line;
+    explicit ImageWriter(int fd) : m_out(fd), m_offset(0) {}
 
-    pickle_error(int err, std::string func, int line) noexcept {
-        _errno = err;
-        this->func = func;
-        this->line;
-        fprintf(stderr, "Pickling error %s(%d) at %s:%d.\n",
-                errnoname(_errno), _errno, func.c_str(), line);
+    /* Bytes written to the image so far */
+    uint64_t Offset() const { return m_offset; }
+
+    /* Write out the image; nothing may be written after this */
+    void Flush() {
+        m_out.Finish();
     }
 
-    pickle_error(const pickle_error &other) {
-        _errno = other._errno;
-        func = other.func;
-        line = other.line;
+    void Write(const void *data, size_t len) override {
+        m_hash.Update(data, len);
+        m_offset += len;
+        m_out.Write(data, len);
     }
 
-    const char *what() const noexcept {
-        return errnoname(errno);
+    /* Zeros are only hashed from a buffer; the output leaves holes */
+    void Zeros(size_t len) override {
+        static const char zeros[IMAGE_IO_ALIGN] = {};
+        m_offset += len;
+        m_out.WriteZeros(len);
+        while (len > 0) {
+            size_t n = std::min(len, sizeof(zeros));
+            m_hash.Update(zeros, n);
+            len -= n;
+        }
     }
 
-    int get_errno() const noexcept {
-        return _errno;
+    void WriteVarint(uint64_t v) {
+        char tmp[10];
+        char *end = put_varint(tmp, v);
+        Write(tmp, end - tmp);
     }
-};
 
-struct state_file_header {
-    size_t fsize;
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-};
+    /* Write the hash of everything written so far, unhashed, and return it
+     * in digest */
+    void WriteHash(unsigned char *digest) {
+        m_hash.Final(digest);
+        WriteUnhashed(digest, IMAGE_HASH_LEN);
+    }
 
-struct inode_state {
-    bool exist;
-    mode_t mode;
+    void WriteUnhashed(const void *data, size_t len) {
+        m_out.Write(data, len);
+        m_offset += len;
+    }
 };
 
-#if OPENSSL_VERSION_NUMBER >= 0x30000000L
-static void feed_hash(EVP_MD_CTX *hashctx, const void *data, size_t len) {
-    if (hashctx == nullptr)
-        return;
-    int ret = EVP_DigestUpdate(hashctx, data, len);
-    if (ret == 0)
-        throw pickle_error(EPROTO, __func__, __LINE__);
+/* Longest encoding of a statvfs, see put_statvfs() */
+#define STATVFS_MAX_SIZE    (11 * 10)
+
+static char *put_statvfs(char *p, const struct statvfs &st) {
+    p = put_varint(p, st.f_bsize);
+    p = put_varint(p, st.f_frsize);
+    p = put_varint(p, st.f_blocks);
+    p = put_varint(p, st.f_bfree);
+    p = put_varint(p, st.f_bavail);
+    p = put_varint(p, st.f_files);
+    p = put_varint(p, st.f_ffree);
+    p = put_varint(p, st.f_favail);
+    p = put_varint(p, st.f_fsid);
+    p = put_varint(p, st.f_flag);
+    p = put_varint(p, st.f_namemax);
+    return p;
 }
-#else
-static void feed_hash(SHA256_CTX *hashctx, const void *data, size_t len) {
-    if (hashctx == nullptr)
-        return;
-    int ret = SHA256_Update(hashctx, data, len);
-    if (ret == 0)
-        throw pickle_error(EPROTO, __func__, __LINE__);
+
+/* Returns the end of the statvfs, or nullptr if it runs past end */
+static const char *load_statvfs(const char *ptr, const char *end, struct statvfs &st) {
+    uint64_t v;
+    memset(&st, 0, sizeof(st));
+    ptr = get_varint(ptr, end, v); st.f_bsize = v;
+    ptr = get_varint(ptr, end, v); st.f_frsize = v;
+    ptr = get_varint(ptr, end, v); st.f_blocks = v;
+    ptr = get_varint(ptr, end, v); st.f_bfree = v;
+    ptr = get_varint(ptr, end, v); st.f_bavail = v;
+    ptr = get_varint(ptr, end, v); st.f_files = v;
+    ptr = get_varint(ptr, end, v); st.f_ffree = v;
+    ptr = get_varint(ptr, end, v); st.f_favail = v;
+    ptr = get_varint(ptr, end, v); st.f_fsid = v;
+    ptr = get_varint(ptr, end, v); st.f_flag = v;
+    ptr = get_varint(ptr, end, v); st.f_namemax = v;
+    return ptr;
 }
-#endif
-static size_t write_to_file(int fd, const void *buf, size_t count) {
-    errno = 0;
-    size_t res = write(fd, buf, count);
-    if (res < count) {
-        throw pickle_error(errno, __func__, __LINE__);
+
+/* fingerprint: A digest of a pickled record and the version of its
+ * contents, to tell whether it changed since an earlier image.  Never all
+ * zeros, which stands for an empty slot. */
+static image_digest fingerprint(const char *data, size_t len, uint64_t version) {
+    ImageHash hash;
+    char v[8];
+    hash.Update(data, len);
+    hash.Update(v, put_u64(v, version) - v);
+    image_digest fp;
+    hash.Final(fp.data());
+    return fp;
+}
+
+/* Fingerprint of everything in a section but the inode slots */
+static image_digest frame_fingerprint(const struct statvfs &fs_stat, size_t num_inodes,
+                                      std::queue<fuse_ino_t> pending_delete_inodes) {
+    std::vector<char> buf(STATVFS_MAX_SIZE + 20 + 10 * pending_delete_inodes.size());
+    char *p = put_statvfs(buf.data(), fs_stat);
+    p = put_varint(p, num_inodes);
+    p = put_varint(p, pending_delete_inodes.size());
+    while (!pending_delete_inodes.empty()) {
+        p = put_varint(p, pending_delete_inodes.front());
+        pending_delete_inodes.pop();
     }
-    return res;
+    return fingerprint(buf.data(), p - buf.data(), 0);
 }
 
-static inline size_t write_and_hash(int fd, SHA256_CTX *hashctx, EVP_MD_CTX *ctx,
-                                    const void *data, size_t count) {
-    size_t res = write_to_file(fd, data, count);
-#if OPENSSL_VERSION_NUMBER >= 0x30000000L    
-    feed_hash(ctx, data, count);
-#else
-    feed_hash(hashctx, data, count);
-#endif
-    return res;
+/* pickle_slot: Pickle the mode and record of an inode into rec, but for
+ * the contents, which are streamed by stream_slot() */
+static void pickle_slot(Inode *inode, PickleWriter &rec) {
+    rec.Reset();
+    rec.Varint(inode->GetMode());
+    inode->Pickle(rec);
+    if (rec.Error() != 0)
+        throw pickle_error(rec.Error(), __func__, __LINE__);
 }
 
+/* stream_slot: Write the contents of the record in rec to out */
+static void stream_slot(PickleWriter &rec, PickleStream &out) {
+    rec.StreamContents(out);
+    /* Fails if a lazily loaded file cannot be read from its image */
+    if (rec.Error() != 0)
+        throw pickle_error(rec.Error(), __func__, __LINE__);
+}
 
-int pickle_file_system(int fd, std::vector<Inode *> &inodes,
-                       std::queue<fuse_ino_t> &pending_delete_inodes,
-                       struct statvfs &fs_stat, SHA256_CTX *hashctx, EVP_MD_CTX *ctx) {
+/* slot_fingerprint: The fingerprint of the record in rec; the contents
+ * are not read */
+static image_digest slot_fingerprint(const PickleWriter &rec) {
+    return fingerprint(rec.Data(), rec.Length(), rec.ContentsVersion());
+}
+
+/* section_unchanged: Check whether a file system state is exactly its
+ * reference section in a base image.  If so, fp is filled in as
+ * pickle_section() would. */
+static bool section_unchanged(const std::vector<Inode *> &inodes,
+                              const std::queue<fuse_ino_t> &pending_delete_inodes,
+                              const struct statvfs &fs_stat,
+                              const struct section_fingerprint &base,
+                              struct section_fingerprint &fp) {
+    fp.frame = frame_fingerprint(fs_stat, inodes.size(), pending_delete_inodes);
+    if (fp.frame != base.frame || inodes.size() != base.slots.size())
+        return false;
+    fp.slots.assign(inodes.size(), image_digest());
+    PickleWriter rec;
+    for (size_t i = 0; i < inodes.size(); ++i) {
+        if (inodes[i] != nullptr) {
+            pickle_slot(inodes[i], rec);
+            fp.slots[i] = slot_fingerprint(rec);
+        }
+        if (fp.slots[i] != base.slots[i])
+            return false;
+    }
+    return true;
+}
+
+/* pickle_section: Write one file system state (the live one, or one in the
+ * state pool) as a section and record it in the section table.
+ *
+ * @param[in]  base: Fingerprints of the reference section in the base image
+ *             of a delta image; inodes that did not change are not written.
+ * @param[out] fp: Fingerprints of the section written.
+ */
+static void pickle_section(ImageWriter &w, uint32_t type, uint64_t key,
+                           const std::vector<Inode *> &inodes,
+                           std::queue<fuse_ino_t> pending_delete_inodes,
+                           const struct statvfs &fs_stat,
+                           std::vector<struct image_section> &table,
+                           const struct section_fingerprint *base,
+                           struct section_fingerprint &fp) {
+    struct image_section sect = {type, key, w.Offset(), 0};
+    w.WriteVarint(type);
+    w.WriteVarint(key);
+    // pickle statvfs
+    char stat_buf[STATVFS_MAX_SIZE];
+    w.Write(stat_buf, put_statvfs(stat_buf, fs_stat) - stat_buf);
+    fp.frame = frame_fingerprint(fs_stat, inodes.size(), pending_delete_inodes);
+    fp.slots.assign(inodes.size(), image_digest());
+    // pickle inodes, remembering the length of each range for the index
+    std::vector<uint64_t> range_lengths;
+    PickleWriter rec;
+    uint64_t range_start = 0;
+    w.WriteVarint(inodes.size());
+    for (size_t i = 0; i < inodes.size(); ++i) {
+        if (i % IMAGE_RANGE_INODES == 0) {
+            if (i > 0)
+                range_lengths.push_back(w.Offset() - range_start);
+            range_start = w.Offset();
+        }
+        Inode *inode = inodes[i];
+        char slot = IMAGE_SLOT_NONE;
+        if (inode == nullptr) {
+            w.Write(&slot, 1);
+            continue;
+        }
+        pickle_slot(inode, rec);
+        fp.slots[i] = slot_fingerprint(rec);
+        if (base && i < base->slots.size() && base->slots[i] == fp.slots[i]) {
+            slot = IMAGE_SLOT_BASE;
+            w.Write(&slot, 1);
+            continue;
+        }
+        slot = IMAGE_SLOT_INODE;
+        w.Write(&slot, 1);
+        w.Write(rec.Data(), rec.Length());
+        stream_slot(rec, w);
+    }
+    if (!inodes.empty())
+        range_lengths.push_back(w.Offset() - range_start);
+    // pickle the list of pending delete inodes
+    /* Note that pending_delete_inodes is a queue (and a copy), therefore
+     * the only way to iterate through it is to pop all the elements */
+    w.WriteVarint(pending_delete_inodes.size());
+    while (!pending_delete_inodes.empty()) {
+        w.WriteVarint(pending_delete_inodes.front());
+        pending_delete_inodes.pop();
+    }
+    // range index
+    uint64_t index_start = w.Offset();
+    w.WriteVarint(IMAGE_RANGE_INODES);
+    w.WriteVarint(range_lengths.size());
+    for (uint64_t len : range_lengths)
+        w.WriteVarint(len);
+    char index_len[8];
+    put_u64(index_len, w.Offset() - index_start);
+    w.Write(index_len, sizeof(index_len));
+    sect.length = w.Offset() - sect.offset;
+    table.push_back(sect);
+}
+
+/* find_fingerprint: The reference section in a base image of the section
+ * (type, key) of a delta image; see image_format.hpp */
+static const struct section_fingerprint *find_fingerprint(const pickle_baseline *base,
+                                                          uint32_t type, uint64_t key) {
+    if (base == nullptr)
+        return nullptr;
+    auto it = base->sections.find(std::make_pair(type, key));
+    if (it == base->sections.end())
+        it = base->sections.find(std::make_pair((uint32_t) IMAGE_SECTION_LIVE, (uint64_t) 0));
+    return (it == base->sections.end()) ? nullptr : &it->second;
+}
+
+/* pickle_file_system: Write a file system and its state pool as an image.
+ *
+ * The image starts at the current file offset of fd; see image_format.hpp
+ * for the layout.  The caller must keep the inodes from changing until
+ * this returns (see FuseRamFs::snapshot()).
+ *
+ * @param[in]  base: If given, write a delta image that holds only the inodes
+ *             and states that differ from this earlier image.
+ * @param[out] result: If given, filled in with the hash and fingerprints of
+ *             the image written, to serve as the base of a later delta.
+ *
+ * @return: 0 on success, or a negative error code.
+ */
+int pickle_file_system(int fd, const std::vector<Inode *> &inodes,
+                       const std::queue<fuse_ino_t> &pending_delete_inodes,
+                       const struct statvfs &fs_stat,
+                       const std::unordered_map<uint64_t, verifs2_state> &states,
+                       const pickle_baseline *base, pickle_baseline *result) {
     /* Remember the current file cursor;
      * if pickling fails, move the cursor here. */
     off_t fpos = lseek(fd, 0, SEEK_CUR);
+    pickle_baseline written;
     try {
-        // pickle statvfs
-        write_and_hash(fd, hashctx, ctx, &fs_stat, sizeof(fs_stat));
-        // pickle inodes
-        size_t num_inodes = inodes.size();
-        write_and_hash(fd, hashctx, ctx, &num_inodes, sizeof(num_inodes));
-        for (size_t i = 0; i < num_inodes; ++i) {
-            Inode *inode = inodes[i];
-            struct inode_state iinfo = {};
-            if (inode == nullptr) {
-                iinfo.exist = false;
-                write_and_hash(fd, hashctx, ctx, &iinfo, sizeof(iinfo));
-                continue;
-            }
-            size_t pickled_size = inode->GetPickledSize();
-            void *data = malloc(pickled_size);
-            if (data == nullptr) {
-                throw pickle_error(ENOMEM, __func__, __LINE__);
-            }
-            /* Should not fail, because the buffer is preallocated */
-            inode->Pickle(data);
-            iinfo.mode = inode->GetMode();
-            iinfo.exist = true;
-            write_and_hash(fd, hashctx, ctx, &iinfo, sizeof(iinfo));
-            write_and_hash(fd, hashctx, ctx, data, pickled_size);
-
-            free(data);
-        }
-        // pickle the list of pending delete inodes
-        size_t num_pending_delete = pending_delete_inodes.size();
-        write_and_hash(fd, hashctx, ctx, &num_pending_delete,
-                       sizeof(num_pending_delete));
-        /* Note that pending_delete_inodes is a queue, therefore the only way
-         * to iterate through it is to pop all the elements in a vector */
-        for (size_t i = 0; i < num_pending_delete; ++i) {
-            fuse_ino_t ino = pending_delete_inodes.front();
-            write_and_hash(fd, hashctx, ctx, &ino, sizeof(ino));
-            pending_delete_inodes.pop();
-            pending_delete_inodes.push(ino);
-        }
+        ImageWriter w(fd);
+        std::vector<struct image_section> table;
+        char header[IMAGE_HEADER_SIZE] = {0};
+        char *hp = header;
+        memcpy(hp, IMAGE_MAGIC, IMAGE_MAGIC_LEN);
+        hp += IMAGE_MAGIC_LEN;
+        hp = put_u32(hp, IMAGE_VERSION);
+        hp = put_u32(hp, base ? IMAGE_FLAG_DELTA : 0);
+        w.Write(header, sizeof(header));
 
-        // start pickling checkpoint/restore pools
-        auto state_pool = get_state_pool();
-
-        size_t num_state_pool = state_pool.size();
-        write_and_hash(fd, hashctx, ctx, &num_state_pool, sizeof(num_state_pool));
-        for (const auto &state: state_pool) {
-            uint64_t key = state.first;
-            write_and_hash(fd, hashctx, ctx, &key, sizeof(key));
-            std::tuple
-                    <std::vector<Inode *>, std::queue<fuse_ino_t>,
-                            struct statvfs> stored_states = state.second;
-            std::vector<Inode *> stored_files = std::get<0>(stored_states);
-            size_t num_stored_files = stored_files.size();
-            write_and_hash(fd, hashctx, ctx, &num_stored_files, sizeof(num_stored_files));
-
-            for (const auto &inode:stored_files) {
-                struct inode_state iinfo = {};
-                if (inode == nullptr) {
-                    iinfo.exist = false;
-                    write_and_hash(fd, hashctx, ctx, &iinfo, sizeof(iinfo));
-                    continue;
-                }
-                size_t pickled_size = inode->GetPickledSize();
-                void *data = malloc(pickled_size);
-                if (data == nullptr) {
-                    throw pickle_error(ENOMEM, __func__, __LINE__);
-                }
-                /* Should not fail, because the buffer is preallocated */
-                inode->Pickle(data);
-                iinfo.mode = inode->GetMode();
-                iinfo.exist = true;
-                write_and_hash(fd, hashctx, ctx, &iinfo, sizeof(iinfo));
-                write_and_hash(fd, hashctx, ctx, data, pickled_size);
-
-                free(data);
-            }
+        if (base) {
+            struct image_section sect = {IMAGE_SECTION_BASE, 0, w.Offset(), 0};
+            w.WriteVarint(sect.type);
+            w.WriteVarint(sect.key);
+            w.Write(base->hash, IMAGE_HASH_LEN);
+            w.WriteVarint(base->path.size());
+            w.Write(base->path.data(), base->path.size());
+            sect.length = w.Offset() - sect.offset;
+            table.push_back(sect);
+        }
 
-            std::queue<fuse_ino_t> stored_DeletedInodes = std::get<1>(stored_states);
-            size_t num_stored_DeletedInodes = stored_DeletedInodes.size();
-            write_and_hash(fd, hashctx, ctx, &num_stored_DeletedInodes, sizeof(num_stored_DeletedInodes));
+        pickle_section(w, IMAGE_SECTION_LIVE, 0, inodes, pending_delete_inodes,
+                       fs_stat, table, find_fingerprint(base, IMAGE_SECTION_LIVE, 0),
+                       written.sections[std::make_pair(IMAGE_SECTION_LIVE, 0)]);
 
-            for (size_t i = 0; i < num_stored_DeletedInodes; ++i) {
-                fuse_ino_t ino = stored_DeletedInodes.front();
-                write_and_hash(fd, hashctx, ctx, &ino, sizeof(ino));
-                stored_DeletedInodes.pop();
-                stored_DeletedInodes.push(ino);
+        // start pickling checkpoint/restore pools
+        for (const auto &state: states) {
+            auto &fp = written.sections[std::make_pair(IMAGE_SECTION_STATE, state.first)];
+            auto base_fp = find_fingerprint(base, IMAGE_SECTION_STATE, state.first);
+            if (base_fp && section_unchanged(std::get<0>(state.second),
+                                             std::get<1>(state.second),
+                                             std::get<2>(state.second), *base_fp, fp)) {
+                struct image_section sect = {IMAGE_SECTION_STATE_BASE, state.first,
+                                             w.Offset(), 0};
+                w.WriteVarint(sect.type);
+                w.WriteVarint(sect.key);
+                sect.length = w.Offset() - sect.offset;
+                table.push_back(sect);
+                continue;
             }
+            pickle_section(w, IMAGE_SECTION_STATE, state.first,
+                           std::get<0>(state.second), std::get<1>(state.second),
+                           std::get<2>(state.second), table, base_fp, fp);
+        }
 
-            struct statvfs stored_m_stbuf = std::get<2>(stored_states);
-            write_and_hash(fd, hashctx, ctx, &stored_m_stbuf, sizeof(stored_m_stbuf));
+        // section table
+        uint64_t table_offset = w.Offset();
+        w.WriteVarint(table.size());
+        for (const auto &sect : table) {
+            w.WriteVarint(sect.type);
+            w.WriteVarint(sect.key);
+            w.WriteVarint(sect.offset);
+            w.WriteVarint(sect.length);
         }
+        uint64_t table_length = w.Offset() - table_offset;
 
+        // trailer
+        char trailer[16];
+        put_u64(put_u64(trailer, table_offset), table_length);
+        w.Write(trailer, sizeof(trailer));
+        w.WriteHash(written.hash);
+        w.WriteUnhashed(IMAGE_TRAILER_MAGIC, IMAGE_MAGIC_LEN);
+        w.Flush();
     } catch (const pickle_error &e) {
         lseek(fd, fpos, SEEK_SET);
         return -e.get_errno();
+    } catch (const std::bad_alloc &) {
+        lseek(fd, fpos, SEEK_SET);
+        return -ENOMEM;
+    }
+    if (result) {
+        memcpy(result->hash, written.hash, IMAGE_HASH_LEN);
+        result->sections.swap(written.sections);
     }
     return 0;
 }
@@ -243,106 +458,468 @@ static char *fetch_filepath(const char *cfgpath) {
     return path;
 }
 
-int FuseRamFs::pickle_verifs2(void) {
-    char *path = nullptr;
+/* is_image_stream: Whether path names a pipe, FIFO or socket (anything but a
+ * regular file) that images are streamed through */
+static bool is_image_stream(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode);
+}
+
+/* open_image_stream: Open a FIFO or pipe (e.g. /proc/<pid>/fd/<n>), or
+ * connect to a unix socket.
+ *
+ * @return: a file descriptor, or a negative error code.
+ */
+static int open_image_stream(const char *path, int flags) {
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return -errno;
+    if (!S_ISSOCK(st.st_mode)) {
+        int fd = open(path, flags | O_CLOEXEC);
+        return (fd < 0) ? -errno : fd;
+    }
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    return fd;
+}
+
+/* pickle_snapshot: Write a snapshot as an image to path.
+ *
+ * The image is written to a temporary file and renamed over the target at
+ * the end: the target may be the image this file system was loaded from,
+ * and File objects may still refer to it.  The image and then the rename
+ * are synced to disk, so that a crash leaves either image in place.  Pipes,
+ * FIFOs and sockets are written to directly.
+ *
+ * @param[in]  base: If given, write a delta image against it.
+ * @param[in]  direct: Write the file with O_DIRECT, if its file system
+ *             supports that.
+ * @param[out] result: The baseline for deltas against the image written.
+ *
+ * @return: 0 on success, or a negative error code; -EINVAL if a delta would
+ * replace its own base.
+ */
+static int pickle_snapshot(const char *path, const fs_snapshot &snap,
+                           const pickle_baseline *base, bool direct,
+                           pickle_baseline &result) {
+    result.path = path;
+    if (is_image_stream(path)) {
+        int fd = open_image_stream(path, O_WRONLY);
+        if (fd < 0)
+            return fd;
+        int res = pickle_file_system(fd, std::get<0>(snap.live), std::get<1>(snap.live),
+                                     std::get<2>(snap.live), snap.states, base, &result);
+        close(fd);
+        return res;
+    }
+    if (base && base->path == path)
+        return -EINVAL;
+
+    std::string tmppath = std::string(path) + ".XXXXXX";
     int fd = -1;
     int res = 0;
+    bool renamed = false;
     try {
-        path = fetch_filepath(VERIFS_PICKLE_CFG);
-        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        fd = mkstemp(&tmppath[0]);
         if (fd < 0)
             throw pickle_error(errno, __func__, __LINE__);
-        // skip the header
-        res = lseek(fd, sizeof(struct state_file_header), SEEK_SET);
-        if (res < 0)
+        if (fchmod(fd, 0644) < 0)
             throw pickle_error(errno, __func__, __LINE__);
+        /* Not all file systems (e.g. tmpfs) support O_DIRECT; write
+         * through the page cache there */
+        if (direct)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
         // pickle the file system data and metadata
-        SHA256_CTX hashctx; 
-	    EVP_MD_CTX *ctx;
-
-#if OPENSSL_VERSION_NUMBER >= 0x30000000L
-	    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
-#else
-        SHA256_Init(&hashctx);
-#endif
-        res = pickle_file_system(fd, FuseRamFs::Inodes,
-                                 FuseRamFs::DeletedInodes,
-                                 FuseRamFs::m_stbuf, &hashctx, ctx);
+        res = pickle_file_system(fd, std::get<0>(snap.live), std::get<1>(snap.live),
+                                 std::get<2>(snap.live), snap.states, base, &result);
         if (res < 0)
+            throw pickle_error(-res, __func__, __LINE__);
+        /* The image must be on disk before it replaces the previous one,
+         * and the rename before the image counts as written: otherwise a
+         * crash may leave an empty or partial image in place of a good one */
+        if (fsync(fd) < 0)
             throw pickle_error(errno, __func__, __LINE__);
-        // lastly: write the header
-        off_t filelen = lseek(fd, 0, SEEK_CUR);
-        struct state_file_header header = {0};
-        header.fsize = filelen;
-#if OPENSSL_VERSION_NUMBER >= 0x30000000L
-        unsigned int sha256_digest_len = EVP_MD_size(EVP_sha256());
-	    EVP_DigestFinal_ex(ctx, header.hash, &sha256_digest_len);
-        EVP_MD_CTX_free(ctx);
-#else
-	    SHA256_Final(header.hash, &hashctx);
-#endif
-        res = lseek(fd, 0, SEEK_SET);
-        if (res < 0)
+        if (rename(tmppath.c_str(), path) < 0)
             throw pickle_error(errno, __func__, __LINE__);
-        res = write(fd, &header, sizeof(header));
-        if (res >= 0) {
-            res = 0;
-        } else {
-            res = -errno;
-        }
+        renamed = true;
+        std::string dir = path;
+        size_t slash = dir.rfind('/');
+        dir = (slash == std::string::npos) ? "." : (slash == 0) ? "/" : dir.substr(0, slash);
+        int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dirfd < 0)
+            throw pickle_error(errno, __func__, __LINE__);
+        int err = (fsync(dirfd) < 0) ? errno : 0;
+        close(dirfd);
+        if (err != 0)
+            throw pickle_error(err, __func__, __LINE__);
+        res = 0;
     } catch (const pickle_error &e) {
         res = -e.get_errno();
+        if (fd >= 0 && !renamed)
+            unlink(tmppath.c_str());
     }
-    if (path)
-        free(path);
-    if (fd > 0)
+    if (fd >= 0)
         close(fd);
     return res;
 }
 
-static int verify_file_size(int fd, size_t expected) {
-    struct stat info;
-    int res = fstat(fd, &info);
-    if (res < 0)
-        return errno;
-    return (info.st_size == expected) ? 0 : -1;
+/* pickle_image_file: Write a snapshot as a full image to path, outside of
+ * any mounted file system (e.g. for offline tools).
+ *
+ * @param[in] flags: VERIFS_IMAGE_DIRECT to write around the page cache
+ *
+ * @return: 0 on success, or a negative error code.
+ */
+int pickle_image_file(const char *path, const fs_snapshot &snap, uint32_t flags) {
+    pickle_baseline result;
+    return pickle_snapshot(path, snap, nullptr, flags & VERIFS_IMAGE_DIRECT, result);
 }
 
-static int verify_file_integrity(int fd, unsigned char *expected) {
-    const size_t blocksize = 4096;
-    unsigned char hashres[SHA256_DIGEST_LENGTH] = {0};
-    char buf[blocksize];
-    SHA256_CTX hashctx; 
-    EVP_MD_CTX *ctx;
-    int res = 0;
-#if OPENSSL_VERSION_NUMBER >= 0x30000000L
-    res = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
-#else
-    res = SHA256_Init(&hashctx);
-#endif
+/* start_pickle: Account for a pickle that is about to start.
+ *
+ * @param[in] background: The pickle runs off the FUSE worker threads; only
+ *            one such pickle may run at a time.
+ *
+ * @return: 0, or -EBUSY if a background pickle is running already.
+ */
+int FuseRamFs::start_pickle(bool background) {
+    std::lock_guard<std::mutex> lk(pickleMutex);
+    if (background) {
+        if (pickleStatus.running)
+            return -EBUSY;
+        pickleStatus.running = 1;
+    }
+    pickleStatus.started++;
+    return 0;
+}
 
-    if (res == 0)
-        return -2;
+/* finish_pickle: Account for a finished pickle.
+ *
+ * @param[in] baseline: What a successful pickle wrote; later delta images
+ *            are written against it.
+ */
+void FuseRamFs::finish_pickle(int res, const struct timespec &start,
+                              bool background,
+                              std::shared_ptr<const pickle_baseline> baseline) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    std::lock_guard<std::mutex> lk(pickleMutex);
+    pickleStatus.completed++;
+    if (res != 0)
+        pickleStatus.failed++;
+    else if (baseline)
+        pickleBaseline = std::move(baseline);
+    pickleStatus.last_error = -res;
+    pickleStatus.last_duration_us = (end.tv_sec - start.tv_sec) * 1000000 +
+                                    (end.tv_nsec - start.tv_nsec) / 1000;
+    if (background)
+        pickleStatus.running = 0;
+    pickleCond.notify_all();
+}
 
-    ssize_t readsz;
-    while ((readsz = read(fd, buf, blocksize)) > 0) {
-#if OPENSSL_VERSION_NUMBER >= 0x30000000L
-        EVP_DigestUpdate(ctx, buf, readsz);
-#else
-        SHA256_Update(&hashctx, buf, readsz);
-#endif    
+/* get_pickle_baseline: The base for a delta pickle, or nullptr to write a
+ * full image (also if nothing has been pickled yet) */
+std::shared_ptr<const pickle_baseline> FuseRamFs::get_pickle_baseline(bool delta) {
+    if (!delta)
+        return nullptr;
+    std::lock_guard<std::mutex> lk(pickleMutex);
+    return pickleBaseline;
+}
+
+/* run_pickle: Snapshot the file system and pickle it in the calling thread */
+int FuseRamFs::run_pickle(const char *path, bool background, uint32_t flags) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int res = start_pickle(background);
+    if (res != 0)
+        return res;
+    auto base = get_pickle_baseline(flags & VERIFS_IMAGE_DELTA);
+    auto result = std::make_shared<pickle_baseline>();
+    {
+        fs_snapshot snap;
+        res = snapshot(snap);
+        if (res == 0)
+            res = pickle_snapshot(path, snap, base.get(),
+                                  flags & VERIFS_IMAGE_DIRECT, *result);
     }
-    if (readsz < 0)
-        return errno;
+    finish_pickle(res, start, background, std::move(result));
+    return res;
+}
 
-#if OPENSSL_VERSION_NUMBER >= 0x30000000L
-    unsigned int sha256_digest_len = EVP_MD_size(EVP_sha256());
-    EVP_DigestFinal_ex(ctx, hashres, &sha256_digest_len);
-    EVP_MD_CTX_free(ctx);
-#else
-    SHA256_Final(hashres, &hashctx);
-#endif
-    return (memcmp(hashres, expected, SHA256_DIGEST_LENGTH) == 0) ? 0 : -3;
+/* pickle_verifs2: Pickle the file system to an image.
+ *
+ * Operations are blocked only while the file system is copied; the copy is
+ * then written without holding any lock.
+ *
+ * @param[in] path: Path to the image, or nullptr to read it from
+ *            VERIFS_PICKLE_CFG (legacy VERIFS_PICKLE ioctl).
+ * @param[in] flags: VERIFS_IMAGE_ASYNC to return once the copy is taken and
+ *            write it on a background thread; see VERIFS_PICKLE_STATUS for
+ *            the result.
+ *            VERIFS_IMAGE_DELTA to write only the inodes and states that
+ *            changed since the last image this file system pickled.  The
+ *            delta refers to that image by hash and path, and must not
+ *            replace it.
+ *            VERIFS_IMAGE_DIRECT to write the image around the page cache.
+ */
+int FuseRamFs::pickle_verifs2(const char *path, uint32_t flags) {
+    bool delta = flags & VERIFS_IMAGE_DELTA;
+    bool direct = flags & VERIFS_IMAGE_DIRECT;
+    std::string target;
+    try {
+        if (path == nullptr) {
+            char *cfgpath = fetch_filepath(VERIFS_PICKLE_CFG);
+            target = cfgpath;
+            free(cfgpath);
+        } else {
+            target = path;
+        }
+    } catch (const pickle_error &e) {
+        return -e.get_errno();
+    }
+    if (!(flags & VERIFS_IMAGE_ASYNC))
+        return run_pickle(target.c_str(), false, flags);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int res = start_pickle(true);
+    if (res != 0)
+        return res;
+    auto base = get_pickle_baseline(delta);
+    std::unique_ptr<fs_snapshot> snap(new fs_snapshot());
+    res = snapshot(*snap);
+    if (res != 0) {
+        snap.reset();
+        finish_pickle(res, start, true, nullptr);
+        return res;
+    }
+
+    std::lock_guard<std::mutex> lk(pickleMutex);
+    /* The previous background pickle has finished, since we are running */
+    if (pickleThread.joinable())
+        pickleThread.join();
+    pickleThread = std::thread([target, start, base, direct, snap = std::move(snap)]() mutable {
+        auto result = std::make_shared<pickle_baseline>();
+        int ret = pickle_snapshot(target.c_str(), *snap, base.get(), direct, *result);
+        snap.reset();
+        finish_pickle(ret, start, true, std::move(result));
+    });
+    return 0;
+}
+
+/* export_state: Pickle one checkpoint of the state pool as a standalone
+ * image.
+ *
+ * The checkpoint becomes the live file system of the image, which has no
+ * state pool; it can be loaded with load_verifs2() or imported into
+ * another state pool with import_state().  Exports do not count as
+ * pickles: they do not show in VERIFS_PICKLE_STATUS and delta images are
+ * not written against them.
+ *
+ * @param[in] flags: VERIFS_IMAGE_DIRECT to write the image around the page
+ *            cache.
+ *
+ * @return: 0 on success, or a negative error code; -ENOENT if there is no
+ * checkpoint with that key.
+ */
+int FuseRamFs::export_state(uint64_t key, const char *path, uint32_t flags) {
+    fs_snapshot snap;
+    int res = snapshot_state(key, snap);
+    if (res != 0)
+        return res;
+    return pickle_image_file(path, snap, flags);
+}
+
+void FuseRamFs::auto_pickle_loop(uint64_t gen) {
+    std::unique_lock<std::mutex> lk(pickleMutex);
+    while (true) {
+        auto interval = std::chrono::milliseconds(autoPickleIntervalMs);
+        if (pickleCond.wait_for(lk, interval, [gen] { return autoPickleGen != gen; }))
+            return;
+        /* Skip this round if a background pickle is still running */
+        if (pickleStatus.running)
+            continue;
+        std::string path = autoPicklePath;
+        lk.unlock();
+        run_pickle(path.c_str(), true, 0);
+        lk.lock();
+    }
+}
+
+/* set_auto_pickle: Start, reconfigure or stop (interval_ms == 0) periodic
+ * pickling. */
+int FuseRamFs::set_auto_pickle(const char *path, uint64_t interval_ms) {
+    std::unique_lock<std::mutex> lk(pickleMutex);
+    std::thread old = std::move(autoPickleThread);
+    autoPickleGen++;
+    autoPickleIntervalMs = interval_ms;
+    autoPicklePath = interval_ms ? path : "";
+    if (interval_ms != 0)
+        autoPickleThread = std::thread(auto_pickle_loop, autoPickleGen);
+    pickleCond.notify_all();
+    lk.unlock();
+    /* Wait for the old loop, which may be in the middle of a pickle */
+    if (old.joinable())
+        old.join();
+    return 0;
+}
+
+/* stop_pickling: Stop periodic pickling and wait for background pickles */
+void FuseRamFs::stop_pickling() {
+    set_auto_pickle(nullptr, 0);
+    std::unique_lock<std::mutex> lk(pickleMutex);
+    std::thread bg = std::move(pickleThread);
+    lk.unlock();
+    if (bg.joinable())
+        bg.join();
+}
+
+void FuseRamFs::get_pickle_status(struct verifs_pickle_status &status) {
+    std::lock_guard<std::mutex> lk(pickleMutex);
+    status = pickleStatus;
+    status.version = VERIFS_IMAGE_ARG_VERSION;
+    status.auto_enabled = (autoPickleIntervalMs != 0);
+    int lease_error;
+    ImageLease::Stats(status.images_copied, status.images_detached, lease_error);
+    status.lease_error = lease_error;
+}
+
+static int read_full(int fd, void *buf, size_t count, off_t off) {
+    char *ptr = (char *) buf;
+    while (count > 0) {
+        ssize_t res = pread(fd, ptr, count, off);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return errno;
+        if (res == 0)
+            return EMSGSIZE;
+        ptr += res;
+        count -= res;
+        off += res;
+    }
+    return 0;
+}
+
+static uint32_t image_flags(const char *header) {
+    return get_u32(header + IMAGE_MAGIC_LEN + 4);
+}
+
+/* The hash of an image, as recorded in its trailer */
+static const unsigned char *image_hash(const void *data, size_t len) {
+    return (const unsigned char *) data + len - IMAGE_UNHASHED_SIZE;
+}
+
+/* Check the header and trailer magic and version of an image */
+static int check_image_frame(const char *header, const char *trailer) {
+    if (memcmp(header, IMAGE_MAGIC, IMAGE_MAGIC_LEN) != 0 ||
+        memcmp(trailer + IMAGE_TRAILER_SIZE - IMAGE_MAGIC_LEN,
+               IMAGE_TRAILER_MAGIC, IMAGE_MAGIC_LEN) != 0)
+        return EINVAL;
+    if (get_u32(header + IMAGE_MAGIC_LEN) != IMAGE_VERSION)
+        return EPROTONOSUPPORT;
+    return 0;
+}
+
+/* Returns the end of the table, or nullptr if it is malformed */
+static const char *parse_section_table(const char *ptr, const char *end,
+                                       std::vector<struct image_section> &sections) {
+    uint64_t count, v;
+    ptr = get_varint(ptr, end, count);
+    sections.clear();
+    /* Every entry takes at least four bytes */
+    if (ptr == nullptr || count > (uint64_t) (end - ptr) / 4)
+        return nullptr;
+    for (uint64_t i = 0; i < count && ptr != nullptr; ++i) {
+        struct image_section sect;
+        ptr = get_varint(ptr, end, v);
+        sect.type = v;
+        ptr = get_varint(ptr, end, sect.key);
+        ptr = get_varint(ptr, end, sect.offset);
+        ptr = get_varint(ptr, end, sect.length);
+        sections.push_back(sect);
+    }
+    return ptr;
+}
+
+/* Whether [offset, offset + length) lies within the first limit bytes */
+static bool within(uint64_t offset, uint64_t length, uint64_t limit) {
+    return offset <= limit && length <= limit - offset;
+}
+
+/* read_image_index: Read the section table of an image in memory.
+ *
+ * @return: 0 on success, or a positive error number.
+ */
+int read_image_index(const void *data, size_t len,
+                     std::vector<struct image_section> &sections) {
+    const char *base = (const char *) data;
+    if (len < IMAGE_HEADER_SIZE + IMAGE_TRAILER_SIZE)
+        return EMSGSIZE;
+    const char *trailer = base + len - IMAGE_TRAILER_SIZE;
+    int res = check_image_frame(base, trailer);
+    if (res != 0)
+        return res;
+    uint64_t table_offset = get_u64(trailer);
+    uint64_t table_length = get_u64(trailer + 8);
+    if (!within(table_offset, table_length, len - IMAGE_TRAILER_SIZE))
+        return EMSGSIZE;
+    const char *end = base + table_offset + table_length;
+    if (parse_section_table(base + table_offset, end, sections) == nullptr)
+        return EINVAL;
+    for (const auto &sect : sections) {
+        if (!within(sect.offset, sect.length, table_offset))
+            return EINVAL;
+    }
+    return 0;
+}
+
+/* read_image_base: Find the base of a delta image in memory.
+ *
+ * @param[out] hash: The hash of the base image
+ * @param[out] path: The path the base image was written to
+ *
+ * @return: 0 on success, -ENOENT if the image is not a delta image, or
+ * another negative error code.
+ */
+int read_image_base(const void *data, size_t len, unsigned char *hash,
+                    std::string &path) {
+    std::vector<struct image_section> index;
+    int res = read_image_index(data, len, index);
+    if (res != 0)
+        return -res;
+    if (!(image_flags((const char *) data) & IMAGE_FLAG_DELTA))
+        return -ENOENT;
+    for (const auto &sect : index) {
+        if (sect.type != IMAGE_SECTION_BASE)
+            continue;
+        const char *ptr = (const char *) data + sect.offset;
+        const char *end = ptr + sect.length;
+        uint64_t v;
+        ptr = get_varint(ptr, end, v);
+        ptr = get_varint(ptr, end, v);
+        if (ptr == nullptr || end - ptr < IMAGE_HASH_LEN)
+            return -EINVAL;
+        memcpy(hash, ptr, IMAGE_HASH_LEN);
+        ptr = get_varint(ptr + IMAGE_HASH_LEN, end, v);
+        if (ptr == nullptr || v != (uint64_t) (end - ptr))
+            return -EINVAL;
+        path.assign(ptr, v);
+        return 0;
+    }
+    return -EINVAL;
 }
 
 /* verify_state_file: Verify the integrity of the state file
@@ -354,181 +931,577 @@ static int verify_file_integrity(int fd, unsigned char *expected) {
  * mismatch sha256 hash digest.
  */
 int verify_state_file(int fd) {
-    struct state_file_header header;
-    // read the header
-    int res = lseek(fd, 0, SEEK_SET);
-    if (res < 0)
-        return errno;
-
-    ssize_t readsz = read(fd, &header, sizeof(header));
-    if (readsz < 0)
+    struct stat info;
+    if (fstat(fd, &info) < 0)
         return errno;
-    else if (readsz < sizeof(header))
-        return ENOSPC;
+    size_t fsize = info.st_size;
+    if (fsize < IMAGE_HEADER_SIZE + IMAGE_TRAILER_SIZE)
+        return -1;
 
-    // validate if the file size and the size recorded in the header match
-    if ((res = verify_file_size(fd, header.fsize)) != 0)
+    char header[IMAGE_HEADER_SIZE], trailer[IMAGE_TRAILER_SIZE];
+    int res = read_full(fd, header, sizeof(header), 0);
+    if (res == 0)
+        res = read_full(fd, trailer, sizeof(trailer), fsize - sizeof(trailer));
+    if (res != 0)
+        return res;
+    if ((res = check_image_frame(header, trailer)) != 0)
         return res;
 
-    // start reading the whole file and calculating the hash
-    if ((res = verify_file_integrity(fd, header.hash)) != 0)
+    // read the whole file and calculate the hash
+    const size_t blocksize = 1 << 20;
+    std::vector<char> buf(blocksize);
+    unsigned char hashres[IMAGE_HASH_LEN];
+    try {
+        ImageHash hash;
+        size_t hashed = fsize - IMAGE_UNHASHED_SIZE;
+        for (size_t off = 0; off < hashed; off += blocksize) {
+            size_t count = std::min(blocksize, hashed - off);
+            if ((res = read_full(fd, buf.data(), count, off)) != 0)
+                return res;
+            hash.Update(buf.data(), count);
+        }
+        hash.Final(hashres);
+    } catch (const pickle_error &e) {
+        return -2;
+    }
+    const unsigned char *expected = (const unsigned char *) trailer + 16;
+    return (memcmp(hashres, expected, IMAGE_HASH_LEN) == 0) ? 0 : -3;
+}
+
+/* verify_image: Verify the integrity of an image in memory
+ *
+ * @return: the same as verify_state_file().
+ */
+int verify_image(const void *data, size_t len) {
+    const char *base = (const char *) data;
+    if (len < IMAGE_HEADER_SIZE + IMAGE_TRAILER_SIZE)
+        return -1;
+    const char *trailer = base + len - IMAGE_TRAILER_SIZE;
+    int res = check_image_frame(base, trailer);
+    if (res != 0)
         return res;
 
-    lseek(fd, sizeof(header), SEEK_SET);
+    unsigned char hashres[IMAGE_HASH_LEN];
+    try {
+        ImageHash hash;
+        hash.Update(base, len - IMAGE_UNHASHED_SIZE);
+        hash.Final(hashres);
+    } catch (const pickle_error &e) {
+        return -2;
+    }
+    const unsigned char *expected = (const unsigned char *) trailer + 16;
+    return (memcmp(hashres, expected, IMAGE_HASH_LEN) == 0) ? 0 : -3;
+}
+
+/* Where the image being loaded is, and how file contents are loaded */
+struct load_source {
+    /* If set, files refer to their contents in this mapping */
+    std::shared_ptr<MappedImage> image;
+    /* If set, files read their contents from this image on first access;
+     * map_addr is the address of image offset map_offset. */
+    std::shared_ptr<ImageFile> lazy;
+    const char *map_addr;
+    off_t map_offset;
+};
+
+/* load_inode: Load the record of an inode of the given mode from [ptr, end)
+ * and advance ptr past it */
+static Inode *load_inode(const char *&ptr, const char *end, mode_t mode,
+                         const struct load_source &src) {
+    Inode *inode;
+    if (S_ISREG(mode)) {
+        inode = new File();
+    } else if (S_ISDIR(mode)) {
+        inode = new Directory();
+    } else if (S_ISLNK(mode)) {
+        inode = new SymLink();
+    } else if (S_ISCHR(mode) || S_ISBLK(mode) ||
+               S_ISSOCK(mode) || S_ISFIFO(mode) || mode == 0) {
+        inode = new SpecialInode();
+    } else {
+        throw pickle_error(EINVAL, __func__, __LINE__);
+    }
+
+    PickleReader in(ptr, end, src.lazy ? nullptr : src.image, src.lazy,
+                    src.map_offset + (ptr - src.map_addr));
+    inode->Load(in);
+    if (in.Error() != 0) {
+        delete inode;
+        throw pickle_error(in.Error(), __func__, __LINE__);
+    }
+    ptr = in.Position();
+    return inode;
+}
+
+/* A section being loaded.  Its frame (everything but the inode records) is
+ * parsed first; the inode ranges are then loaded, possibly in parallel. */
+struct section_load {
+    const char *start;
+    const char *end;
+    struct image_section sect;
+    std::vector<Inode *> inodes;
+    std::queue<fuse_ino_t> pending_delete_inodes;
+    struct statvfs fs_stat;
+    uint64_t range_inodes;
+    /* Start of each inode range, plus the end of the last one */
+    std::vector<const char *> ranges;
+    /* Inodes of the reference section in the base of a delta image */
+    const std::vector<Inode *> *base = nullptr;
+};
+
+/* parse_section_frame: Parse the header, statvfs, range index and pending
+ * delete list of a section. */
+static void parse_section_frame(struct section_load &sl) {
+    uint64_t v;
+    const char *ptr = sl.start;
+    ptr = get_varint(ptr, sl.end, v);
+    sl.sect.type = v;
+    ptr = get_varint(ptr, sl.end, sl.sect.key);
+    // load statvfs
+    ptr = load_statvfs(ptr, sl.end, sl.fs_stat);
+    uint64_t num_inodes;
+    ptr = get_varint(ptr, sl.end, num_inodes);
+    /* Every inode slot takes at least a byte */
+    if (ptr == nullptr || sl.end - ptr < 8 || num_inodes > (uint64_t) (sl.end - ptr))
+        throw pickle_error(EINVAL, __func__, __LINE__);
+
+    // range index, at the end of the section
+    uint64_t index_len = get_u64(sl.end - 8);
+    if (index_len > (uint64_t) (sl.end - 8 - ptr))
+        throw pickle_error(EINVAL, __func__, __LINE__);
+    const char *index = sl.end - 8 - index_len;
+    const char *index_end = sl.end - 8;
+    uint64_t num_ranges;
+    index = get_varint(index, index_end, sl.range_inodes);
+    index = get_varint(index, index_end, num_ranges);
+    if (index == nullptr || sl.range_inodes == 0 ||
+        num_ranges != num_inodes / sl.range_inodes + (num_inodes % sl.range_inodes != 0) ||
+        num_ranges > (uint64_t) (index_end - index))
+        throw pickle_error(EINVAL, __func__, __LINE__);
+    /* The ranges, and then the pending delete list, come before the index */
+    const char *list_end = index_end - index_len;
+    sl.ranges.push_back(ptr);
+    for (uint64_t i = 0; i < num_ranges; ++i) {
+        index = get_varint(index, index_end, v);
+        if (index == nullptr || v > (uint64_t) (list_end - ptr))
+            throw pickle_error(EINVAL, __func__, __LINE__);
+        ptr += v;
+        sl.ranges.push_back(ptr);
+    }
+    if (index != index_end)
+        throw pickle_error(EINVAL, __func__, __LINE__);
+
+    // the pending delete list follows the last range
+    uint64_t num_pending_delete;
+    ptr = get_varint(ptr, list_end, num_pending_delete);
+    if (ptr == nullptr || num_pending_delete > (uint64_t) (list_end - ptr))
+        throw pickle_error(EINVAL, __func__, __LINE__);
+    for (uint64_t i = 0; i < num_pending_delete && ptr != nullptr; ++i) {
+        ptr = get_varint(ptr, list_end, v);
+        sl.pending_delete_inodes.push(v);
+    }
+    if (ptr != list_end)
+        throw pickle_error(EINVAL, __func__, __LINE__);
+    sl.inodes.assign(num_inodes, nullptr);
+}
+
+/* load_range: Load the inodes of one range of a section */
+static void load_range(struct section_load &sl, size_t range,
+                       const struct load_source &src) {
+    const char *ptr = sl.ranges[range];
+    const char *end = sl.ranges[range + 1];
+    size_t first = range * sl.range_inodes;
+    size_t last = first + std::min<uint64_t>(sl.range_inodes, sl.inodes.size() - first);
+    for (size_t i = first; i < last; ++i) {
+        if (ptr >= end)
+            throw pickle_error(EINVAL, __func__, __LINE__);
+        char slot = *ptr++;
+        if (slot == IMAGE_SLOT_NONE) {
+            /* Keep the slot so that inode numbers stay the same */
+            continue;
+        }
+        if (slot == IMAGE_SLOT_BASE) {
+            /* Several sections may refer to the same base inode, so copy
+             * it; file contents stay shared with the base image */
+            if (sl.base == nullptr || i >= sl.base->size() || (*sl.base)[i] == nullptr)
+                throw pickle_error(EINVAL, __func__, __LINE__);
+            sl.inodes[i] = copy_inode((*sl.base)[i]);
+            if (sl.inodes[i] == nullptr)
+                throw pickle_error(EINVAL, __func__, __LINE__);
+            continue;
+        }
+        if (slot != IMAGE_SLOT_INODE)
+            throw pickle_error(EINVAL, __func__, __LINE__);
+        uint64_t mode;
+        ptr = get_varint(ptr, end, mode);
+        if (ptr == nullptr)
+            throw pickle_error(EINVAL, __func__, __LINE__);
+        sl.inodes[i] = load_inode(ptr, end, mode, src);
+    }
+    if (ptr != end)
+        throw pickle_error(EINVAL, __func__, __LINE__);
+}
+
+static void free_inode_table(std::vector<Inode *> &table) {
+    for (auto &i : table) {
+        delete i;
+    }
+    table.clear();
+}
+
+/* load_sections: Load a set of sections, spreading their inode ranges over
+ * up to one thread per core.
+ *
+ * @return: 0 on success, or a negative error code; no inodes are left
+ * allocated on failure.
+ */
+static int load_sections(std::vector<struct section_load> &sections,
+                         const struct load_source &src) {
+    std::vector<std::pair<size_t, size_t>> tasks;
+    try {
+        for (size_t s = 0; s < sections.size(); ++s) {
+            parse_section_frame(sections[s]);
+            for (size_t r = 0; r + 1 < sections[s].ranges.size(); ++r)
+                tasks.emplace_back(s, r);
+        }
+    } catch (const pickle_error &e) {
+        return -e.get_errno();
+    } catch (const std::bad_alloc &) {
+        return -ENOMEM;
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<int> error(0);
+    auto worker = [&]() {
+        size_t t;
+        while (error == 0 && (t = next++) < tasks.size()) {
+            try {
+                load_range(sections[tasks[t].first], tasks[t].second, src);
+            } catch (const pickle_error &e) {
+                int expected = 0;
+                error.compare_exchange_strong(expected, e.get_errno());
+            } catch (const std::bad_alloc &) {
+                int expected = 0;
+                error.compare_exchange_strong(expected, ENOMEM);
+            } catch (...) {
+                /* Nothing may escape a worker thread */
+                int expected = 0;
+                error.compare_exchange_strong(expected, EINVAL);
+            }
+        }
+    };
+    size_t nthreads = std::min<size_t>(std::max(1U, std::thread::hardware_concurrency()),
+                                       tasks.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nthreads; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+        t.join();
+
+    if (error != 0) {
+        for (auto &sl : sections)
+            free_inode_table(sl.inodes);
+        return -error;
+    }
     return 0;
 }
 
-/* load_file_system: Load the file system from pickled data.
+/* read_image_stream: Read a whole image from a pipe or socket.
  *
- * NOTE: load_file_system() expects a memory buffer or a mmap'ed area
- * instead of a FILE object.
+ * The stream is read front to back only, and hashed as it arrives, so the
+ * image is verified as soon as the last byte is in.
  *
- * @param[in]  data: pointer to the pickled data
- * @param[out] inodes: Inode table
- * @param[out] pending_del_inodes: The queue of pending deleted inodes
- * @param[out] fs_stat: File system statistics info
+ * @param[in]  fd: The stream
+ * @param[in]  verify: Check the image hash
+ * @param[out] image: The image, in memory
  *
- * @return: bytes used
+ * @return: 0 on success, or a negative error code: -EMSGSIZE if the stream
+ * is too short, -EINVAL if the hash does not match.
  */
-ssize_t load_file_system(const void *data, std::vector<Inode *> &inodes,
-                         std::queue<fuse_ino_t> &pending_delete_inodes,
-                         struct statvfs &fs_stat) {
-    const char *ptr = (const char *) data;
+int read_image_stream(int fd, bool verify, std::shared_ptr<MappedImage> &image) {
+    size_t cap = 1 << 20, len = 0, hashed = 0;
+    char *buf = (char *) malloc(cap);
+    if (buf == nullptr)
+        return -ENOMEM;
     try {
-        // load statvfs
-        memcpy(&fs_stat, ptr, sizeof(fs_stat));
-        ptr += sizeof(fs_stat);
-        // load inodes
-        size_t num_inodes;
-        memcpy(&num_inodes, ptr, sizeof(num_inodes));
-        ptr += sizeof(num_inodes);
-        for (size_t i = 0; i < num_inodes; ++i) {
-            struct inode_state iinfo;
-            memcpy(&iinfo, ptr, sizeof(iinfo));
-            ptr += sizeof(iinfo);
-            if (!iinfo.exist)
+        ImageHash hash;
+        while (true) {
+            if (len == cap) {
+                char *newbuf = (char *) realloc(buf, cap * 2);
+                if (newbuf == nullptr)
+                    throw pickle_error(ENOMEM, __func__, __LINE__);
+                buf = newbuf;
+                cap *= 2;
+            }
+            ssize_t n = read(fd, buf + len, cap - len);
+            if (n < 0 && errno == EINTR)
                 continue;
+            if (n < 0)
+                throw pickle_error(errno, __func__, __LINE__);
+            if (n == 0)
+                break;
+            len += n;
+            /* The last IMAGE_UNHASHED_SIZE bytes seen so far may be the
+             * hash and trailer magic */
+            if (verify && len > hashed + IMAGE_UNHASHED_SIZE) {
+                hash.Update(buf + hashed, len - IMAGE_UNHASHED_SIZE - hashed);
+                hashed = len - IMAGE_UNHASHED_SIZE;
+            }
+        }
+        if (len < IMAGE_HEADER_SIZE + IMAGE_TRAILER_SIZE)
+            throw pickle_error(EMSGSIZE, __func__, __LINE__);
+        if (verify) {
+            unsigned char digest[IMAGE_HASH_LEN];
+            hash.Final(digest);
+            if (memcmp(digest, buf + len - IMAGE_UNHASHED_SIZE, IMAGE_HASH_LEN) != 0)
+                throw pickle_error(EINVAL, __func__, __LINE__);
+        }
+    } catch (const pickle_error &e) {
+        free(buf);
+        return -e.get_errno();
+    }
+    image = std::make_shared<MappedImage>(buf, len, true);
+    return 0;
+}
 
-            size_t res;
-            const void *ptr2 = (const void *) ptr;
-            if (S_ISREG(iinfo.mode)) {
-                File *file = new File();
-                res = file->Load(ptr2);
-                inodes.push_back(file);
-            } else if (S_ISDIR(iinfo.mode)) {
-                auto *dir = new Directory();
-                res = dir->Load(ptr2);
-                inodes.push_back(dir);
-            } else if (S_ISLNK(iinfo.mode)) {
-                auto *link = new SymLink();
-                res = link->Load(ptr2);
-                inodes.push_back(link);
-            } else if (S_ISCHR(iinfo.mode) || S_ISBLK(iinfo.mode) ||
-                       S_ISSOCK(iinfo.mode) || S_ISFIFO(iinfo.mode) || iinfo.mode == 0) {
-                auto *special = new SpecialInode();
-                res = special->Load(ptr2);
-                inodes.push_back(special);
-            } else {
+/* read_image_direct: Read a whole image file into memory with direct I/O.
+ *
+ * Several chunks are read at once; each is hashed as soon as it is in,
+ * while the next ones are still being read.
+ *
+ * @return: 0 on success, or a negative error code: -EMSGSIZE if the file
+ * is too short, -EINVAL if the hash does not match.
+ */
+static int read_image_direct(int fd, bool verify, std::shared_ptr<MappedImage> &image) {
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+        return -errno;
+    size_t len = info.st_size;
+    if (len < IMAGE_HEADER_SIZE + IMAGE_TRAILER_SIZE)
+        return -EMSGSIZE;
+    void *buf = nullptr;
+    size_t cap = (len + IMAGE_IO_ALIGN - 1) / IMAGE_IO_ALIGN * IMAGE_IO_ALIGN;
+    if (posix_memalign(&buf, IMAGE_IO_ALIGN, cap) != 0)
+        return -ENOMEM;
+
+    size_t hashed = len - IMAGE_UNHASHED_SIZE;
+    int res;
+    try {
+        ImageHash hash;
+        res = read_file_chunks(fd, (char *) buf, len, [&](size_t off, size_t n) {
+            if (verify && off < hashed)
+                hash.Update((char *) buf + off, std::min(n, hashed - off));
+        });
+        if (res == 0 && verify) {
+            unsigned char digest[IMAGE_HASH_LEN];
+            hash.Final(digest);
+            if (memcmp(digest, (char *) buf + hashed, IMAGE_HASH_LEN) != 0)
                 throw pickle_error(EINVAL, __func__, __LINE__);
-            }
+        }
+    } catch (const pickle_error &e) {
+        res = -e.get_errno();
+    }
+    if (res != 0) {
+        free(buf);
+        return res;
+    }
+    image = std::make_shared<MappedImage>(buf, len, true);
+    return 0;
+}
 
-            if (res == 0) {
-                throw pickle_error(ENOMEM, __func__, __LINE__);
-            }
-            ptr += res;
+/* load_file_system: Load the file system from an image.
+ *
+ * NOTE: load_file_system() expects a memory buffer or a mmap'ed area
+ * instead of a FILE object.
+ *
+ * @param[in]  data: pointer to the image
+ * @param[in]  len: length of the image
+ * @param[out] fs: The file system and its state pool
+ * @param[in]  image: The mapping that data points into, if any.  If given,
+ *             loaded files refer to their contents in the mapping instead
+ *             of copying them.
+ * @param[in]  lazy: The image file that data is a mapping of, if any.  If
+ *             given, loaded files read their contents from it on first
+ *             access, and data need not stay mapped after loading.
+ * @param[in]  base_fs: For a delta image, the file system its base image
+ *             holds.  Inodes and states that did not change are copied
+ *             from it.  The caller checks that it is the right base.
+ *
+ * The sections and the inode ranges within them are loaded in parallel.
+ *
+ * @return: bytes used, or a negative error code
+ */
+ssize_t load_file_system(const void *data, size_t len, fs_snapshot &fs,
+                         const std::shared_ptr<MappedImage> &image,
+                         const std::shared_ptr<ImageFile> &lazy,
+                         const fs_snapshot *base_fs) {
+    const char *base = (const char *) data;
+    struct load_source src = {image, lazy, base, 0};
+    std::vector<struct image_section> index;
+    int res = read_image_index(data, len, index);
+    if (res != 0)
+        return -res;
+    bool delta = image_flags(base) & IMAGE_FLAG_DELTA;
+    if (delta != (base_fs != nullptr))
+        return -EINVAL;
+
+    std::vector<struct section_load> sections;
+    /* States that are the same as their reference section, and the latter */
+    std::vector<std::pair<uint64_t, const verifs2_state *>> base_states;
+    /* Every image holds exactly one live file system */
+    size_t nr_live = 0;
+    for (const auto &entry : index) {
+        /* Unknown section types are skipped */
+        if (entry.type != IMAGE_SECTION_LIVE && entry.type != IMAGE_SECTION_STATE &&
+            entry.type != IMAGE_SECTION_STATE_BASE)
+            continue;
+        if (entry.type == IMAGE_SECTION_LIVE && ++nr_live > 1)
+            return -EINVAL;
+        const verifs2_state *ref = nullptr;
+        if (base_fs) {
+            auto it = base_fs->states.find(entry.key);
+            ref = (entry.type != IMAGE_SECTION_LIVE && it != base_fs->states.end())
+                  ? &it->second : &base_fs->live;
         }
-        size_t num_pending_delete;
-        memcpy(&num_pending_delete, ptr, sizeof(num_pending_delete));
-        ptr += sizeof(num_pending_delete);
-        for (size_t i = 0; i < num_pending_delete; ++i) {
-            fuse_ino_t ino;
-            memcpy(&ino, ptr, sizeof(ino));
-            pending_delete_inodes.push(ino);
-            ptr += sizeof(ino);
+        if (entry.type == IMAGE_SECTION_STATE_BASE) {
+            if (ref == nullptr)
+                return -EINVAL;
+            base_states.emplace_back(entry.key, ref);
+            continue;
         }
+        struct section_load sl;
+        sl.start = base + entry.offset;
+        sl.end = sl.start + entry.length;
+        sl.base = ref ? &std::get<0>(*ref) : nullptr;
+        sections.push_back(std::move(sl));
+    }
+    if (nr_live == 0)
+        return -EINVAL;
+    res = load_sections(sections, src);
+    if (res != 0)
+        return res;
 
-        // start unpickling checkpoint/restore pools
-        auto state_pool = get_state_pool();
-
-        state_pool.clear();
-        size_t num_state_pool;
-        memcpy(&num_state_pool, ptr, sizeof(num_state_pool));
-        ptr += sizeof(num_state_pool);
-
-        for (size_t i = 0; i < num_state_pool; ++i) {
-            uint64_t key;
-            memcpy(&key, ptr, sizeof(key));
-            ptr += sizeof(key);
-
-            size_t num_stored_files;
-            memcpy(&num_stored_files, ptr, sizeof(num_stored_files));
-            ptr += sizeof(num_stored_files);
-
-            auto cr_inodes = std::vector<Inode *>();
-
-            for (size_t j = 0; j < num_stored_files; ++j) {
-                struct inode_state iinfo;
-                memcpy(&iinfo, ptr, sizeof(iinfo));
-                ptr += sizeof(iinfo);
-                if (!iinfo.exist)
-                    continue;
-
-                size_t res;
-                const void *ptr2 = (const void *) ptr;
-                if (S_ISREG(iinfo.mode)) {
-                    File *file = new File();
-                    res = file->Load(ptr2);
-                    cr_inodes.push_back(file);
-                } else if (S_ISDIR(iinfo.mode)) {
-                    auto *dir = new Directory();
-                    res = dir->Load(ptr2);
-                    cr_inodes.push_back(dir);
-                } else if (S_ISLNK(iinfo.mode)) {
-                    auto *link = new SymLink();
-                    res = link->Load(ptr2);
-                    cr_inodes.push_back(link);
-                } else if (S_ISCHR(iinfo.mode) || S_ISBLK(iinfo.mode) ||
-                           S_ISSOCK(iinfo.mode) || S_ISFIFO(iinfo.mode) || iinfo.mode == 0) {
-                    auto *special = new SpecialInode();
-                    res = special->Load(ptr2);
-                    cr_inodes.push_back(special);
-                } else {
-                    throw pickle_error(EINVAL, __func__, __LINE__);
-                }
-
-                if (res == 0) {
-                    throw pickle_error(ENOMEM, __func__, __LINE__);
-                }
-                ptr += res;
-            }
+    /* From here on, the inodes are owned by fs */
+    for (auto &sl : sections) {
+        if (sl.sect.type == IMAGE_SECTION_LIVE) {
+            std::get<0>(fs.live).swap(sl.inodes);
+            std::get<1>(fs.live).swap(sl.pending_delete_inodes);
+            std::get<2>(fs.live) = sl.fs_stat;
+        } else if (fs.states.count(sl.sect.key) == 0) {
+            fs.states.emplace(sl.sect.key,
+                              std::make_tuple(std::move(sl.inodes),
+                                              sl.pending_delete_inodes,
+                                              sl.fs_stat));
+        } else {
+            res = -EEXIST;
+        }
+        /* Anything not moved into fs (duplicate sections) is freed here */
+        free_inode_table(sl.inodes);
+    }
+    for (const auto &state : base_states) {
+        std::vector<Inode *> copied;
+        for (Inode *inode : std::get<0>(*state.second)) {
+            copied.push_back(inode ? copy_inode(inode) : nullptr);
+            if (inode && copied.back() == nullptr)
+                res = -EINVAL;
+        }
+        if (res == 0 && fs.states.count(state.first) == 0) {
+            fs.states.emplace(state.first,
+                              std::make_tuple(std::move(copied),
+                                              std::get<1>(*state.second),
+                                              std::get<2>(*state.second)));
+        } else if (res == 0) {
+            res = -EEXIST;
+        }
+        free_inode_table(copied);
+    }
+    return (res != 0) ? res : (ssize_t) len;
+}
+
+/* load_image_section: Load a single section of an image file.
+ *
+ * Only the trailer, the section table and the requested section are
+ * read, so one checkpoint (or the live file system) can be picked out of a
+ * large image cheaply.  The section is not verified against the image
+ * hash, since that would require reading the whole image.
+ *
+ * @return: 0 on success, or a negative error code; -ENOENT if the image
+ * has no such section.
+ */
+int load_image_section(int fd, uint32_t type, uint64_t key,
+                       std::vector<Inode *> &inodes,
+                       std::queue<fuse_ino_t> &pending_delete_inodes,
+                       struct statvfs &fs_stat) {
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+        return -errno;
+    size_t fsize = info.st_size;
+    if (fsize < IMAGE_HEADER_SIZE + IMAGE_TRAILER_SIZE)
+        return -EMSGSIZE;
 
-            auto cr_deleted_inodes = std::queue<fuse_ino_t>();
-            size_t num_stored_DeletedInodes;
-            memcpy(&num_stored_DeletedInodes, ptr, sizeof(num_stored_DeletedInodes));
-            ptr += sizeof(num_stored_DeletedInodes);
+    char header[IMAGE_HEADER_SIZE], trailer[IMAGE_TRAILER_SIZE];
+    int res = read_full(fd, header, sizeof(header), 0);
+    if (res == 0)
+        res = read_full(fd, trailer, sizeof(trailer), fsize - sizeof(trailer));
+    if (res == 0)
+        res = check_image_frame(header, trailer);
+    if (res != 0)
+        return -res;
+    /* Sections of a delta image are incomplete without the base */
+    if (image_flags(header) & IMAGE_FLAG_DELTA)
+        return -EOPNOTSUPP;
 
-            for (size_t j = 0; j < num_stored_DeletedInodes; ++j) {
-                fuse_ino_t ino;
-                memcpy(&ino, ptr, sizeof(ino));
-                ptr += sizeof(ino);
-                cr_deleted_inodes.push(ino);
-            }
+    uint64_t table_offset = get_u64(trailer);
+    uint64_t table_length = get_u64(trailer + 8);
+    if (!within(table_offset, table_length, fsize - IMAGE_TRAILER_SIZE))
+        return -EMSGSIZE;
+    std::vector<char> table(table_length);
+    if ((res = read_full(fd, table.data(), table_length, table_offset)) != 0)
+        return -res;
+    std::vector<struct image_section> sections;
+    if (parse_section_table(table.data(), table.data() + table_length,
+                            sections) == nullptr)
+        return -EINVAL;
 
-            struct statvfs stored_m_stbuf;
-            memcpy(&stored_m_stbuf, ptr, sizeof(stored_m_stbuf));
-            ptr += sizeof(stored_m_stbuf);
+    auto entry = std::find_if(sections.begin(), sections.end(),
+                              [&](const struct image_section &s) {
+                                  return s.type == type && s.key == key;
+                              });
+    if (entry == sections.end())
+        return -ENOENT;
+    if (!within(entry->offset, entry->length, table_offset))
+        return -EINVAL;
 
-            int ret;
-            ret = insert_state(key, std::make_tuple(cr_inodes, cr_deleted_inodes, stored_m_stbuf));
-            if (ret != 0) {
-                throw pickle_error(EINVAL, __func__, __LINE__);
-            }
-        }
+    /* mmap offsets must be page aligned */
+    size_t pgsize = sysconf(_SC_PAGESIZE);
+    size_t map_start = entry->offset / pgsize * pgsize;
+    size_t map_len = entry->offset + entry->length - map_start;
+    void *mapped = mmap(nullptr, map_len, PROT_READ, MAP_PRIVATE, fd, map_start);
+    if (mapped == MAP_FAILED)
+        return -errno;
+    auto image = std::make_shared<MappedImage>(mapped, map_len);
+    /* Sections loaded in keep referring into the image (see load_image()) */
+    res = image->Pin(fd);
+    if (res != 0)
+        return -res;
+    struct load_source src = {image, nullptr, (const char *) mapped,
+                              (off_t) map_start};
 
-    } catch (const pickle_error &e) {
-        return -e.get_errno();
+    std::vector<struct section_load> load(1);
+    load[0].start = (const char *) mapped + (entry->offset - map_start);
+    load[0].end = load[0].start + entry->length;
+    res = load_sections(load, src);
+    if (res != 0)
+        return res;
+    if (load[0].sect.type != type || load[0].sect.key != key) {
+        free_inode_table(load[0].inodes);
+        return -EINVAL;
     }
-    return ptr - (const char *) data;
+    inodes.swap(load[0].inodes);
+    pending_delete_inodes.swap(load[0].pending_delete_inodes);
+    fs_stat = load[0].fs_stat;
+    return 0;
 }
 
 static size_t get_fsize(int fd) {
@@ -540,52 +1513,322 @@ static size_t get_fsize(int fd) {
     return info.st_size;
 }
 
-int FuseRamFs::load_verifs2(void) {
-    char *path = nullptr;
-    void *mapped = nullptr;
-    int fd = -1, res = 0;
-    size_t content_size = 0;
+/* Turn a result of verify_state_file() / verify_image() into an exception */
+static void check_verify_result(int res) {
+    if (res > 0) {
+        throw pickle_error(res, __func__, __LINE__);
+    } else if (res == -1) {
+        // res == -1: size mismatches
+        throw pickle_error(EMSGSIZE, __func__, __LINE__);
+    } else if (res == -2) {
+        // res == -2: error occurred when hashing
+        throw pickle_error(EPROTO, __func__, __LINE__);
+    } else if (res == -3) {
+        // res == -3: hash mismatch
+        throw pickle_error(EINVAL, __func__, __LINE__);
+    }
+}
+
+/* ThreadJoiner: Joins a thread, if it was started, when leaving its
+ * scope, so that the thread is never destroyed joinable */
+class ThreadJoiner {
+private:
+    std::thread &m_thread;
+
+public:
+    explicit ThreadJoiner(std::thread &thread) : m_thread(thread) {}
+    ~ThreadJoiner() { Join(); }
+    ThreadJoiner(const ThreadJoiner &) = delete;
+    ThreadJoiner &operator=(const ThreadJoiner &) = delete;
+
+    void Join() {
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+};
+
+/* load_image: Load the file system from one image.
+ *
+ * The image is mapped once; its hash is computed on a separate thread
+ * while it is parsed, so both passes share the same page cache reads.
+ * If path is a pipe, FIFO or unix socket, the image is read from it front to
+ * back and verified as it arrives instead, and so is a file read with
+ * direct I/O.
+ *
+ * @param[in]  flags: VERIFS_IMAGE_* of load_verifs2()
+ * @param[in]  base: For a delta image, the file system its base holds, and
+ *             base_hash the hash of the base image.  If nullptr, the base
+ *             of a delta image is loaded from the path recorded in it.
+ * @param[out] loaded: The file system and its state pool
+ * @param[out] hash: The hash of the image
+ * @param[in]  depth: Number of delta images followed to get here
+ */
+static void load_image(const char *path, uint32_t flags, const fs_snapshot *base,
+                       const unsigned char *base_hash, fs_snapshot &loaded,
+                       unsigned char *hash, unsigned depth) {
+    bool lazy = flags & VERIFS_IMAGE_LAZY;
+    bool verify = !(flags & (VERIFS_IMAGE_LAZY | VERIFS_IMAGE_NOVERIFY));
+    bool direct = (flags & VERIFS_IMAGE_DIRECT) && !lazy;
+    std::shared_ptr<MappedImage> image;
+    std::shared_ptr<ImageFile> image_file;
+    int fd = -1;
     try {
-        path = fetch_filepath(VERIFS_LOAD_CFG);
-        fd = open(path, O_RDONLY);
-        if (fd < 0)
-            throw pickle_error(errno, __func__, __LINE__);
-        // verify integrity of the input state file
-        res = verify_state_file(fd);
-        if (res > 0) {
-            throw pickle_error(res, __func__, __LINE__);
-        } else if (res == -1) {
-            // res == -1: size mismatches
-            throw pickle_error(EMSGSIZE, __func__, __LINE__);
-        } else if (res == -2) {
-            // res == -2: error occurred when hashing
-            throw pickle_error(EPROTO, __func__, __LINE__);
-        } else if (res == -3) {
-            // res == -3: hash mismatch
+        int verify_res = 0;
+        if (is_image_stream(path)) {
+            /* Streams are read into memory (and verified) up front; there
+             * is no file to read contents from later */
+            if (lazy)
+                throw pickle_error(ESPIPE, __func__, __LINE__);
+            fd = open_image_stream(path, O_RDONLY);
+            if (fd < 0)
+                throw pickle_error(-fd, __func__, __LINE__);
+            int res = read_image_stream(fd, verify, image);
+            if (res < 0)
+                throw pickle_error(-res, __func__, __LINE__);
+            verify = false;
+        } else if (direct) {
+            /* Fall back to the page cache where O_DIRECT is not supported */
+            fd = open(path, O_RDONLY | O_DIRECT);
+            if (fd < 0 && errno == EINVAL)
+                fd = open(path, O_RDONLY);
+            if (fd < 0)
+                throw pickle_error(errno, __func__, __LINE__);
+            int res = read_image_direct(fd, verify, image);
+            if (res < 0)
+                throw pickle_error(-res, __func__, __LINE__);
+            verify = false;
+        } else {
+            fd = open(path, O_RDONLY);
+            if (fd < 0)
+                throw pickle_error(errno, __func__, __LINE__);
+            /* File contents are served from the image until they are
+             * modified, through the mapping or (lazily) by reading the
+             * image.  MAP_PRIVATE only keeps our side from writing back:
+             * later writes to the image file still show through, and
+             * reading past a truncated end faults.  So the image must not
+             * change while loaded; it is leased, and copied into memory
+             * if someone changes it anyway (see ImageLease). */
+            if (lazy) {
+                /* Files keep the descriptor instead of the mapping, which
+                 * is unmapped once the metadata has been parsed, and is
+                 * leased through a description of its own */
+                image_file = std::make_shared<ImageFile>(fd);
+                fd = -1;
+                int res = image_file->Pin();
+                if (res != 0)
+                    throw pickle_error(res, __func__, __LINE__);
+                std::string reopen = "/proc/self/fd/" + std::to_string(image_file->Fd());
+                fd = open(reopen.c_str(), O_RDONLY);
+                if (fd < 0)
+                    throw pickle_error(errno, __func__, __LINE__);
+            }
+            size_t content_size = get_fsize(fd);
+            if (content_size < IMAGE_HEADER_SIZE + IMAGE_TRAILER_SIZE)
+                throw pickle_error(EMSGSIZE, __func__, __LINE__);
+            void *mapped = mmap(nullptr, content_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED)
+                throw pickle_error(errno, __func__, __LINE__);
+            image = std::make_shared<MappedImage>(mapped, content_size);
+            int res = image->Pin(fd);
+            if (res != 0)
+                throw pickle_error(res, __func__, __LINE__);
+        }
+        const void *mapped = image->Data();
+        size_t content_size = image->Length();
+        memcpy(hash, image_hash(mapped, content_size), IMAGE_HASH_LEN);
+
+        // a delta image needs the file system of its base
+        unsigned char want_hash[IMAGE_HASH_LEN], found_hash[IMAGE_HASH_LEN];
+        std::string base_path;
+        fs_snapshot found;
+        int res = read_image_base(mapped, content_size, want_hash, base_path);
+        if (res == 0) {
+            if (base == nullptr) {
+                if (depth >= IMAGE_MAX_CHAIN)
+                    throw pickle_error(ELOOP, __func__, __LINE__);
+                load_image(base_path.c_str(), flags, nullptr, nullptr, found,
+                           found_hash, depth + 1);
+                base = &found;
+                base_hash = found_hash;
+            }
+            if (memcmp(base_hash, want_hash, IMAGE_HASH_LEN) != 0)
+                throw pickle_error(EINVAL, __func__, __LINE__);
+        } else if (res != -ENOENT) {
+            throw pickle_error(-res, __func__, __LINE__);
+        } else if (base != nullptr) {
+            /* Only delta images can follow another image in a chain */
             throw pickle_error(EINVAL, __func__, __LINE__);
         }
-        // mmap the file
-        content_size = get_fsize(fd);
-        mapped = mmap(nullptr, content_size, PROT_READ, MAP_SHARED, fd, 0);
-        if (mapped == MAP_FAILED)
-            throw pickle_error(errno, __func__, __LINE__);
-        // load the file system
-        clear_states();
-        FuseRamFs::Inodes.clear();
-        while (!FuseRamFs::DeletedInodes.empty())
-            FuseRamFs::DeletedInodes.pop();
-        char *ptr = (char *) mapped + sizeof(state_file_header);
-        load_file_system(ptr, FuseRamFs::Inodes, FuseRamFs::DeletedInodes,
-                         FuseRamFs::m_stbuf);
+
+        /* Verify the integrity of the image while loading it.  The bytes
+         * are parsed before they are known to be good (and with LAZY or
+         * NOVERIFY never checked), so the parser relies on bounds checks
+         * alone to stay within the image. */
+        std::thread verifier;
+        ThreadJoiner join_verifier(verifier);
+        if (verify) {
+            madvise((void *) mapped, content_size, MADV_SEQUENTIAL);
+            verifier = std::thread([&]() {
+                verify_res = verify_image(mapped, content_size);
+            });
+        }
+        ssize_t load_res;
+        try {
+            load_res = load_file_system(mapped, content_size, loaded,
+                                        lazy ? nullptr : image, image_file, base);
+        } catch (const std::bad_alloc &) {
+            load_res = -ENOMEM;
+        }
+        join_verifier.Join();
+        /* On failure, the caller's `loaded` frees whatever has been loaded */
+        check_verify_result(verify_res);
+        if (load_res < 0)
+            throw pickle_error(-load_res, __func__, __LINE__);
     } catch (const pickle_error &e) {
-        res = -e.get_errno();
+        if (fd >= 0)
+            close(fd);
+        throw;
     }
-    if (mapped)
-        munmap(mapped, content_size);
     if (fd >= 0)
         close(fd);
-    if (path)
-        free(path);
+}
+
+/* load_image_file: Load an image, and the bases of a delta image, outside
+ * of any mounted file system.
+ *
+ * @param[in]  flags: VERIFS_IMAGE_LAZY, VERIFS_IMAGE_NOVERIFY and
+ *             VERIFS_IMAGE_DIRECT, as for load_verifs2().  Without the
+ *             first two, file contents refer to a private mapping of the
+ *             image, so even large images are read only where used.
+ * @param[out] loaded: The file system and state pool of the image
+ *
+ * @return: 0 on success, or a negative error code.
+ */
+int load_image_file(const char *path, uint32_t flags, fs_snapshot &loaded) {
+    unsigned char hash[IMAGE_HASH_LEN];
+    try {
+        load_image(path, flags, nullptr, nullptr, loaded, hash, 0);
+    } catch (const pickle_error &e) {
+        return -e.get_errno();
+    }
+    return 0;
+}
 
+/* load_verifs2: Load the file system from an image.
+ *
+ * @param[in] path: Path to the image, or nullptr to read it from
+ *            VERIFS_LOAD_CFG (legacy VERIFS_LOAD ioctl).  If it is a delta
+ *            image, its base is loaded from the path recorded in it.
+ * @param[in] flags: As for a chain of images, below.
+ */
+int FuseRamFs::load_verifs2(const char *path, uint32_t flags) {
+    std::string source;
+    try {
+        if (path == nullptr) {
+            char *cfgpath = fetch_filepath(VERIFS_LOAD_CFG);
+            source = cfgpath;
+            free(cfgpath);
+        } else {
+            source = path;
+        }
+    } catch (const pickle_error &e) {
+        return -e.get_errno();
+    }
+    return load_verifs2(std::vector<std::string>{source}, flags);
+}
+
+/* Preload: Load the file system from an image before it is mounted, in
+ * place of the empty one FuseInit() would create.
+ *
+ * @param[in] flags: As for load_verifs2().
+ */
+int FuseRamFs::Preload(const char *path, uint32_t flags) {
+    return load_verifs2(std::vector<std::string>{path}, flags);
+}
+
+/* SetExitPickle: Have FuseDestroy() pickle the file system to path when it
+ * is unmounted */
+void FuseRamFs::SetExitPickle(const char *path) {
+    exitPicklePath = path;
+}
+
+/* load_verifs2: Load the file system from a chain of images.
+ *
+ * The loaded inodes and states replace the current ones only if every
+ * image parses and passes the hash check; otherwise the file system is
+ * left as it was.
+ *
+ * Mapped and lazily loaded images must not be written to or truncated
+ * while files still refer to them; they are leased meanwhile, and a
+ * writer waits for the image to be copied into memory (see ImageLease).
+ *
+ * @param[in] chain: Paths to the images, oldest first; each image after
+ *            the first must be a delta image of the one before it.
+ * @param[in] flags: VERIFS_IMAGE_LAZY to build the inodes now but leave
+ *            file contents in the images until they are first accessed.
+ *            The image hashes are not checked in this mode, since that
+ *            would read all of the contents; the load time then depends on
+ *            the number of inodes only.
+ *            VERIFS_IMAGE_NOVERIFY to skip the hash check of trusted images.
+ *            VERIFS_IMAGE_DIRECT to read image files into memory with
+ *            O_DIRECT instead of mapping them; not with VERIFS_IMAGE_LAZY.
+ */
+int FuseRamFs::load_verifs2(const std::vector<std::string> &chain, uint32_t flags) {
+    if (chain.empty())
+        return -EINVAL;
+    try {
+        fs_snapshot loaded;
+        unsigned char hash[IMAGE_HASH_LEN];
+        for (size_t i = 0; i < chain.size(); ++i) {
+            /* Whatever the next image does not take from its base is freed
+             * along with `prev` */
+            fs_snapshot prev;
+            unsigned char prev_hash[IMAGE_HASH_LEN];
+            prev.swap(loaded);
+            memcpy(prev_hash, hash, IMAGE_HASH_LEN);
+            load_image(chain[i].c_str(), flags, i ? &prev : nullptr,
+                       i ? prev_hash : nullptr, loaded, hash, 0);
+        }
+
+        // replace the file system
+        std::unique_lock<std::shared_mutex> lk(crMutex);
+        invalidate_kernel_states();
+        Inodes.swap(std::get<0>(loaded.live));
+        DeletedInodes.swap(std::get<1>(loaded.live));
+        std::swap(m_stbuf, std::get<2>(loaded.live));
+        auto old_states = get_state_pool();
+        clear_states();
+        for (const auto &state : loaded.states)
+            insert_state(state.first, state.second);
+        /* The old inodes and states are freed along with `loaded` */
+        loaded.states.swap(old_states);
+    } catch (const pickle_error &e) {
+        return -e.get_errno();
+    }
+    return 0;
+}
+
+/* import_state: Load the live file system of an image as a checkpoint.
+ *
+ * The state pool of the image, if any, is ignored, and the live file
+ * system is not touched.  A delta image is loaded along with its base.
+ *
+ * @param[in] key: Key of the new checkpoint, which must not exist yet
+ * @param[in] flags: VERIFS_IMAGE_LAZY, VERIFS_IMAGE_NOVERIFY and
+ *            VERIFS_IMAGE_DIRECT, as for load_verifs2().
+ *
+ * @return: 0 on success, or a negative error code; -EEXIST if the key is
+ * taken.
+ */
+int FuseRamFs::import_state(uint64_t key, const char *path, uint32_t flags) {
+    fs_snapshot loaded;
+    int res = load_image_file(path, flags, loaded);
+    if (res != 0)
+        return res;
+    std::unique_lock<std::shared_mutex> lk(crMutex);
+    res = insert_state(key, loaded.live);
+    /* The state pool owns the inodes now */
+    if (res == 0)
+        std::get<0>(loaded.live).clear();
     return res;
 }
@@ -24,12 +24,110 @@
 #ifndef _PICKLE_HPP_
 #define _PICKLE_HPP_
 
-int pickle_file_system(int fd, std::vector<Inode *>& inodes,
-                       std::queue<fuse_ino_t>& pending_delete_inodes,
-                       struct statvfs &fs_stat, SHA256_CTX *hashctx);
+#include <array>
+#include <memory>
+#include <exception>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <mcfs/errnoname.h>
+
+#include "inode.hpp"
+#include "file.hpp"
+#include "image_format.hpp"
+#include "cr_util.hpp"
+#include "fuse_cpp_ramfs.hpp"
+
+class pickle_error : public std::exception {
+public:
+    int _errno;
+    std::string func;
+    int line;
+
+    pickle_error(int err, std::string func, int line) noexcept {
+        _errno = err;
+        this->func = func;
+        this->line = line;
+        fprintf(stderr, "Pickling error %s(%d) at %s:%d.\n",
+                errnoname(_errno), _errno, func.c_str(), line);
+    }
+
+    pickle_error(const pickle_error &other) {
+        _errno = other._errno;
+        func = other.func;
+        line = other.line;
+    }
+
+    const char *what() const noexcept {
+        return errnoname(_errno);
+    }
+
+    int get_errno() const noexcept {
+        return _errno;
+    }
+};
+
+/* ImageHash: SHA-256 over an image, on either OpenSSL API */
+class ImageHash {
+private:
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MD_CTX *m_ctx;
+#else
+    SHA256_CTX m_ctx;
+#endif
+
+public:
+    ImageHash();
+    ~ImageHash();
+    ImageHash(const ImageHash &) = delete;
+    ImageHash &operator=(const ImageHash &) = delete;
+
+    void Update(const void *data, size_t len);
+    void Final(unsigned char *digest);
+};
+
+/* A SHA-256 digest */
+typedef std::array<unsigned char, IMAGE_HASH_LEN> image_digest;
+
+/* Fingerprints of a pickled section, for finding what changed since.
+ * They are digests of what is pickled, but for file contents, which stand
+ * for themselves by their version (see PickleWriter::ContentsVersion()),
+ * so that no contents are read to find what changed. */
+struct section_fingerprint {
+    /* statvfs, inode count and pending delete list */
+    image_digest frame;
+    /* One per inode slot; all zeros for an empty slot */
+    std::vector<image_digest> slots;
+};
+
+/* pickle_baseline: What an image holds, as far as delta images need it */
+struct pickle_baseline {
+    unsigned char hash[IMAGE_HASH_LEN];
+    std::string path;
+    std::map<std::pair<uint32_t, uint64_t>, struct section_fingerprint> sections;
+};
+
+int pickle_file_system(int fd, const std::vector<Inode *>& inodes,
+                       const std::queue<fuse_ino_t>& pending_delete_inodes,
+                       const struct statvfs &fs_stat,
+                       const std::unordered_map<uint64_t, verifs2_state> &states,
+                       const pickle_baseline *base = nullptr,
+                       pickle_baseline *result = nullptr);
 int verify_state_file(int fd);
-ssize_t load_file_system(const void *data, std::vector<Inode *>& inodes,
-                         std::queue<fuse_ino_t>& pending_del_inodes,
-                         struct statvfs &fs_stat);
+int verify_image(const void *data, size_t len);
+int read_image_stream(int fd, bool verify, std::shared_ptr<MappedImage> &image);
+int read_image_index(const void *data, size_t len,
+                     std::vector<struct image_section> &sections);
+int read_image_base(const void *data, size_t len, unsigned char *hash,
+                    std::string &path);
+ssize_t load_file_system(const void *data, size_t len, fs_snapshot &fs,
+                         const std::shared_ptr<MappedImage> &image = nullptr,
+                         const std::shared_ptr<ImageFile> &lazy = nullptr,
+                         const fs_snapshot *base = nullptr);
+int load_image_file(const char *path, uint32_t flags, fs_snapshot &loaded);
+int pickle_image_file(const char *path, const fs_snapshot &snap, uint32_t flags);
+int load_image_section(int fd, uint32_t type, uint64_t key,
+                       std::vector<Inode *>& inodes,
+                       std::queue<fuse_ino_t>& pending_del_inodes,
+                       struct statvfs &fs_stat);
 
-#endif // _PICKLE_HPP_
\ No newline at end of file
+#endif // _PICKLE_HPP_
@@ -27,12 +27,52 @@
 #include <mcfs/errnoname.h>
 #include "common.h"
 #include "cr.h"
+#include "tool_util.hpp"
+#include <sys/wait.h>
 
 // 2023-04-14: VeriFS2 pickle and load only support Ubuntu20 and does not support Ubuntu22 yet
 
 int main(int argc, char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <mountpoint> <output-file>\n", argv[0]);
+    // -b: return once the file system is copied and pickle in the background
+    // -d: write only what changed since the last pickle, which must be kept
+    // -D: write the image with direct I/O, around the page cache
+    // -k <key>: write only checkpoint <key> of the state pool
+    uint32_t flags = 0;
+    bool async = false;
+    bool export_state = false;
+    uint64_t key = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "bdDk:")) != -1) {
+        if (opt == 'b') {
+            flags |= VERIFS_IMAGE_ASYNC;
+            async = true;
+        } else if (opt == 'd') {
+            flags |= VERIFS_IMAGE_DELTA;
+        } else if (opt == 'D') {
+            flags |= VERIFS_IMAGE_DIRECT;
+        } else if (opt == 'k') {
+            export_state = true;
+            key = parse_key(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-b] [-d] [-D] [-k <key>] <mountpoint> <output-file|->\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind < 2) {
+        fprintf(stderr, "Usage: %s [-b] [-d] [-D] [-k <key>] <mountpoint> <output-file|->\n",
+                argv[0]);
+        exit(1);
+    }
+    argv += optind - 1;
+    // "-": write the image to stdout
+    bool streaming = (strcmp(argv[2], "-") == 0);
+    if (streaming && async) {
+        fprintf(stderr, "-b cannot be used with -\n");
+        exit(1);
+    }
+    if (export_state && (flags & (VERIFS_IMAGE_ASYNC | VERIFS_IMAGE_DELTA))) {
+        fprintf(stderr, "-k cannot be used with -b or -d\n");
         exit(1);
     }
 
@@ -43,27 +83,58 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    // write the config file to pass the output file path
-    int cfgfd = open(VERIFS_PICKLE_CFG, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (cfgfd < 0) {
-        fprintf(stderr, "Cannot open/create %s: (%d:%s)\n", VERIFS_PICKLE_CFG,
-                errno, errnoname(errno));
-        exit(2);
+    // pass the output file path in the ioctl payload; the file system
+    // resolves it relative to its own working directory, so make it absolute
+    struct verifs_image_arg iarg;
+    memset(&iarg, 0, sizeof(iarg));
+    iarg.version = VERIFS_IMAGE_ARG_VERSION;
+    iarg.flags = flags;
+    int len;
+    int pipefd[2] = {-1, -1};
+    pid_t pump = -1;
+    if (streaming) {
+        // the file system writes to a pipe, opened through /proc, and a
+        // child process copies it to stdout
+        if (pipe(pipefd) < 0 || (pump = fork()) < 0) {
+            fprintf(stderr, "Cannot create pipe: (%d:%s)\n", errno, errnoname(errno));
+            exit(2);
+        }
+        if (pump == 0) {
+            close(pipefd[1]);
+            copy_stream(pipefd[0], STDOUT_FILENO);
+            _exit(0);
+        }
+        close(pipefd[0]);
+        len = snprintf(iarg.path, sizeof(iarg.path), "/proc/%d/fd/%d",
+                       getpid(), pipefd[1]);
+    } else {
+        len = absolute_path(argv[2], iarg.path, sizeof(iarg.path));
     }
-    size_t pathlen = strnlen(argv[2], PATH_MAX);
-    ssize_t res = write(cfgfd, argv[2], pathlen);
-    if (res < 0) {
-        fprintf(stderr, "Cannot write parameter to %s: (%d:%s)\n",
-                VERIFS_PICKLE_CFG, errno, errnoname(errno));
+    if (len >= (int) sizeof(iarg.path)) {
+        fprintf(stderr, "Path too long: %s\n", argv[2]);
         exit(3);
     }
-    close(cfgfd);
 
     // call the ioctl
-    int ret = ioctl(dirfd, VERIFS_PICKLE, nullptr);
+    int ret;
+    if (export_state) {
+        struct verifs_state_arg sarg;
+        memset(&sarg, 0, sizeof(sarg));
+        sarg.version = VERIFS_IMAGE_ARG_VERSION;
+        sarg.flags = flags;
+        sarg.key = key;
+        memcpy(sarg.path, iarg.path, sizeof(sarg.path));
+        ret = ioctl(dirfd, VERIFS_EXPORT_STATE, &sarg);
+    } else {
+        ret = ioctl(dirfd, VERIFS_PICKLE_ARG, &iarg);
+    }
     if (ret != 0) {
-        printf("Result: ret = %d, errno = %d (%s)\n",
-               ret, errno, errnoname(errno));
+        fprintf(streaming ? stderr : stdout, "Result: ret = %d, errno = %d (%s)\n",
+                ret, errno, errnoname(errno));
+    }
+    if (streaming) {
+        close(pipefd[1]);
+        waitpid(pump, nullptr, 0);
     }
     close(dirfd);
     return (ret == 0) ? 0 : 1;
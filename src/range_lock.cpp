@@ -0,0 +1,77 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "chunk_pool.hpp"
+#include "range_lock.hpp"
+
+/* Widen [start, end) to whole chunks */
+static void align_range(uint64_t &start, uint64_t &end) {
+    const uint64_t size = ChunkPool::kChunkSize;
+    start -= start % size;
+    if (end % size != 0)
+        end = (end > RangeLock::kEnd - size) ? RangeLock::kEnd : end + (size - end % size);
+}
+
+RangeLock::Guard::Guard(RangeLock &lock, uint64_t start, uint64_t end, bool exclusive) :
+m_lock(lock), m_start(start), m_end(end), m_exclusive(exclusive) {
+    m_lock.Lock(m_start, m_end, m_exclusive);
+}
+
+bool RangeLock::Conflicts(uint64_t start, uint64_t end, bool exclusive) const {
+    for (const Range &r : m_held) {
+        if (r.start < end && start < r.end && (exclusive || r.exclusive))
+            return true;
+    }
+    return false;
+}
+
+void RangeLock::Lock(uint64_t start, uint64_t end, bool exclusive) {
+    align_range(start, end);
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_cond.wait(lk, [&] { return !Conflicts(start, end, exclusive); });
+    m_held.push_back({start, end, exclusive});
+}
+
+bool RangeLock::TryLock(uint64_t start, uint64_t end, bool exclusive) {
+    align_range(start, end);
+    std::lock_guard<std::mutex> lk(m_mutex);
+    if (Conflicts(start, end, exclusive))
+        return false;
+    m_held.push_back({start, end, exclusive});
+    return true;
+}
+
+void RangeLock::Unlock(uint64_t start, uint64_t end, bool exclusive) {
+    align_range(start, end);
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        for (auto it = m_held.begin(); it != m_held.end(); ++it) {
+            if (it->start == start && it->end == end && it->exclusive == exclusive) {
+                *it = m_held.back();
+                m_held.pop_back();
+                break;
+            }
+        }
+    }
+    m_cond.notify_all();
+}
@@ -0,0 +1,83 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RANGE_LOCK_HPP_
+#define _RANGE_LOCK_HPP_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/* RangeLock: Reader/writer locks on byte ranges of a file.
+ *
+ * Ranges are widened to whole chunks (see ChunkPool), so two holders
+ * never touch the same chunk unless both only read it.  A range overlaps
+ * another if they share a chunk; shared holders of overlapping ranges run
+ * together, an exclusive holder waits for every overlapping one.
+ */
+class RangeLock {
+public:
+    /* The end of a range that reaches past any file */
+    static const uint64_t kEnd = UINT64_MAX;
+
+    RangeLock() {}
+    RangeLock(const RangeLock &) = delete;
+    RangeLock &operator=(const RangeLock &) = delete;
+
+    void Lock(uint64_t start, uint64_t end, bool exclusive);
+    /* Lock the range only if that does not have to wait */
+    bool TryLock(uint64_t start, uint64_t end, bool exclusive);
+    void Unlock(uint64_t start, uint64_t end, bool exclusive);
+
+    /* Holds [start, end) for the lifetime of the guard */
+    class Guard {
+    public:
+        Guard(RangeLock &lock, uint64_t start, uint64_t end, bool exclusive);
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+        ~Guard() { m_lock.Unlock(m_start, m_end, m_exclusive); }
+
+    private:
+        RangeLock &m_lock;
+        uint64_t m_start;
+        uint64_t m_end;
+        bool m_exclusive;
+    };
+
+private:
+    struct Range {
+        uint64_t start;
+        uint64_t end;
+        bool exclusive;
+    };
+
+    bool Conflicts(uint64_t start, uint64_t end, bool exclusive) const;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::vector<Range> m_held;
+};
+
+#endif // _RANGE_LOCK_HPP_
@@ -0,0 +1,548 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* reffs-img: Inspect, diff, extract from and rewrite state images offline,
+ * without mounting a file system.
+ *
+ * Images are loaded with the same code as VERIFS_LOAD_ARG, into inodes that
+ * refer to their contents in a private mapping of the image, so only the
+ * contents that are looked at are read.
+ */
+
+#include "common.h"
+#include <functional>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "inode.hpp"
+#include "file.hpp"
+#include "directory.hpp"
+#include "symlink.hpp"
+#include "special_inode.hpp"
+#include "fuse_cpp_ramfs.hpp"
+#include "pickle.hpp"
+#include "serializer.hpp"
+#include "cr.h"
+#include "tool_util.hpp"
+
+/* The inode classes refer to the channel of a mounted file system, which
+ * they only use to reply to requests */
+struct fuse_chan *ch = nullptr;
+
+/* Paths of a file system state, and their inodes */
+typedef std::map<std::string, Inode *> path_map;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <command> [options] <args>\n"
+            "  info [-v] <image>\n"
+            "      show the header, sections and base of an image; -v checks its hash\n"
+            "  tree [-k <key>] <image>\n"
+            "      list the live file system, or checkpoint <key>\n"
+            "  extract [-k <key>] [-n] <image> <path> <dest>\n"
+            "      copy a file or directory out of the image to <dest>, without\n"
+            "      writing over existing files; -n skips checking the image hash\n"
+            "  diff [-a <key>] [-b <key>] <image-a> [<image-b>]\n"
+            "      compare two images, or two checkpoints of one image\n"
+            "  rewrite [-s] <image> <output>\n"
+            "      write an image, and the bases of a delta image, as one full\n"
+            "      image in the current format; -s drops the state pool\n",
+            prog);
+    exit(1);
+}
+
+static void die(const char *what, const char *path, int err) {
+    fprintf(stderr, "%s %s: %s (%d)\n", what, path, errnoname(err), err);
+    exit(2);
+}
+
+/* Load an image, checking its hash unless flags has VERIFS_IMAGE_NOVERIFY;
+ * file contents stay in the mapping */
+static void load(const char *path, fs_snapshot &snap, uint32_t flags) {
+    int res = load_image_file(path, flags, snap);
+    if (res != 0)
+        die("Cannot load", path, -res);
+}
+
+/* The live file system of an image, or one of its checkpoints */
+static const verifs2_state &select_state(const fs_snapshot &snap, const char *path,
+                                         bool has_key, uint64_t key) {
+    if (!has_key)
+        return snap.live;
+    auto it = snap.states.find(key);
+    if (it == snap.states.end()) {
+        fprintf(stderr, "%s has no checkpoint %lu\n", path, (unsigned long) key);
+        exit(2);
+    }
+    return it->second;
+}
+
+static Inode *get_inode(const std::vector<Inode *> &inodes, fuse_ino_t ino) {
+    return (ino < inodes.size()) ? inodes[ino] : nullptr;
+}
+
+/* Whether an entry name taken from an image names a single entry: paths
+ * are built from them, so one like "../x" or "a/b" would lead elsewhere */
+static bool valid_name(const std::string &name) {
+    return !name.empty() && name != "." && name != ".." &&
+           name.find('/') == std::string::npos;
+}
+
+/* Collect every path below a directory; directories reachable more than
+ * once (which a consistent image never has) are only visited once, and
+ * entries with invalid names are left out */
+static void walk(const std::vector<Inode *> &inodes, fuse_ino_t ino,
+                 const std::string &path, path_map &paths,
+                 std::vector<bool> &visited) {
+    Inode *inode = get_inode(inodes, ino);
+    paths[path] = inode;
+    if (inode == nullptr || !S_ISDIR(inode->GetMode()) || visited[ino])
+        return;
+    visited[ino] = true;
+    auto *dir = dynamic_cast<Directory *>(inode);
+    if (dir == nullptr)
+        return;
+    for (const auto &child : dir->Children()) {
+        if (child.first == "." || child.first == "..")
+            continue;
+        if (!valid_name(child.first)) {
+            fprintf(stderr, "Skipping invalid name \"%s\" in %s\n",
+                    child.first.c_str(), path.c_str());
+            continue;
+        }
+        std::string sub = (path == "/") ? "/" + child.first : path + "/" + child.first;
+        walk(inodes, child.second, sub, paths, visited);
+    }
+}
+
+static void collect_paths(const verifs2_state &state, path_map &paths) {
+    const auto &inodes = std::get<0>(state);
+    std::vector<bool> visited(inodes.size(), false);
+    walk(inodes, FUSE_ROOT_ID, "/", paths, visited);
+}
+
+static std::string mode_string(mode_t mode) {
+    std::string s = "?---------";
+    if (S_ISREG(mode)) s[0] = '-';
+    else if (S_ISDIR(mode)) s[0] = 'd';
+    else if (S_ISLNK(mode)) s[0] = 'l';
+    else if (S_ISCHR(mode)) s[0] = 'c';
+    else if (S_ISBLK(mode)) s[0] = 'b';
+    else if (S_ISFIFO(mode)) s[0] = 'p';
+    else if (S_ISSOCK(mode)) s[0] = 's';
+    const char *rwx = "rwxrwxrwx";
+    for (int i = 0; i < 9; ++i) {
+        if (mode & (1 << (8 - i)))
+            s[i + 1] = rwx[i];
+    }
+    return s;
+}
+
+static std::string hex(const unsigned char *data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string s;
+    for (size_t i = 0; i < len; ++i) {
+        s += digits[data[i] >> 4];
+        s += digits[data[i] & 0xf];
+    }
+    return s;
+}
+
+static const char *section_name(uint32_t type) {
+    switch (type) {
+        case IMAGE_SECTION_LIVE: return "live";
+        case IMAGE_SECTION_STATE: return "state";
+        case IMAGE_SECTION_BASE: return "base";
+        case IMAGE_SECTION_STATE_BASE: return "state-base";
+        default: return "unknown";
+    }
+}
+
+static int cmd_info(int argc, char **argv) {
+    bool verify = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        if (opt == 'v')
+            verify = true;
+        else
+            usage(argv[0]);
+    }
+    if (argc - optind != 1)
+        usage(argv[0]);
+    const char *path = argv[optind];
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        die("Cannot open", path, errno);
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        die("Cannot stat", path, errno);
+    size_t len = st.st_size;
+    if (len < IMAGE_HEADER_SIZE + IMAGE_TRAILER_SIZE)
+        die("Cannot read", path, EMSGSIZE);
+    void *mapped = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED)
+        die("Cannot map", path, errno);
+    close(fd);
+    const char *data = (const char *) mapped;
+
+    std::vector<struct image_section> sections;
+    int res = read_image_index(data, len, sections);
+    if (res != 0)
+        die("Cannot read", path, res);
+    uint32_t flags = get_u32(data + IMAGE_MAGIC_LEN + 4);
+    const unsigned char *hash = (const unsigned char *) data + len - IMAGE_UNHASHED_SIZE;
+    printf("version:  %u\n", get_u32(data + IMAGE_MAGIC_LEN));
+    printf("flags:    %s\n", (flags & IMAGE_FLAG_DELTA) ? "delta" : "full");
+    printf("size:     %zu\n", len);
+    printf("sha256:   %s\n", hex(hash, IMAGE_HASH_LEN).c_str());
+    unsigned char base_hash[IMAGE_HASH_LEN];
+    std::string base_path;
+    if (read_image_base(data, len, base_hash, base_path) == 0) {
+        printf("base:     %s\n", base_path.c_str());
+        printf("base sha: %s\n", hex(base_hash, IMAGE_HASH_LEN).c_str());
+    }
+    if (verify)
+        printf("hash:     %s\n", verify_image(data, len) == 0 ? "ok" : "MISMATCH");
+
+    printf("\n%-10s %20s %12s %12s %10s\n", "SECTION", "KEY", "OFFSET", "LENGTH", "INODES");
+    for (const auto &sect : sections) {
+        std::string ninodes = "-";
+        if (sect.type == IMAGE_SECTION_LIVE || sect.type == IMAGE_SECTION_STATE) {
+            /* type, key, statvfs (11 varints), then the slot count */
+            PickleReader in(data + sect.offset, data + sect.offset + sect.length);
+            uint64_t v = 0;
+            for (int i = 0; i < 2 + 11 + 1; ++i)
+                in.Varint(v);
+            if (in.Error() == 0)
+                ninodes = std::to_string(v);
+        }
+        printf("%-10s %20lu %12lu %12lu %10s\n", section_name(sect.type),
+               (unsigned long) sect.key, (unsigned long) sect.offset,
+               (unsigned long) sect.length, ninodes.c_str());
+    }
+    munmap(mapped, len);
+    return 0;
+}
+
+static void print_entry(const std::string &path, Inode *inode) {
+    if (inode == nullptr) {
+        printf("?????????? %4s %5s %5s %12s %s (missing inode)\n", "?", "?", "?", "?",
+               path.c_str());
+        return;
+    }
+    struct stat st;
+    inode->GetAttr(&st);
+    printf("%s %4lu %5u %5u %12ld %s", mode_string(st.st_mode).c_str(),
+           (unsigned long) st.st_nlink, st.st_uid, st.st_gid, (long) st.st_size,
+           path.c_str());
+    if (auto *link = dynamic_cast<SymLink *>(inode))
+        printf(" -> %s", link->Link());
+    printf("\n");
+}
+
+static int cmd_tree(int argc, char **argv) {
+    bool has_key = false;
+    uint64_t key = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "k:")) != -1) {
+        if (opt == 'k') {
+            has_key = true;
+            key = parse_key(optarg);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1)
+        usage(argv[0]);
+    fs_snapshot snap;
+    load(argv[optind], snap, VERIFS_IMAGE_NOVERIFY);
+    path_map paths;
+    collect_paths(select_state(snap, argv[optind], has_key, key), paths);
+    for (const auto &entry : paths)
+        print_entry(entry.first, entry.second);
+    return 0;
+}
+
+/* File contents are copied out in pieces of this size */
+static const size_t kCopySize = 1 << 20;
+
+static int write_full(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t res = write(fd, buf, len);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return errno;
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/* Copy one inode out to dest; returns 0 or an error number */
+static int extract_one(Inode *inode, const std::string &dest) {
+    struct stat st;
+    inode->GetAttr(&st);
+    mode_t perm = st.st_mode & 07777;
+    if (S_ISDIR(st.st_mode)) {
+        if (mkdir(dest.c_str(), perm | S_IRWXU) == 0)
+            return 0;
+        /* An existing directory is extracted into, but not a symlink to one */
+        struct stat old;
+        if (errno != EEXIST || lstat(dest.c_str(), &old) < 0)
+            return errno;
+        return S_ISDIR(old.st_mode) ? 0 : EEXIST;
+    }
+    if (S_ISLNK(st.st_mode)) {
+        auto *link = dynamic_cast<SymLink *>(inode);
+        if (link == nullptr || symlink(link->Link(), dest.c_str()) < 0)
+            return link ? errno : EINVAL;
+        return 0;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Skipping special file %s\n", dest.c_str());
+        return 0;
+    }
+    auto *file = dynamic_cast<File *>(inode);
+    if (file == nullptr)
+        return EIO;
+    /* Never write through what is already there */
+    int fd = open(dest.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, perm);
+    if (fd < 0)
+        return errno;
+    std::vector<char> buf(kCopySize);
+    int res = 0;
+    for (off_t off = 0; off < st.st_size && res == 0; off += kCopySize) {
+        ssize_t n = file->Read(buf.data(), kCopySize, off);
+        if (n <= 0)
+            res = (n < 0) ? -n : EIO;
+        else
+            res = write_full(fd, buf.data(), n);
+    }
+    if (close(fd) < 0 && res == 0)
+        res = errno;
+    return res;
+}
+
+static int cmd_extract(int argc, char **argv) {
+    bool has_key = false;
+    uint64_t key = 0;
+    uint32_t flags = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "k:n")) != -1) {
+        if (opt == 'k') {
+            has_key = true;
+            key = parse_key(optarg);
+        } else if (opt == 'n') {
+            flags |= VERIFS_IMAGE_NOVERIFY;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3)
+        usage(argv[0]);
+    const char *image = argv[optind];
+    std::string src = argv[optind + 1];
+    std::string dest = argv[optind + 2];
+    while (src.size() > 1 && src.back() == '/')
+        src.pop_back();
+    if (src.empty() || src[0] != '/')
+        src = "/" + src;
+
+    fs_snapshot snap;
+    load(image, snap, flags);
+    path_map paths;
+    collect_paths(select_state(snap, image, has_key, key), paths);
+    auto it = paths.find(src);
+    if (it == paths.end() || it->second == nullptr)
+        die("Cannot find", src.c_str(), ENOENT);
+
+    /* The map is sorted, so a directory comes before everything in it */
+    std::string prefix = (src == "/") ? "/" : src + "/";
+    int failed = 0;
+    for (; it != paths.end(); ++it) {
+        if (it->first != src && it->first.compare(0, prefix.size(), prefix) != 0)
+            continue;
+        if (it->second == nullptr)
+            continue;
+        std::string out = dest + it->first.substr(src.size() == 1 ? 0 : src.size());
+        if (it->first == src)
+            out = dest;
+        int res = extract_one(it->second, out);
+        if (res != 0) {
+            fprintf(stderr, "Cannot extract %s: %s (%d)\n", it->first.c_str(),
+                    errnoname(res), res);
+            failed = 1;
+        }
+    }
+    return failed ? 2 : 0;
+}
+
+/* Whether two files of the same size have the same contents */
+static bool same_contents(File *a, File *b, off_t size) {
+    std::vector<char> ba(kCopySize), bb(kCopySize);
+    for (off_t off = 0; off < size; off += kCopySize) {
+        ssize_t na = a->Read(ba.data(), kCopySize, off);
+        ssize_t nb = b->Read(bb.data(), kCopySize, off);
+        if (na <= 0 || na != nb || memcmp(ba.data(), bb.data(), na) != 0)
+            return false;
+    }
+    return true;
+}
+
+/* What differs between two inodes, or "" */
+static std::string compare_inodes(Inode *a, Inode *b) {
+    struct stat sa, sb;
+    a->GetAttr(&sa);
+    b->GetAttr(&sb);
+    std::string what;
+    if ((sa.st_mode & S_IFMT) != (sb.st_mode & S_IFMT))
+        return " type";
+    if (sa.st_mode != sb.st_mode)
+        what += " mode";
+    if (sa.st_uid != sb.st_uid || sa.st_gid != sb.st_gid)
+        what += " owner";
+    if (sa.st_nlink != sb.st_nlink)
+        what += " nlink";
+    if (sa.st_rdev != sb.st_rdev)
+        what += " rdev";
+    if (sa.st_size != sb.st_size) {
+        what += " size";
+    } else if (S_ISREG(sa.st_mode)) {
+        auto *fa = dynamic_cast<File *>(a);
+        auto *fb = dynamic_cast<File *>(b);
+        if (fa == nullptr || fb == nullptr || !same_contents(fa, fb, sa.st_size))
+            what += " contents";
+    }
+    auto *la = dynamic_cast<SymLink *>(a);
+    auto *lb = dynamic_cast<SymLink *>(b);
+    if (la && lb && strcmp(la->Link(), lb->Link()) != 0)
+        what += " target";
+    const auto &xa = a->XAttrs();
+    const auto &xb = b->XAttrs();
+    bool same_xattrs = xa.size() == xb.size() &&
+        std::equal(xa.begin(), xa.end(), xb.begin(), [](const auto &x, const auto &y) {
+            return x.first == y.first && x.second.second == y.second.second &&
+                   memcmp(x.second.first, y.second.first, x.second.second) == 0;
+        });
+    if (!same_xattrs)
+        what += " xattrs";
+    return what;
+}
+
+static int cmd_diff(int argc, char **argv) {
+    bool has_key[2] = {false, false};
+    uint64_t key[2] = {0, 0};
+    int opt;
+    while ((opt = getopt(argc, argv, "a:b:")) != -1) {
+        if (opt == 'a' || opt == 'b') {
+            has_key[opt - 'a'] = true;
+            key[opt - 'a'] = parse_key(optarg);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 && argc - optind != 2)
+        usage(argv[0]);
+    const char *image[2] = {argv[optind], argv[argc - 1]};
+    fs_snapshot snaps[2];
+    path_map paths[2];
+    load(image[0], snaps[0], VERIFS_IMAGE_NOVERIFY);
+    if (argc - optind == 2)
+        load(image[1], snaps[1], VERIFS_IMAGE_NOVERIFY);
+    for (int i = 0; i < 2; ++i) {
+        const fs_snapshot &snap = (argc - optind == 2) ? snaps[i] : snaps[0];
+        collect_paths(select_state(snap, image[i], has_key[i], key[i]), paths[i]);
+    }
+
+    /* Walk both sorted maps in step */
+    int differ = 0;
+    auto ia = paths[0].begin(), ib = paths[1].begin();
+    while (ia != paths[0].end() || ib != paths[1].end()) {
+        if (ib == paths[1].end() || (ia != paths[0].end() && ia->first < ib->first)) {
+            printf("- %s\n", ia->first.c_str());
+            ++ia;
+        } else if (ia == paths[0].end() || ib->first < ia->first) {
+            printf("+ %s\n", ib->first.c_str());
+            ++ib;
+        } else {
+            std::string what;
+            if (ia->second == nullptr || ib->second == nullptr)
+                what = (ia->second == ib->second) ? "" : " missing";
+            else
+                what = compare_inodes(ia->second, ib->second);
+            if (!what.empty())
+                printf("M %s:%s\n", ia->first.c_str(), what.c_str());
+            differ |= !what.empty();
+            ++ia;
+            ++ib;
+            continue;
+        }
+        differ = 1;
+    }
+    return differ;
+}
+
+static int cmd_rewrite(int argc, char **argv) {
+    bool strip = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        if (opt == 's')
+            strip = true;
+        else
+            usage(argv[0]);
+    }
+    if (argc - optind != 2)
+        usage(argv[0]);
+    fs_snapshot snap;
+    /* Check the hashes: whatever is rewritten gets a new, valid one */
+    load(argv[optind], snap, 0);
+    if (strip) {
+        /* Freed along with `dropped` */
+        fs_snapshot dropped;
+        dropped.states.swap(snap.states);
+    }
+    int res = pickle_image_file(argv[optind + 1], snap, 0);
+    if (res != 0)
+        die("Cannot write", argv[optind + 1], -res);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2)
+        usage(argv[0]);
+    static const std::map<std::string, std::function<int(int, char **)>> commands = {
+        {"info", cmd_info},
+        {"tree", cmd_tree},
+        {"extract", cmd_extract},
+        {"diff", cmd_diff},
+        {"rewrite", cmd_rewrite},
+    };
+    auto it = commands.find(argv[1]);
+    if (it == commands.end())
+        usage(argv[0]);
+    /* Let getopt see the command's own arguments */
+    argv[1] = argv[0];
+    return it->second(argc - 1, argv + 1);
+}
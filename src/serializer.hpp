@@ -0,0 +1,398 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SERIALIZER_HPP_
+#define _SERIALIZER_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/types.h>
+
+#include "image_format.hpp"
+
+class MappedImage;
+class ImageFile;
+
+/* Inode records are described once per class, by a member template
+ *
+ *     template <class Archive> void Serialize(Archive &ar);
+ *
+ * that visits the fields in record order.  The same description computes
+ * the size of a record (PickleSizer), writes it (PickleWriter) and reads it
+ * back (PickleReader); the few fields that need to act differently when
+ * loading test Archive::kLoading.  See image_format.hpp for the encodings.
+ *
+ * Archives do not throw on bad input: the first error is kept in Error()
+ * and later fields are skipped.
+ *
+ * Raw contents that may be large (file contents) are given to the writing
+ * archives by Contents(), as the last field of a record: PickleWriter does
+ * not buffer them but keeps the function that streams them, for the image
+ * writer to call after writing the rest of the record.  With them comes a
+ * version, which changes whenever the contents may have, so that telling
+ * whether a record changed does not take reading its contents.
+ */
+
+/* PickleStream: Where the contents of a record are streamed to */
+class PickleStream {
+public:
+    virtual ~PickleStream() {}
+    virtual void Write(const void *data, size_t len) = 0;
+    /* len zero bytes */
+    virtual void Zeros(size_t len) = 0;
+};
+
+/* Streams the contents to a PickleStream; returns 0 or an error number */
+typedef std::function<int(PickleStream &)> PickleContents;
+
+/* PickleSizer: Adds up the size of a record */
+class PickleSizer {
+private:
+    size_t m_size;
+
+public:
+    static constexpr bool kLoading = false;
+
+    PickleSizer() : m_size(0) {}
+
+    size_t Size() const { return m_size; }
+    int Error() const { return 0; }
+    void Fail(int) {}
+
+    template <class T> void Varint(const T &v) {
+        m_size += varint_size(static_cast<uint64_t>(v));
+    }
+    template <class T> void Varint(const std::atomic<T> &v) {
+        m_size += varint_size(static_cast<uint64_t>(v.load()));
+    }
+    template <class T> void Zigzag(const T &v) {
+        m_size += varint_size(zigzag_encode(static_cast<int64_t>(v)));
+    }
+    void Flag(bool) { m_size += 1; }
+    void Double(double) { m_size += sizeof(uint64_t); }
+    void String(const std::string &s) { m_size += bytes_size(s.size()); }
+    void Blob(const void *, size_t len) { m_size += bytes_size(len); }
+    /* Room for n raw bytes; there is nowhere to put them */
+    char *Extend(size_t n) {
+        m_size += n;
+        return nullptr;
+    }
+    void Contents(uint64_t n, uint64_t, const PickleContents &) { m_size += n; }
+
+    template <class E, class F> void Sequence(const std::vector<E> &v, F f) {
+        Varint(v.size());
+        for (auto &e : v)
+            f(e);
+    }
+    template <class K, class V, class F> void Sequence(const std::map<K, V> &m, F f) {
+        Varint(m.size());
+        for (auto &e : m)
+            f(e.first, e.second);
+    }
+};
+
+/* PickleWriter: Appends records to a growing buffer.
+ *
+ * The buffer is kept across Reset(), so pickling many inodes through one
+ * writer allocates only when a record is larger than any before it.  The
+ * contents are not buffered; see StreamContents().
+ */
+class PickleWriter {
+private:
+    char *m_data;
+    size_t m_len;
+    size_t m_cap;
+    int m_error;
+    uint64_t m_contentsLen;
+    uint64_t m_contentsVersion;
+    PickleContents m_contents;
+
+    /* Make room for n more bytes and return where they go, or nullptr
+     * once a field could not be written */
+    char *Reserve(size_t n) {
+        if (m_error != 0)
+            return nullptr;
+        if (m_cap - m_len < n) {
+            size_t cap = std::max(m_cap * 2, m_len + n);
+            char *data = (char *) realloc(m_data, cap);
+            if (data == nullptr) {
+                Fail(ENOMEM);
+                return nullptr;
+            }
+            m_data = data;
+            m_cap = cap;
+        }
+        return m_data + m_len;
+    }
+
+    void PutVarint(uint64_t v) {
+        char *p = Reserve(10);
+        if (p)
+            m_len = put_varint(p, v) - m_data;
+    }
+
+public:
+    static constexpr bool kLoading = false;
+
+    PickleWriter() : m_data(nullptr), m_len(0), m_cap(0), m_error(0), m_contentsLen(0),
+    m_contentsVersion(0) {}
+    ~PickleWriter() { free(m_data); }
+    PickleWriter(const PickleWriter &) = delete;
+    PickleWriter &operator=(const PickleWriter &) = delete;
+
+    /* Start a new record, keeping the buffer */
+    void Reset() {
+        m_len = 0;
+        m_error = 0;
+        m_contentsLen = 0;
+        m_contentsVersion = 0;
+        m_contents = nullptr;
+    }
+    /* The record but its contents */
+    const char *Data() const { return m_data; }
+    size_t Length() const { return m_len; }
+    /* The length of the contents, which follow Data() in the image */
+    uint64_t ContentsLength() const { return m_contentsLen; }
+    /* The version of the contents, or 0 if there are none */
+    uint64_t ContentsVersion() const { return m_contentsVersion; }
+    /* Write the contents to out; on failure Error() is set */
+    void StreamContents(PickleStream &out) {
+        if (m_error == 0 && m_contents) {
+            int err = m_contents(out);
+            if (err != 0)
+                Fail(err);
+        }
+    }
+    /* The errno of a field that could not be written, or 0 */
+    int Error() const { return m_error; }
+    void Fail(int err) {
+        if (m_error == 0)
+            m_error = err;
+    }
+
+    template <class T> void Varint(const T &v) {
+        PutVarint(static_cast<uint64_t>(v));
+    }
+    template <class T> void Varint(const std::atomic<T> &v) {
+        PutVarint(static_cast<uint64_t>(v.load()));
+    }
+    template <class T> void Zigzag(const T &v) {
+        PutVarint(zigzag_encode(static_cast<int64_t>(v)));
+    }
+    void Flag(bool v) {
+        char *p = Reserve(1);
+        if (p) {
+            *p = v ? 1 : 0;
+            m_len += 1;
+        }
+    }
+    void Double(double v) {
+        char *p = Reserve(sizeof(uint64_t));
+        if (p)
+            m_len = put_double(p, v) - m_data;
+    }
+    void String(const std::string &s) {
+        Blob(s.data(), s.size());
+    }
+    void Blob(const void *data, size_t len) {
+        PutVarint(len);
+        char *p = Extend(len);
+        if (p)
+            memcpy(p, data, len);
+    }
+    /* Room for n raw bytes, to be filled in by the caller, or nullptr */
+    char *Extend(size_t n) {
+        char *p = Reserve(n);
+        if (p)
+            m_len += n;
+        return p;
+    }
+    /* n bytes of contents, the last field of the record, written later
+     * by contents; version is never 0 */
+    void Contents(uint64_t n, uint64_t version, const PickleContents &contents) {
+        if (m_error == 0) {
+            m_contentsLen = n;
+            m_contentsVersion = version;
+            m_contents = contents;
+        }
+    }
+
+    template <class E, class F> void Sequence(const std::vector<E> &v, F f) {
+        Varint(v.size());
+        for (auto &e : v)
+            f(e);
+    }
+    template <class K, class V, class F> void Sequence(const std::map<K, V> &m, F f) {
+        Varint(m.size());
+        for (auto &e : m)
+            f(e.first, e.second);
+    }
+};
+
+/* PickleReader: Reads records from an image in memory.
+ *
+ * Besides the bytes, it tells File how the contents of the image are to be
+ * kept: copied (the default), referred to in a mapping of the image, or
+ * read from the image file on first access.
+ */
+class PickleReader {
+private:
+    const char *m_start;
+    const char *m_ptr;
+    const char *m_end;
+    int m_error;
+    std::shared_ptr<MappedImage> m_image;
+    std::shared_ptr<ImageFile> m_lazy;
+    off_t m_offset;
+
+    bool GetVarint(uint64_t &v) {
+        const char *p = (m_error == 0) ? get_varint(m_ptr, m_end, v) : nullptr;
+        if (p == nullptr) {
+            Fail(EINVAL);
+            return false;
+        }
+        m_ptr = p;
+        return true;
+    }
+
+public:
+    static constexpr bool kLoading = true;
+
+    /* Read [ptr, end), which is at offset in the image file */
+    PickleReader(const char *ptr, const char *end,
+                 const std::shared_ptr<MappedImage> &image = nullptr,
+                 const std::shared_ptr<ImageFile> &lazy = nullptr, off_t offset = 0) :
+    m_start(ptr), m_ptr(ptr), m_end(end), m_error(0), m_image(image),
+    m_lazy(lazy), m_offset(offset) {}
+
+    const char *Position() const { return m_ptr; }
+    /* The errno of the first field that could not be read, or 0 */
+    int Error() const { return m_error; }
+    void Fail(int err) {
+        if (m_error == 0)
+            m_error = err;
+        m_ptr = m_end;
+    }
+
+    /* If set, file contents stay in this mapping */
+    const std::shared_ptr<MappedImage> &Image() const { return m_image; }
+    /* If set, file contents are read from this image on first access */
+    const std::shared_ptr<ImageFile> &LazyImage() const { return m_lazy; }
+    /* Offset in the image file of a byte that has been read */
+    off_t ImageOffset(const char *p) const { return m_offset + (p - m_start); }
+
+    template <class T> void Varint(T &v) {
+        uint64_t x;
+        if (GetVarint(x))
+            v = static_cast<T>(x);
+    }
+    template <class T> void Varint(std::atomic<T> &v) {
+        uint64_t x;
+        if (GetVarint(x))
+            v.store(static_cast<T>(x));
+    }
+    template <class T> void Zigzag(T &v) {
+        uint64_t x;
+        if (GetVarint(x))
+            v = static_cast<T>(zigzag_decode(x));
+    }
+    void Flag(bool &v) {
+        const char *p = Extend(1);
+        if (p)
+            v = *p;
+    }
+    void Double(double &v) {
+        const char *p = Extend(sizeof(uint64_t));
+        if (p)
+            v = get_double(p);
+    }
+    void String(std::string &s) {
+        uint64_t len;
+        const char *p;
+        if (GetVarint(len) && (p = Extend(len)) != nullptr)
+            s.assign(p, len);
+    }
+    /* data is malloced */
+    void Blob(void *&data, size_t &len) {
+        uint64_t n;
+        const char *p;
+        data = nullptr;
+        len = 0;
+        if (!GetVarint(n) || (p = Extend(n)) == nullptr)
+            return;
+        data = malloc(n);
+        if (data == nullptr && n > 0) {
+            Fail(ENOMEM);
+            return;
+        }
+        memcpy(data, p, n);
+        len = n;
+    }
+    /* The next n raw bytes, or nullptr if there are not that many */
+    const char *Extend(size_t n) {
+        if (m_error != 0 || n > (size_t) (m_end - m_ptr)) {
+            Fail(EINVAL);
+            return nullptr;
+        }
+        const char *p = m_ptr;
+        m_ptr += n;
+        return p;
+    }
+
+    template <class E, class F> void Sequence(std::vector<E> &v, F f) {
+        uint64_t n;
+        v.clear();
+        /* Every element takes at least a byte */
+        if (!GetVarint(n) || n > (uint64_t) (m_end - m_ptr)) {
+            Fail(EINVAL);
+            return;
+        }
+        v.resize(n);
+        for (auto &e : v)
+            f(e);
+    }
+    template <class K, class V, class F> void Sequence(std::map<K, V> &m, F f) {
+        uint64_t n;
+        m.clear();
+        if (!GetVarint(n) || n > (uint64_t) (m_end - m_ptr)) {
+            Fail(EINVAL);
+            return;
+        }
+        for (uint64_t i = 0; i < n && m_error == 0; ++i) {
+            K key;
+            V value{};
+            f(key, value);
+            m.emplace(std::move(key), value);
+        }
+    }
+};
+
+#endif // _SERIALIZER_HPP_
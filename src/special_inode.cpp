@@ -26,6 +26,7 @@
 
 #include "inode.hpp"
 #include "special_inode.hpp"
+#include "serializer.hpp"
 
 SpecialInode::SpecialInode(enum SpecialInodeTypes type, dev_t dev) :
 m_type(type) {
@@ -50,26 +51,25 @@ int SpecialInode::ReadAndReply(fuse_req_t req, size_t size, off_t off) {
     return fuse_reply_err(req, ENOENT);
 }
 
+/* Special inode record: the inode record, then the type */
+template <class Archive>
+void SpecialInode::Serialize(Archive &ar) {
+    Inode::Serialize(ar);
+    ar.Varint(m_type);
+}
+
 size_t SpecialInode::GetPickledSize() {
-    return Inode::GetPickledSize() + sizeof(m_type);
+    PickleSizer sizer;
+    Serialize(sizer);
+    return sizer.Size();
 }
 
-size_t SpecialInode::Pickle(void* &buf) {
-    if (buf == nullptr) {
-        buf = malloc(SpecialInode::GetPickledSize());
-    }
-    if (buf == nullptr) {
-        return 0;
-    }
-    size_t offset = Inode::Pickle(buf);
-    char *ptr = (char *)buf + offset;
-    memcpy(ptr, &m_type, sizeof(m_type));
-    return offset + sizeof(m_type);
+void SpecialInode::Pickle(PickleWriter &out) {
+    Serialize(out);
 }
 
-size_t SpecialInode::Load(const void* &buf) {
-    size_t offset = Inode::Load(buf);
-    char *ptr = (char *)buf + offset;
-    memcpy(&m_type, ptr, sizeof(m_type));
-    return offset + sizeof(m_type);
+void SpecialInode::Load(PickleReader &in) {
+    Serialize(in);
+    if (in.Error() != 0)
+        ClearXAttrs();
 }
@@ -51,9 +51,10 @@ public:
 
     enum SpecialInodeTypes Type();
 
+    template <class Archive> void Serialize(Archive &ar);
     size_t GetPickledSize();
-    size_t Pickle(void* &buf);
-    size_t Load(const void* &buf);
+    void Pickle(PickleWriter &out);
+    void Load(PickleReader &in);
 
     #ifdef DUMP_TESTING
     friend void dump_SpecialInode(SpecialInode* sinode);
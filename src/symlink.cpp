@@ -27,6 +27,26 @@
 #include "util.hpp"
 #include "inode.hpp"
 #include "symlink.hpp"
+#include "serializer.hpp"
+
+/* SetLink: Take len bytes at link as the target.  Returns false if a long
+ * target cannot be allocated. */
+bool SymLink::SetLink(const char *link, size_t len) {
+    if (len < kInlineSize) {
+        memcpy(m_inline, link, len);
+        m_inline[len] = '\0';
+        m_long.reset();
+    } else {
+        char *buf = new (std::nothrow) char[len + 1];
+        if (buf == nullptr)
+            return false;
+        memcpy(buf, link, len);
+        buf[len] = '\0';
+        m_long.reset(buf);
+    }
+    m_len = len;
+    return true;
+}
 
 int SymLink::WriteAndReply(fuse_req_t req, const char *buf, size_t size, off_t off) {
     return fuse_reply_err(req, EISDIR);
@@ -39,7 +59,11 @@ int SymLink::ReadAndReply(fuse_req_t req, size_t size, off_t off) {
 void SymLink::Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid) {
     Inode::Initialize(ino, mode, nlink, gid, uid);
 
-    m_fuseEntryParam.attr.st_size = m_link.size();
+    m_fuseEntryParam.attr.st_size = m_len;
+    if (!m_long) {
+        m_fuseEntryParam.attr.st_blocks = 0;
+        return;
+    }
     m_fuseEntryParam.attr.st_blocks = m_fuseEntryParam.attr.st_size / m_fuseEntryParam.attr.st_blksize;
 
     // Add another block if the size is larger than a whole number of blocks
@@ -48,27 +72,36 @@ void SymLink::Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid,
     }
 }
 
+/* Symlink record: the inode record, then the link target, stored like a
+ * string */
+template <class Archive>
+void SymLink::Serialize(Archive &ar) {
+    Inode::Serialize(ar);
+    uint64_t len = m_len;
+    ar.Varint(len);
+    if constexpr (Archive::kLoading) {
+        const char *link = ar.Extend(len);
+        if (link != nullptr && !SetLink(link, len))
+            ar.Fail(ENOMEM);
+    } else {
+        char *link = ar.Extend(len);
+        if (link != nullptr)
+            memcpy(link, Link(), len);
+    }
+}
+
 size_t SymLink::GetPickledSize() {
-    return Inode::GetPickledSize() + m_link.size();
+    PickleSizer sizer;
+    Serialize(sizer);
+    return sizer.Size();
 }
 
-size_t SymLink::Pickle(void *&buf) {
-    if (buf == nullptr) {
-        buf = malloc(SymLink::GetPickledSize());
-    }
-    if (buf == nullptr) {
-        return 0;
-    }
-    size_t offset = Inode::Pickle(buf);
-    char *ptr = (char *)buf + offset;
-    memcpy(ptr, m_link.c_str(), m_link.size());
-    return offset + m_link.size();
+void SymLink::Pickle(PickleWriter &out) {
+    Serialize(out);
 }
 
-size_t SymLink::Load(const void *&buf) {
-    size_t offset = Inode::Load(buf);
-    const char *ptr = (const char *) buf + offset;
-    size_t linksize = m_fuseEntryParam.attr.st_size;
-    m_link = std::string(ptr, linksize);
-    return offset + linksize;
-}
\ No newline at end of file
+void SymLink::Load(PickleReader &in) {
+    Serialize(in);
+    if (in.Error() != 0)
+        ClearXAttrs();
+}
@@ -25,17 +25,31 @@
 #ifndef symlink_hpp
 #define symlink_hpp
 
+#include <memory>
+
 class SymLink : public Inode {
 private:
-    std::string m_link;
+    /* Targets shorter than kInlineSize are kept in the inode itself, like
+     * fast symlinks on ext4, and take no blocks; longer ones are
+     * allocated.  Either way the target is NUL-terminated. */
+    static constexpr size_t kInlineSize = 64;
+    size_t m_len;
+    char m_inline[kInlineSize];
+    std::unique_ptr<char[]> m_long;
+
+    bool SetLink(const char *link, size_t len);
     
 public:
-    SymLink() : m_link("") {};
-    SymLink(const std::string &link) :
-    m_link(link) {};
+    SymLink() : m_len(0), m_inline() {};
+    /* Throws std::bad_alloc if a long target cannot be allocated */
+    SymLink(const char *link) : m_len(0), m_inline() {
+        if (!SetLink(link, strlen(link)))
+            throw std::bad_alloc();
+    };
 
-    SymLink(const SymLink &sym) : Inode(sym) {
-      m_link = sym.m_link;
+    SymLink(const SymLink &sym) : Inode(sym), m_len(0), m_inline() {
+        if (!SetLink(sym.Link(), sym.m_len))
+            throw std::bad_alloc();
     }
 
     ~SymLink() {};
@@ -45,11 +59,12 @@ public:
     
     void Initialize(fuse_ino_t ino, mode_t mode, nlink_t nlink, gid_t gid, uid_t uid);
     
-    const std::string &Link() { return m_link; }
+    const char *Link() const { return m_long ? m_long.get() : m_inline; }
 
+    template <class Archive> void Serialize(Archive &ar);
     size_t GetPickledSize();
-    size_t Pickle(void* &buf);
-    size_t Load(const void* &buf);
+    void Pickle(PickleWriter &out);
+    void Load(PickleReader &in);
 
     #ifdef DUMP_TESTING
     friend void dump_SymLink(SymLink* m_link);
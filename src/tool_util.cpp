@@ -0,0 +1,69 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <mcfs/errnoname.h>
+
+#include "tool_util.hpp"
+
+void copy_stream(int from, int to) {
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(from, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        for (ssize_t done = 0; n > 0 && done < n; ) {
+            ssize_t w = write(to, buf + done, n - done);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return;
+            done += w;
+        }
+    }
+}
+
+int absolute_path(const char *path, char *buf, size_t size) {
+    if (path[0] == '/')
+        return snprintf(buf, size, "%s", path);
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+        fprintf(stderr, "Cannot get working directory: (%d:%s)\n",
+                errno, errnoname(errno));
+        exit(2);
+    }
+    return snprintf(buf, size, "%s/%s", cwd, path);
+}
+
+uint64_t parse_key(const char *arg) {
+    char *end;
+    errno = 0;
+    uint64_t key = strtoull(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || end == arg) {
+        fprintf(stderr, "Invalid key: %s\n", arg);
+        exit(1);
+    }
+    return key;
+}
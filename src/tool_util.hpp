@@ -0,0 +1,42 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TOOL_UTIL_HPP_
+#define _TOOL_UTIL_HPP_
+
+#include <cstdint>
+#include <cstddef>
+
+/* Helpers shared by the command-line tools (pkl, load, reffs-img) */
+
+/* Copy everything from one descriptor to another */
+void copy_stream(int from, int to);
+
+/* Write path to buf as an absolute path; returns its length (which may
+ * exceed size) */
+int absolute_path(const char *path, char *buf, size_t size);
+
+/* Parse a checkpoint key, exiting on anything but a decimal number */
+uint64_t parse_key(const char *arg);
+
+#endif // _TOOL_UTIL_HPP_
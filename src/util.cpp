@@ -88,6 +88,22 @@ size_t SizeStr2Number(const char *str)
         return size * unit;
 }
 
+/* option_path: Copy a path given in an option, made absolute since the
+ * file system changes its working directory when it daemonizes */
+static char *option_path(const char *value) {
+    char cwd[PATH_MAX];
+    if (value[0] != '/' && getcwd(cwd, sizeof(cwd)) != nullptr) {
+        size_t len = strnlen(cwd, PATH_MAX) + strnlen(value, OPTION_MAX) + 2;
+        char *path = new char[len];
+        snprintf(path, len, "%s/%s", cwd, value);
+        return path;
+    }
+    size_t len = strnlen(value, OPTION_MAX) + 1;
+    char *path = new char[len];
+    strncpy(path, value, len);
+    return path;
+}
+
 /* ramfs_parse_options: Parse option string provided by -o argument
  *
  * @param[in] optstr:   Option string 
@@ -100,6 +116,20 @@ size_t SizeStr2Number(const char *str)
  *              including k,m,g,t,p,e.
  *   - inodes   Inode slots of the file system. Also supports unit suffix.
  *   - subtype  Subtype name to be displayed in mount list.
+ *   - load     Image to load the file system from before mounting.
+ *   - load_lazy
+ *              Leave file contents in that image until first accessed.
+ *   - pickle_on_exit
+ *              Image to pickle the file system to when it is unmounted.
+ *   - compress_idle
+ *              Seconds after which file contents left untouched are
+ *              compressed in memory.
+ *   - spill    Directory of a file to keep file contents in once they
+ *              outgrow spill_after, with the page cache holding what is
+ *              in use.
+ *   - spill_after
+ *              Bytes of file contents to keep in memory before that
+ *              (default 0).  Supports unit suffix.
  * 
  * @return: The new string buffer containing the original option string
  *   with the parsed options excluded.
@@ -132,6 +162,34 @@ char *ramfs_parse_options(char *optstr, struct fuse_ramfs_options &opt) {
                 opt.inodes = SizeStr2Number(value);
                 printf("Custom inode slots: %zu\n", opt.inodes);
             }
+        } else if (key && strncmp(key, "load", OPTION_MAX) == 0) {
+            if (value) {
+                opt.load = option_path(value);
+                printf("Load image: %s\n", opt.load);
+            }
+        } else if (key && strncmp(key, "load_lazy", OPTION_MAX) == 0) {
+            opt.load_lazy = true;
+            printf("Elected to load lazily\n");
+        } else if (key && strncmp(key, "pickle_on_exit", OPTION_MAX) == 0) {
+            if (value) {
+                opt.pickle_on_exit = option_path(value);
+                printf("Pickle on exit: %s\n", opt.pickle_on_exit);
+            }
+        } else if (key && strncmp(key, "compress_idle", OPTION_MAX) == 0) {
+            if (value) {
+                opt.compress_idle = strtoul(value, nullptr, 10);
+                printf("Compress chunks untouched for: %zu s\n", opt.compress_idle);
+            }
+        } else if (key && strncmp(key, "spill", OPTION_MAX) == 0) {
+            if (value) {
+                opt.spill = option_path(value);
+                printf("Spill file contents to: %s\n", opt.spill);
+            }
+        } else if (key && strncmp(key, "spill_after", OPTION_MAX) == 0) {
+            if (value) {
+                opt.spill_after = SizeStr2Number(value);
+                printf("Spill after: %zu bytes\n", opt.spill_after);
+            }
         } else if (key && strncmp(key, "subtype", OPTION_MAX) == 0) {
             if (value) {
                 opt.subtype = value;
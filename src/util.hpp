@@ -25,6 +25,8 @@
 #ifndef util_hpp
 #define util_hpp
 
+#include <stdint.h>
+#include <time.h>
 #include <sys/types.h>
 #include <linux/binfmts.h>
 
@@ -46,6 +48,15 @@ struct fuse_ramfs_options {
     char *subtype;
     char *mountpoint;
     char *_optstr;
+    /* Image to load before mounting, and to pickle to on unmount */
+    char *load;
+    bool load_lazy;
+    char *pickle_on_exit;
+    /* Compress file chunks once untouched for this long; 0 never does */
+    size_t compress_idle;
+    /* Directory to keep file contents past spill_after bytes in */
+    char *spill;
+    size_t spill_after;
 };
 
 // TODO: This looks like it was required before. Perhaps Sierra now includes it.
@@ -59,6 +70,13 @@ static inline size_t round_up(size_t value, size_t unit) {
         return (value + unit - 1) / unit * unit;
 }
 
+/* A coarse CLOCK_MONOTONIC, in milliseconds */
+static inline uint64_t monotonic_ms() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static inline size_t get_nblocks(size_t size, size_t blocksize) {
         return (size + blocksize - 1) / blocksize;
 }
@@ -0,0 +1,112 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "zero_scan.hpp"
+
+static bool is_zero_scalar(const char *p, size_t len) {
+    for (; len >= 4 * sizeof(uint64_t); p += 4 * sizeof(uint64_t), len -= 4 * sizeof(uint64_t)) {
+        uint64_t w[4];
+        memcpy(w, p, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3]) != 0)
+            return false;
+    }
+    for (; len > 0; ++p, --len) {
+        if (*p != 0)
+            return false;
+    }
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static bool is_zero_sse2(const char *p, size_t len) {
+    for (; len >= 64; p += 64, len -= 64) {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *) p),
+                         _mm_loadu_si128((const __m128i *) (p + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *) (p + 32)),
+                         _mm_loadu_si128((const __m128i *) (p + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+            return false;
+    }
+    return is_zero_scalar(p, len);
+}
+
+__attribute__((target("avx2")))
+static bool is_zero_avx2(const char *p, size_t len) {
+    for (; len >= 128; p += 128, len -= 128) {
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *) p),
+                            _mm256_loadu_si256((const __m256i *) (p + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (p + 64)),
+                            _mm256_loadu_si256((const __m256i *) (p + 96))));
+        if (!_mm256_testz_si256(v, v))
+            return false;
+    }
+    return is_zero_sse2(p, len);
+}
+#endif
+
+struct ZeroScan {
+    bool (*scan)(const char *, size_t);
+    const char *name;
+};
+
+static ZeroScan pick_zero_scan() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return {is_zero_avx2, "avx2"};
+    if (__builtin_cpu_supports("sse2"))
+        return {is_zero_sse2, "sse2"};
+#endif
+    return {is_zero_scalar, "scalar"};
+}
+
+/* Picked on first use, whatever order static initializers run in */
+static const ZeroScan &zero_scan() {
+    static const ZeroScan scan = pick_zero_scan();
+    return scan;
+}
+
+bool is_zero(const void *data, size_t len) {
+    /* A non-zero first word is the common case and needs no dispatch */
+    const char *p = (const char *) data;
+    if (len >= sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        if (w != 0)
+            return false;
+    }
+    return zero_scan().scan(p, len);
+}
+
+const char *is_zero_impl() {
+    return zero_scan().name;
+}
@@ -0,0 +1,38 @@
+/*
+ * This file is part of RefFS.
+ *
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2020-2024 Wei Su
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RefFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ZERO_SCAN_HPP_
+#define _ZERO_SCAN_HPP_
+
+#include <cstddef>
+
+/* True if the len bytes at data are all zeros.
+ *
+ * Uses AVX2 or SSE2 where the CPU has them, a word at a time otherwise,
+ * and stops at the first non-zero block, so that all-zero chunks can be
+ * left as holes for about the cost of reading them. */
+bool is_zero(const void *data, size_t len);
+/* Which of those is_zero() uses: "avx2", "sse2" or "scalar" */
+const char *is_zero_impl();
+
+#endif // _ZERO_SCAN_HPP_
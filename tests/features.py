@@ -0,0 +1,402 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+#
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+# Write, read back and compare through a mounted file system: holes and
+# VERIFS_SEEK, fallocate, VERIFS_COPY_RANGE, inline files and symlinks,
+# compression of cold chunks, and spilling to a backing file.
+
+import ctypes
+import subprocess
+import struct
+import fcntl
+import glob
+import os
+import sys
+import time
+import errno
+
+mnt = 'mnt/features'
+spill_mnt = 'mnt/features-spill'
+spill_dir = os.path.abspath('mnt/features-spill-file')
+
+CHUNK = 4096
+
+# From cr.h
+def _ioc(direction, nr, size):
+    return (direction << 30) | (size << 16) | (ord('1') << 8) | (ord('1') + nr)
+
+SEEK_ARG = 'qII'
+COPY_RANGE_ARG = 'QqqQII'
+COMPRESS_ARG = 'IIQQ'
+COMPRESS_STATUS = 'IIQQQQQ'
+VERIFS_SEEK = _ioc(3, 12, struct.calcsize(SEEK_ARG))
+VERIFS_COPY_RANGE = _ioc(3, 13, struct.calcsize(COPY_RANGE_ARG))
+VERIFS_COMPRESS = _ioc(1, 14, struct.calcsize(COMPRESS_ARG))
+VERIFS_COMPRESS_STATUS = _ioc(2, 15, struct.calcsize(COMPRESS_STATUS))
+VERIFS_COPY_CLONE = 1
+VERIFS_IMAGE_ARG_VERSION = 1
+
+# From linux/falloc.h
+FALLOC_FL_KEEP_SIZE = 0x01
+FALLOC_FL_PUNCH_HOLE = 0x02
+FALLOC_FL_COLLAPSE_RANGE = 0x08
+FALLOC_FL_ZERO_RANGE = 0x10
+FALLOC_FL_INSERT_RANGE = 0x20
+
+libc = ctypes.CDLL(None, use_errno=True)
+libc.fallocate64.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int64, ctypes.c_int64]
+
+def make_sure_path_exists(path):
+    try:
+        os.makedirs(path)
+    except OSError as exception:
+        if exception.errno != errno.EEXIST:
+            raise
+
+def fail(msg):
+    sys.stderr.write(msg + '\n')
+    sys.exit(-1)
+
+def check(cond, msg):
+    if not cond:
+        fail(msg)
+
+def expect_errno(err, what, func, *args):
+    try:
+        func(*args)
+    except OSError as e:
+        if e.errno != err:
+            fail('{}: expected {} actual {}'.format(what, errno.errorcode[err],
+                                                    errno.errorcode.get(e.errno, e.errno)))
+        return
+    fail('{}: expected {}, but it succeeded'.format(what, errno.errorcode[err]))
+
+def path(name):
+    return os.path.join(mnt, name)
+
+def write_file(path, data, offset=0):
+    with open(path, 'r+b' if os.path.exists(path) else 'wb') as f:
+        f.seek(offset)
+        f.write(data)
+
+def read_file(path):
+    # Every open drops the kernel's cached pages, so this reads from RefFS
+    with open(path, 'rb') as f:
+        return f.read()
+
+def compare(path, expected):
+    data = read_file(path)
+    if data != expected:
+        at = next((i for i in range(min(len(data), len(expected)))
+                   if data[i] != expected[i]), min(len(data), len(expected)))
+        fail('{}: wrong contents at {} (size expected {} actual {})'.format(
+            path, at, len(expected), len(data)))
+
+def fallocate(path, mode, offset, length):
+    fd = os.open(path, os.O_RDWR)
+    try:
+        if libc.fallocate64(fd, mode, offset, length) != 0:
+            err = ctypes.get_errno()
+            raise OSError(err, os.strerror(err))
+    finally:
+        os.close(fd)
+
+def seek(path, offset, whence):
+    arg = bytearray(struct.pack(SEEK_ARG, offset, whence, 0))
+    with open(path, 'rb') as f:
+        fcntl.ioctl(f.fileno(), VERIFS_SEEK, arg)
+    return struct.unpack(SEEK_ARG, arg)[0]
+
+def copy_range(src, dst, src_offset, dst_offset, length, flags=0):
+    arg = bytearray(struct.pack(COPY_RANGE_ARG, os.stat(src).st_ino, src_offset,
+                                dst_offset, length, flags, 0))
+    with open(dst, 'r+b') as f:
+        fcntl.ioctl(f.fileno(), VERIFS_COPY_RANGE, arg)
+    return struct.unpack(COPY_RANGE_ARG, arg)[3]
+
+def compress(idle_ms):
+    fd = os.open(mnt, os.O_RDONLY)
+    try:
+        fcntl.ioctl(fd, VERIFS_COMPRESS,
+                    struct.pack(COMPRESS_ARG, VERIFS_IMAGE_ARG_VERSION, 0, idle_ms, 0))
+    finally:
+        os.close(fd)
+
+def compress_status():
+    fd = os.open(mnt, os.O_RDONLY)
+    try:
+        arg = bytearray(struct.calcsize(COMPRESS_STATUS))
+        fcntl.ioctl(fd, VERIFS_COMPRESS_STATUS, arg)
+    finally:
+        os.close(fd)
+    keys = ['version', 'enabled', 'idle_ms', 'chunks', 'compressed_bytes',
+            'compressed', 'decompressed']
+    return dict(zip(keys, struct.unpack(COMPRESS_STATUS, arg)))
+
+def chunks(*fills):
+    return b''.join(bytes([c]) * CHUNK for c in fills)
+
+def mount(mountpoint, options=None):
+    make_sure_path_exists(mountpoint)
+    args = ['src/fuse-cpp-ramfs']
+    if options:
+        args += ['-o', options]
+    child = subprocess.Popen(args + [mountpoint])
+    # If you write too soon, the mountpoint won't be available.
+    time.sleep(1)
+    if not os.path.ismount(mountpoint):
+        child.kill()
+        child.wait()
+        fail('{} is not mounted'.format(mountpoint))
+    return child
+
+def unmount(mountpoint, child):
+    if sys.platform == 'darwin':
+        subprocess.run(['umount', mountpoint])
+    else:
+        subprocess.run(['fusermount', '-u', mountpoint])
+    child.wait()
+
+def test_holes():
+    # Data in chunks 0 and 5 only, then a hole up to 1 GB
+    f = path('sparse')
+    write_file(f, b'a' * CHUNK)
+    write_file(f, b'b' * 100, 5 * CHUNK)
+    size = 5 * CHUNK + 100
+    compare(f, b'a' * CHUNK + bytes(4 * CHUNK) + b'b' * 100)
+    check(seek(f, 0, os.SEEK_DATA) == 0, 'SEEK_DATA from 0')
+    check(seek(f, 0, os.SEEK_HOLE) == CHUNK, 'SEEK_HOLE from 0')
+    check(seek(f, 100, os.SEEK_HOLE) == CHUNK, 'SEEK_HOLE within data')
+    check(seek(f, CHUNK, os.SEEK_DATA) == 5 * CHUNK, 'SEEK_DATA over the hole')
+    check(seek(f, 2 * CHUNK + 7, os.SEEK_HOLE) == 2 * CHUNK + 7, 'SEEK_HOLE within a hole')
+    check(seek(f, 5 * CHUNK, os.SEEK_HOLE) == size, 'SEEK_HOLE at the end')
+    expect_errno(errno.ENXIO, 'SEEK_DATA at the end', seek, f, size, os.SEEK_DATA)
+    expect_errno(errno.EINVAL, 'bad whence', seek, f, 0, os.SEEK_SET)
+
+    os.truncate(f, 1 << 30)
+    check(os.stat(f).st_size == 1 << 30, 'size after truncating up')
+    check(os.stat(f).st_blocks * 512 < 1 << 20, 'truncating up allocated the hole')
+    expect_errno(errno.ENXIO, 'SEEK_DATA past the last data', seek, f, 6 * CHUNK, os.SEEK_DATA)
+    with open(f, 'rb') as fp:
+        fp.seek(1 << 29)
+        check(fp.read(CHUNK) == bytes(CHUNK), 'a hole does not read as zeros')
+        fp.seek(5 * CHUNK)
+        check(fp.read(200) == b'b' * 100 + bytes(100), 'data before a hole')
+
+def test_fallocate():
+    f = path('falloc')
+    write_file(f, b'')
+    fallocate(f, 0, 0, 10000)
+    check(os.stat(f).st_size == 10000, 'fallocate did not extend the file')
+    compare(f, bytes(10000))
+    fallocate(f, FALLOC_FL_KEEP_SIZE, 10000, 3 * CHUNK)
+    check(os.stat(f).st_size == 10000, 'fallocate with KEEP_SIZE changed the size')
+
+    data = chunks(1, 2, 3, 4)
+    write_file(f, data)
+    os.truncate(f, len(data))
+    fallocate(f, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, CHUNK, CHUNK)
+    data = data[:CHUNK] + bytes(CHUNK) + data[2 * CHUNK:]
+    compare(f, data)
+    check(seek(f, 0, os.SEEK_HOLE) == CHUNK, 'a punched chunk is not a hole')
+    fallocate(f, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 100, 50)
+    data = data[:100] + bytes(50) + data[150:]
+    compare(f, data)
+    expect_errno(errno.EOPNOTSUPP, 'PUNCH_HOLE without KEEP_SIZE',
+                 fallocate, f, FALLOC_FL_PUNCH_HOLE, 0, CHUNK)
+    compare(f, data)
+
+    # The kernel passes ZERO_RANGE, COLLAPSE_RANGE and INSERT_RANGE on to
+    # FUSE file systems only from some version on
+    try:
+        fallocate(f, FALLOC_FL_ZERO_RANGE, 3 * CHUNK + 10, 2 * CHUNK)
+        # Past the end, so the file grows
+        data = data[:3 * CHUNK + 10] + bytes(2 * CHUNK)
+        compare(f, data)
+    except OSError as e:
+        if e.errno != errno.EOPNOTSUPP:
+            raise
+        print('ZERO_RANGE is not passed on by the kernel; skipped')
+
+    data = chunks(1, 2, 3, 4)
+    write_file(f, data)
+    os.truncate(f, len(data))
+    try:
+        fallocate(f, FALLOC_FL_COLLAPSE_RANGE, CHUNK, CHUNK)
+    except OSError as e:
+        if e.errno != errno.EOPNOTSUPP:
+            raise
+        print('COLLAPSE_RANGE and INSERT_RANGE are not passed on by the kernel; skipped')
+        return
+    data = chunks(1, 3, 4)
+    compare(f, data)
+    fallocate(f, FALLOC_FL_INSERT_RANGE, CHUNK, 2 * CHUNK)
+    data = chunks(1, 0, 0, 3, 4)
+    compare(f, data)
+    for mode, name in [(FALLOC_FL_COLLAPSE_RANGE, 'COLLAPSE_RANGE'),
+                       (FALLOC_FL_INSERT_RANGE, 'INSERT_RANGE')]:
+        expect_errno(errno.EINVAL, name + ' at an unaligned offset',
+                     fallocate, f, mode, 100, CHUNK)
+        expect_errno(errno.EINVAL, name + ' of an unaligned length',
+                     fallocate, f, mode, CHUNK, 100)
+        expect_errno(errno.EINVAL, name + ' with KEEP_SIZE',
+                     fallocate, f, mode | FALLOC_FL_KEEP_SIZE, CHUNK, CHUNK)
+    expect_errno(errno.EINVAL, 'COLLAPSE_RANGE to the end',
+                 fallocate, f, FALLOC_FL_COLLAPSE_RANGE, 3 * CHUNK, 2 * CHUNK)
+    compare(f, data)
+
+def test_copy_range():
+    src = path('copy-src')
+    dst = path('copy-dst')
+    data = os.urandom(4 * CHUNK + 123)
+    write_file(src, data)
+    write_file(dst, b'')
+
+    # Within one file, which anyone who may write it may do
+    check(copy_range(src, src, 0, len(data), 0) == len(data), 'copy to the end of the file')
+    compare(src, data + data)
+    check(copy_range(src, src, 0, 8 * CHUNK, 2 * CHUNK, VERIFS_COPY_CLONE) == 2 * CHUNK,
+          'clone within the file')
+    expect_errno(errno.EINVAL, 'clone at an unaligned offset',
+                 copy_range, src, src, 10, 10 * CHUNK, CHUNK, VERIFS_COPY_CLONE)
+    expect_errno(errno.EINVAL, 'clone of an unaligned length',
+                 copy_range, src, src, 0, 10 * CHUNK, 100, VERIFS_COPY_CLONE)
+    expect_errno(errno.EINVAL, 'copy between overlapping ranges',
+                 copy_range, src, src, 0, 100, CHUNK)
+    compare(src, (data + data)[:8 * CHUNK] + data[:2 * CHUNK])
+    os.truncate(src, len(data))
+
+    # Another file is named by inode number, which takes CAP_DAC_READ_SEARCH
+    if os.geteuid() != 0:
+        expect_errno(errno.EPERM, 'copy from another file without the capability',
+                     copy_range, src, dst, 0, 0, 0)
+        compare(dst, b'')
+        return
+    check(copy_range(src, dst, 0, 0, 0, VERIFS_COPY_CLONE) == len(data), 'clone a whole file')
+    compare(dst, data)
+    check(copy_range(src, dst, 100, len(data), 1000) == 1000, 'copy an unaligned range')
+    compare(dst, data + data[100:1100])
+    # Chunks are shared until one side writes them
+    write_file(dst, b'changed', CHUNK)
+    compare(src, data)
+    write_file(src, b'CHANGED', 0)
+    compare(dst, data[:CHUNK] + b'changed' + data[CHUNK + 7:] + data[100:1100])
+
+def test_inline():
+    f = path('tiny')
+    write_file(f, b'x' * 10)
+    compare(f, b'x' * 10)
+    # Past 64 bytes and back
+    write_file(f, b'y' * 10, 90)
+    compare(f, b'x' * 10 + bytes(80) + b'y' * 10)
+    os.truncate(f, 30)
+    compare(f, b'x' * 10 + bytes(20))
+    os.truncate(f, 70)
+    compare(f, b'x' * 10 + bytes(60))
+    os.truncate(f, 64)
+    write_file(f, b'z', 63)
+    compare(f, b'x' * 10 + bytes(53) + b'z')
+    write_file(f, b'w', 64)
+    compare(f, b'x' * 10 + bytes(53) + b'zw')
+    os.truncate(f, 5)
+    compare(f, b'x' * 5)
+    os.truncate(f, 0)
+    compare(f, b'')
+
+    for length in [1, 63, 64, 65, 1000]:
+        target = 't' * length
+        link = path('link-{}'.format(length))
+        os.symlink(target, link)
+        check(os.readlink(link) == target, 'symlink to {} bytes reads back wrong'.format(length))
+
+def test_compress():
+    f = path('cold')
+    data = b''.join('line {}\n'.format(i).encode() for i in range(100000))
+    write_file(f, data)
+    compress(100)
+    deadline = time.time() + 10
+    while compress_status()['compressed'] == 0:
+        if time.time() > deadline:
+            fail('no chunks compressed: {}'.format(compress_status()))
+        time.sleep(0.2)
+    status = compress_status()
+    check(status['enabled'] == 1 and status['idle_ms'] == 100,
+          'wrong compression status {}'.format(status))
+    check(status['chunks'] * CHUNK > status['compressed_bytes'],
+          'chunks did not get smaller: {}'.format(status))
+    compare(f, data)
+    check(compress_status()['decompressed'] > 0, 'reading did not decompress')
+    # Compressed chunks are copied on write like any others
+    write_file(f, b'new', 5 * CHUNK)
+    compare(f, data[:5 * CHUNK] + b'new' + data[5 * CHUNK + 3:])
+    compress(0)
+    check(compress_status()['enabled'] == 0, 'compression did not stop')
+    compare(f, data[:5 * CHUNK] + b'new' + data[5 * CHUNK + 3:])
+
+def spill_files(pid):
+    # The backing file is unlinked, so only the daemon's descriptors show it
+    found = []
+    for fd in glob.glob('/proc/{}/fd/*'.format(pid)):
+        try:
+            target = os.readlink(fd)
+        except OSError:
+            continue
+        if target.startswith(spill_dir + '/'):
+            found.append(target)
+    return found
+
+def test_spill(child):
+    blobs = [os.urandom(3 << 20) for _ in range(3)]
+    for i, blob in enumerate(blobs):
+        write_file(os.path.join(spill_mnt, 'big{}'.format(i)), blob)
+    check(spill_files(child.pid), 'no backing file in {}'.format(spill_dir))
+    for i, blob in enumerate(blobs):
+        compare(os.path.join(spill_mnt, 'big{}'.format(i)), blob)
+    # Freed chunks get used again
+    os.unlink(os.path.join(spill_mnt, 'big0'))
+    write_file(os.path.join(spill_mnt, 'big0'), blobs[2][::-1])
+    compare(os.path.join(spill_mnt, 'big0'), blobs[2][::-1])
+    compare(os.path.join(spill_mnt, 'big1'), blobs[1])
+
+child = mount(mnt)
+try:
+    test_holes()
+    test_fallocate()
+    test_copy_range()
+    test_inline()
+    test_compress()
+finally:
+    unmount(mnt, child)
+check(child.returncode == 0, 'fuse-cpp-ramfs exited with {}'.format(child.returncode))
+
+make_sure_path_exists(spill_dir)
+child = mount(spill_mnt, 'spill={},spill_after=1M'.format(spill_dir))
+try:
+    test_spill(child)
+finally:
+    unmount(spill_mnt, child)
+check(child.returncode == 0, 'fuse-cpp-ramfs exited with {}'.format(child.returncode))
+
+sys.exit(0)
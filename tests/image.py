@@ -0,0 +1,149 @@
+#!/usr/bin/env python
+
+#
+# This file is part of RefFS.
+#
+# Copyright (c) 2020-2024 Yifei Liu
+# Copyright (c) 2020-2024 Wei Su
+# Copyright (c) 2020-2024 Erez Zadok
+# Copyright (c) 2020-2024 Stony Brook University
+# Copyright (c) 2020-2024 The Research Foundation of SUNY
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# RefFS is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+#
+
+# Pickle a full and a delta image of a mounted file system, then check
+# offline with reffs-img that they load back to the same file system, and
+# that corrupt or truncated images are rejected with EINVAL.
+
+from subprocess import Popen, PIPE
+import subprocess
+import os
+import sys
+import time
+import errno
+
+mnt = 'mnt/reffs-img'
+imgdir = os.path.abspath('mnt/images')
+
+def make_sure_path_exists(path):
+    try:
+        os.makedirs(path)
+    except OSError as exception:
+        if exception.errno != errno.EEXIST:
+            raise
+
+def fail(msg):
+    sys.stderr.write(msg + '\n')
+    sys.exit(-1)
+
+def run(args, expect=0):
+    p = Popen(args, stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate()
+    if p.returncode < 0:
+        fail('{} killed by signal {}'.format(' '.join(args), -p.returncode))
+    if expect is not None and p.returncode != expect:
+        fail('{}: expected exit code {} actual {}\n{}'.format(
+            ' '.join(args), expect, p.returncode, stderr.decode()))
+    return p.returncode, stdout.decode(), stderr.decode()
+
+def image(name):
+    return os.path.join(imgdir, name)
+
+def write_file(path, data, offset=0):
+    with open(path, 'r+b' if os.path.exists(path) else 'wb') as f:
+        f.seek(offset)
+        f.write(data)
+
+make_sure_path_exists(mnt)
+make_sure_path_exists(imgdir)
+
+child = subprocess.Popen(['src/fuse-cpp-ramfs', mnt])
+# If you pickle too soon, the mountpoint won't be available.
+time.sleep(1)
+
+try:
+    write_file(os.path.join(mnt, 'hello'), b'hello, world\n')
+    # A hole between two runs of data
+    write_file(os.path.join(mnt, 'sparse'), b'x' * 5000)
+    write_file(os.path.join(mnt, 'sparse'), b'y' * 5000, 1 << 20)
+    os.mkdir(os.path.join(mnt, 'dir'))
+    write_file(os.path.join(mnt, 'dir', 'big'), os.urandom(3 << 20))
+    os.symlink('../hello', os.path.join(mnt, 'dir', 'link'))
+    run(['src/ckpt', mnt, '7'])
+    run(['src/pkl', mnt, image('full.img')])
+
+    write_file(os.path.join(mnt, 'hello'), b'HELLO')
+    os.unlink(os.path.join(mnt, 'sparse'))
+    write_file(os.path.join(mnt, 'dir', 'new'), b'new file\n')
+    run(['src/pkl', '-d', mnt, image('delta.img')])
+finally:
+    if sys.platform == 'darwin':
+        subprocess.run(['umount', mnt])
+    else:
+        subprocess.run(['fusermount', '-u', mnt])
+    child.wait()
+
+# Both images pass their hash check; the delta one names its base
+for name in ['full.img', 'delta.img']:
+    _, out, _ = run(['src/reffs-img', 'info', '-v', image(name)])
+    if 'hash:     ok' not in out:
+        fail('{} fails its hash check:\n{}'.format(name, out))
+    if name == 'delta.img' and 'base:     ' + image('full.img') not in out:
+        fail('{} does not name its base:\n{}'.format(name, out))
+
+# Load each image and pickle it again: the file systems must not differ
+for name in ['full.img', 'delta.img']:
+    copy = image('rewritten-' + name)
+    run(['src/reffs-img', 'rewrite', image(name), copy])
+    _, out, _ = run(['src/reffs-img', 'diff', image(name), copy])
+    if out:
+        fail('{} changed on the way through:\n{}'.format(name, out))
+run(['src/reffs-img', 'diff', '-b', '7', image('full.img')])
+
+# The delta image holds exactly the changes made after the full one
+_, out, _ = run(['src/reffs-img', 'diff', image('full.img'), image('delta.img')], 1)
+expected = ['M /: size', 'M /dir: size', '+ /dir/new', 'M /hello: contents',
+            '- /sparse']
+if sorted(out.splitlines()) != sorted(expected):
+    fail('Wrong diff\nExpected {} Actual {}'.format(expected, out.splitlines()))
+
+# File contents come back out as written, holes included
+extracted = image('sparse.out')
+if os.path.exists(extracted):
+    os.unlink(extracted)
+run(['src/reffs-img', 'extract', image('full.img'), '/sparse', extracted])
+with open(extracted, 'rb') as f:
+    data = f.read()
+if data != b'x' * 5000 + bytes((1 << 20) - 5000) + b'y' * 5000:
+    fail('Wrong contents extracted')
+
+# Damaged images fail to load with EINVAL instead of crashing
+with open(image('full.img'), 'rb') as f:
+    data = bytearray(f.read())
+damaged = image('damaged.img')
+for cut in [len(data) // 2, len(data) - 1]:
+    with open(damaged, 'wb') as f:
+        f.write(data[:cut])
+    _, _, err = run(['src/reffs-img', 'tree', damaged], 2)
+    if '({})'.format(errno.EINVAL) not in err:
+        fail('Image truncated to {} bytes: wrong error {}'.format(cut, err))
+data[len(data) // 3] ^= 0x55
+with open(damaged, 'wb') as f:
+    f.write(data)
+_, _, err = run(['src/reffs-img', 'rewrite', damaged, image('rewritten-damaged.img')], 2)
+if '({})'.format(errno.EINVAL) not in err:
+    fail('Corrupt image: wrong error {}'.format(err))
+
+sys.exit(0)